@@ -0,0 +1,428 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * alloc.cc - Heap allocators of the tools and of libgit2
+ *
+ * All allocations go through heap_alloc() and friends below: libgit2 gets
+ * them via GIT_OPT_SET_ALLOCATOR, and the global operator new covers the
+ * containers and strings of the tools. Until alloc_counting_init() or
+ * alloc_arena_init() is called, they are plain malloc() and free() plus
+ * one branch.
+ *
+ * The arena is one big reservation of address space which is handed out by
+ * bumping a pointer. Blocks are never freed, which is fine for the short
+ * runs of the tools and saves the work of freeing every single object.
+ * Only pages actually used are backed by memory.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <iostream>
+#include <new>
+
+#include <sys/mman.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <git2.h>
+#include <git2/sys/alloc.h>
+
+#include "alloc.h"
+
+/*
+ * Upper limit of the arena, at most an eighth of the memory is used. When it
+ * is full, allocations fall back to malloc(), so runs which allocate a lot of
+ * short-lived memory, like merge-base walks, do not run out of memory.
+ */
+#define ARENA_SIZE	(1ULL << 30)
+/* Alignment of malloc() on x86-64, also the size of the block header */
+#define ARENA_ALIGN	16
+
+static bool counting;
+static alloc_counters counters;
+
+static uintptr_t arena_base;
+static uintptr_t arena_end;
+static uintptr_t arena_next;
+
+static bool in_arena(void *ptr)
+{
+	uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+
+	return p >= arena_base && p < arena_end;
+}
+
+/* Returns NULL when the arena is not used or exhausted */
+static void *arena_alloc(size_t size)
+{
+	size_t total;
+	uintptr_t p;
+
+	if (arena_base == 0 || size > arena_end - arena_base)
+		return NULL;
+
+	total = (size + 2 * ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	p     = __atomic_fetch_add(&arena_next, total, __ATOMIC_RELAXED);
+	if (p + total > arena_end)
+		return NULL;
+
+	/* The size is needed by realloc() */
+	*reinterpret_cast<size_t *>(p) = size;
+
+	return reinterpret_cast<void *>(p + ARENA_ALIGN);
+}
+
+static size_t heap_size(void *ptr)
+{
+	if (in_arena(ptr))
+		return reinterpret_cast<size_t *>(ptr)[-ARENA_ALIGN / sizeof(size_t)];
+
+	return malloc_usable_size(ptr);
+}
+
+static void count_alloc(void *ptr)
+{
+	long long live, peak;
+	size_t size;
+
+	if (!counting || ptr == NULL)
+		return;
+
+	size = heap_size(ptr);
+
+	__atomic_add_fetch(&counters.count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters.bytes, size, __ATOMIC_RELAXED);
+	live = __atomic_add_fetch(&counters.live, size, __ATOMIC_RELAXED);
+
+	peak = __atomic_load_n(&counters.peak, __ATOMIC_RELAXED);
+	while (live > peak &&
+	       !__atomic_compare_exchange_n(&counters.peak, &peak, live, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void count_free(void *ptr)
+{
+	/* Arena blocks stay allocated */
+	if (!counting || ptr == NULL || in_arena(ptr))
+		return;
+
+	__atomic_sub_fetch(&counters.live, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+static void *heap_alloc(size_t size, bool zero)
+{
+	void *ptr = arena_alloc(size);
+
+	/* Arena memory is fresh from mmap() and never reused, so it is zero */
+	if (ptr == NULL)
+		ptr = zero ? calloc(1, size) : malloc(size);
+
+	count_alloc(ptr);
+
+	return ptr;
+}
+
+static void heap_free(void *ptr)
+{
+	count_free(ptr);
+
+	if (!in_arena(ptr))
+		free(ptr);
+}
+
+/* Frees ptr when size is zero, like the stdalloc of libgit2 */
+static void *heap_realloc(void *ptr, size_t size)
+{
+	void *new_ptr;
+
+	if (ptr != NULL && size == 0) {
+		heap_free(ptr);
+		return NULL;
+	}
+
+	if (ptr == NULL || in_arena(ptr) || arena_base != 0) {
+		new_ptr = heap_alloc(size, false);
+		if (new_ptr != NULL && ptr != NULL) {
+			memcpy(new_ptr, ptr, std::min(size, heap_size(ptr)));
+			heap_free(ptr);
+		}
+		return new_ptr;
+	}
+
+	/* The old block is gone after a successful realloc() */
+	count_free(ptr);
+
+	new_ptr = realloc(ptr, size);
+	if (new_ptr == NULL) {
+		/* Still owned by the caller */
+		if (counting)
+			__atomic_add_fetch(&counters.live, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	count_alloc(new_ptr);
+
+	return new_ptr;
+}
+
+/* The libgit2 allocator, modelled after its stdalloc */
+
+static void *git_heap_malloc(size_t n, const char *file, int line)
+{
+	void *ptr = heap_alloc(n, false);
+
+	if (ptr == NULL)
+		giterr_set_oom();
+
+	return ptr;
+}
+
+static void *git_heap_calloc(size_t nelem, size_t elsize, const char *file, int line)
+{
+	size_t size;
+	void *ptr;
+
+	if (__builtin_mul_overflow(nelem, elsize, &size)) {
+		giterr_set_oom();
+		return NULL;
+	}
+
+	ptr = heap_alloc(size, true);
+	if (ptr == NULL)
+		giterr_set_oom();
+
+	return ptr;
+}
+
+static char *git_heap_substrdup(const char *str, size_t n, const char *file, int line)
+{
+	char *ptr;
+
+	if (n == SIZE_MAX) {
+		giterr_set_oom();
+		return NULL;
+	}
+
+	ptr = static_cast<char *>(git_heap_malloc(n + 1, file, line));
+	if (ptr == NULL)
+		return NULL;
+
+	memcpy(ptr, str, n);
+	ptr[n] = 0;
+
+	return ptr;
+}
+
+static char *git_heap_strdup(const char *str, const char *file, int line)
+{
+	return git_heap_substrdup(str, strlen(str), file, line);
+}
+
+static char *git_heap_strndup(const char *str, size_t n, const char *file, int line)
+{
+	return git_heap_substrdup(str, strnlen(str, n), file, line);
+}
+
+static void *git_heap_realloc(void *ptr, size_t size, const char *file, int line)
+{
+	void *new_ptr = heap_realloc(ptr, size);
+
+	if (new_ptr == NULL && size != 0)
+		giterr_set_oom();
+
+	return new_ptr;
+}
+
+static void *git_heap_reallocarray(void *ptr, size_t nelem, size_t elsize,
+				   const char *file, int line)
+{
+	size_t size;
+
+	if (__builtin_mul_overflow(nelem, elsize, &size)) {
+		giterr_set_oom();
+		return NULL;
+	}
+
+	return git_heap_realloc(ptr, size, file, line);
+}
+
+static void *git_heap_mallocarray(size_t nelem, size_t elsize, const char *file, int line)
+{
+	return git_heap_reallocarray(NULL, nelem, elsize, file, line);
+}
+
+static void git_heap_free(void *ptr)
+{
+	heap_free(ptr);
+}
+
+/*
+ * Newer libgit2 versions shrank git_allocator to gmalloc, grealloc and gfree
+ * and implement the other functions on top of these. Each of the other
+ * members is only set if the git_allocator of the headers has it, so the
+ * tools build against either layout.
+ */
+#define OPTIONAL_MEMBER(member, fn)						\
+	template <typename T>							\
+	static auto set_##member(T &a, int) -> decltype(a.member = fn, void())	\
+	{									\
+		a.member = fn;							\
+	}									\
+	template <typename T>							\
+	static void set_##member(T &, long)					\
+	{									\
+	}
+
+OPTIONAL_MEMBER(gcalloc, git_heap_calloc)
+OPTIONAL_MEMBER(gstrdup, git_heap_strdup)
+OPTIONAL_MEMBER(gstrndup, git_heap_strndup)
+OPTIONAL_MEMBER(gsubstrdup, git_heap_substrdup)
+OPTIONAL_MEMBER(greallocarray, git_heap_reallocarray)
+OPTIONAL_MEMBER(gmallocarray, git_heap_mallocarray)
+
+static git_allocator heap_allocator;
+
+static int install_allocator()
+{
+	static bool installed;
+	int error;
+
+	if (installed)
+		return 0;
+
+	memset(&heap_allocator, 0, sizeof(heap_allocator));
+	heap_allocator.gmalloc  = git_heap_malloc;
+	heap_allocator.grealloc = git_heap_realloc;
+	heap_allocator.gfree    = git_heap_free;
+
+	/* The int argument prefers the overload which sets the member */
+	set_gcalloc(heap_allocator, 0);
+	set_gstrdup(heap_allocator, 0);
+	set_gstrndup(heap_allocator, 0);
+	set_gsubstrdup(heap_allocator, 0);
+	set_greallocarray(heap_allocator, 0);
+	set_gmallocarray(heap_allocator, 0);
+
+	error = git_libgit2_opts(GIT_OPT_SET_ALLOCATOR, &heap_allocator);
+	if (error < 0)
+		return error;
+
+	installed = true;
+
+	return 0;
+}
+
+int alloc_counting_init()
+{
+	int error;
+
+	error = install_allocator();
+	if (error < 0)
+		return error;
+
+	counting = true;
+
+	return 0;
+}
+
+int alloc_arena_init()
+{
+	size_t size = ARENA_SIZE;
+	long pages;
+	void *base;
+	int error;
+
+	error = install_allocator();
+	if (error < 0)
+		return error;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	if (pages > 0)
+		size = std::min<size_t>(size, (size_t)pages * sysconf(_SC_PAGESIZE) / 8);
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		/* Not fatal, everything keeps using malloc() */
+		std::cerr << "Warning: Can't reserve memory for the arena" << std::endl;
+		return 0;
+	}
+
+	/* Fewer page faults while the arena fills up */
+	madvise(base, size, MADV_HUGEPAGE);
+
+	arena_next = reinterpret_cast<uintptr_t>(base);
+	arena_end  = arena_next + size;
+	arena_base = arena_next;
+
+	return 0;
+}
+
+alloc_counters alloc_counters_get()
+{
+	alloc_counters c;
+
+	c.count = __atomic_load_n(&counters.count, __ATOMIC_RELAXED);
+	c.bytes = __atomic_load_n(&counters.bytes, __ATOMIC_RELAXED);
+	c.live  = __atomic_load_n(&counters.live, __ATOMIC_RELAXED);
+	c.peak  = __atomic_load_n(&counters.peak, __ATOMIC_RELAXED);
+
+	return c;
+}
+
+void alloc_reset_peak()
+{
+	__atomic_store_n(&counters.peak, __atomic_load_n(&counters.live, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+}
+
+void fast_exit(int status)
+{
+	std::cout.flush();
+	std::cerr.flush();
+	fflush(NULL);
+
+	_exit(status);
+}
+
+/* The allocations of the tools themselves */
+
+void *operator new(size_t size)
+{
+	void *ptr = heap_alloc(size ? size : 1, false);
+
+	if (ptr == NULL)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	heap_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	heap_free(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept
+{
+	heap_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t size) noexcept
+{
+	heap_free(ptr);
+}
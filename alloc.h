@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * alloc.h - Heap allocators of the tools and of libgit2
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __ALLOC_H
+#define __ALLOC_H
+
+/* Heap usage seen by the counting allocator, bytes are usable sizes */
+struct alloc_counters {
+	unsigned long long count;
+	unsigned long long bytes;
+	long long live;
+	long long peak;
+};
+
+/*
+ * Installs the counting allocator into libgit2 and starts counting the
+ * allocations done by operator new. Must be called right after
+ * git_libgit2_init(), before any repository is opened.
+ */
+int alloc_counting_init();
+
+/*
+ * Switches libgit2 and operator new to an arena which never frees blocks.
+ * Same constraints as alloc_counting_init(), both can be combined.
+ */
+int alloc_arena_init();
+
+alloc_counters alloc_counters_get();
+
+/* Starts tracking the peak again from the currently live bytes */
+void alloc_reset_peak();
+
+/*
+ * Flushes the output and exits without freeing anything. Only call it
+ * once all work is done, nothing is cleaned up.
+ */
+void fast_exit(int status) __attribute__((noreturn));
+
+#endif
@@ -0,0 +1,542 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * batchio.cc - Batched reads of loose refs and loose objects
+ *
+ * io_uring is used through its system calls directly, so there is no
+ * dependency on liburing. A file takes two requests, the open and the read,
+ * the close is done right away when the read completes.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <sys/types.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#if defined(__NR_io_uring_setup)
+#define HAVE_IO_URING	1
+#endif
+#endif
+#endif
+
+#include "pipeline.h"
+#include "batchio.h"
+
+/* Requests in flight, also the number of read buffers */
+#define QUEUE_DEPTH		64
+
+/* Smaller batches are read directly, setting up a ring costs more */
+#define BATCH_MIN		16
+
+#define FALLBACK_THREADS	16
+
+/* Uncompressed start of a loose commit searched for the committer line */
+#define LOOSE_HEADER_MAX	4096
+
+static int os_error(const std::string &what)
+{
+	std::string msg = what + ": " + strerror(errno);
+
+	giterr_set_str(GITERR_OS, msg.c_str());
+
+	return -1;
+}
+
+/* Returns 0 or a negative errno, like the io_uring completions */
+static int read_file(const std::string &path, char *buf, size_t size, size_t *len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, buf, size);
+	if (n < 0)
+		n = -errno;
+	close(fd);
+
+	if (n < 0)
+		return n;
+
+	*len = n;
+
+	return 0;
+}
+
+size_t file_batch::add(const std::string &path)
+{
+	paths.push_back(path);
+
+	return paths.size() - 1;
+}
+
+void file_batch::run_sync(const batch_read_cb &cb)
+{
+	std::vector<char> buf(size);
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		size_t len = 0;
+		int error;
+
+		error = read_file(paths[i], buf.data(), size, &len);
+		cb(i, error, buf.data(), len);
+	}
+}
+
+#ifdef HAVE_IO_URING
+
+/* Submission and completion rings, mapped from the kernel */
+class uring {
+	int fd;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned queued;
+
+	bool supported(const std::vector<int> &ops);
+
+public:
+	unsigned entries;
+
+	uring()
+		: fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes((io_uring_sqe *)MAP_FAILED),
+		  queued(0), entries(0)
+	{}
+
+	~uring();
+
+	/* Fails if io_uring or one of the operations is not available */
+	bool setup(unsigned depth);
+
+	void push(const struct io_uring_sqe &sqe);
+	int enter(unsigned wait);
+
+	/* Passes the completions to fn as (user_data, res) */
+	template <typename F> void reap(F fn);
+};
+
+uring::~uring()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+	if (sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_size);
+	if (fd >= 0)
+		close(fd);
+}
+
+bool uring::supported(const std::vector<int> &ops)
+{
+	std::vector<char> buf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe *probe = (struct io_uring_probe *)buf.data();
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+		return false;
+
+	for (int op : ops) {
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+			return false;
+	}
+
+	return true;
+}
+
+bool uring::setup(unsigned depth)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+
+	fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (fd < 0)
+		return false;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = std::max(sq_size, cq_size);
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		return false;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      fd, IORING_OFF_CQ_RING);
+	if (cq_ptr == MAP_FAILED)
+		return false;
+
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+
+	sq = (char *)sq_ptr;
+	cq = (char *)cq_ptr;
+
+	sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head  = (unsigned *)(cq + p.cq_off.head);
+	cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	entries  = p.sq_entries;
+
+	/* Kernels before 5.6 have neither of them */
+	return supported({ IORING_OP_OPENAT, IORING_OP_READ });
+}
+
+/* Never more requests are in flight than there are entries, so no checks */
+void uring::push(const struct io_uring_sqe &sqe)
+{
+	unsigned tail = *sq_tail;
+	unsigned idx = tail & *sq_mask;
+
+	sqes[idx]     = sqe;
+	sq_array[idx] = idx;
+
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+}
+
+/* Submits the queued requests and waits for at least wait completions */
+int uring::enter(unsigned wait)
+{
+	while (true) {
+		long ret = syscall(__NR_io_uring_enter, fd, queued, wait,
+				   IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (ret >= 0) {
+			queued -= ret;
+			return 0;
+		}
+
+		if (errno != EINTR && errno != EAGAIN)
+			return -1;
+	}
+}
+
+template <typename F> void uring::reap(F fn)
+{
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+
+		/* Handing the entry back first, fn queues the next requests */
+		__atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+		fn(data, res);
+	}
+}
+
+/* Returns 1 if io_uring can't be used */
+int file_batch::run_uring(const batch_read_cb &cb)
+{
+	struct slot {
+		size_t file;
+		int fd;		// -1 while opening
+	};
+	std::vector<slot> slots;
+	std::vector<char> buffers;
+	size_t next = 0;
+	unsigned active;
+	uring ring;
+
+	if (!ring.setup(QUEUE_DEPTH))
+		return 1;
+
+	slots.resize(std::min<size_t>(ring.entries, paths.size()));
+	buffers.resize(slots.size() * size);
+
+	auto open_next = [&](unsigned s) {
+		struct io_uring_sqe sqe;
+
+		slots[s].file = next++;
+		slots[s].fd   = -1;
+
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode     = IORING_OP_OPENAT;
+		sqe.fd         = AT_FDCWD;
+		sqe.addr       = (uintptr_t)paths[slots[s].file].c_str();
+		sqe.open_flags = O_RDONLY | O_CLOEXEC;
+		sqe.user_data  = s;
+		ring.push(sqe);
+	};
+
+	for (unsigned s = 0; s < slots.size(); s++)
+		open_next(s);
+	active = slots.size();
+
+	while (active) {
+		if (ring.enter(1) < 0)
+			return os_error("io_uring_enter failed");
+
+		ring.reap([&](uint64_t s, int res) {
+			slot &sl = slots[s];
+			char *buf = &buffers[s * size];
+
+			if (sl.fd < 0 && res >= 0) {
+				struct io_uring_sqe sqe;
+
+				sl.fd = res;
+
+				memset(&sqe, 0, sizeof(sqe));
+				sqe.opcode    = IORING_OP_READ;
+				sqe.fd        = sl.fd;
+				sqe.addr      = (uintptr_t)buf;
+				sqe.len       = size;
+				sqe.user_data = s;
+				ring.push(sqe);
+				return;
+			}
+
+			if (sl.fd >= 0)
+				close(sl.fd);
+
+			if (res < 0)
+				cb(sl.file, res, NULL, 0);
+			else
+				cb(sl.file, 0, buf, res);
+
+			if (next < paths.size())
+				open_next(s);
+			else
+				active--;
+		});
+	}
+
+	return 0;
+}
+
+#endif
+
+void file_batch::run_threads(const batch_read_cb &cb)
+{
+	struct result {
+		size_t idx;
+		int error;
+		std::string data;
+	};
+	bounded_queue<result> results(QUEUE_DEPTH);
+	std::vector<std::thread> threads;
+	std::atomic<size_t> next(0);
+	unsigned count;
+
+	count = std::min<size_t>(FALLBACK_THREADS, paths.size());
+
+	for (unsigned i = 0; i < count; i++) {
+		threads.push_back(std::thread([this, &results, &next] {
+			std::vector<char> buf(size);
+			size_t idx;
+
+			while ((idx = next++) < paths.size()) {
+				size_t len = 0;
+				result r;
+
+				r.idx   = idx;
+				r.error = read_file(paths[idx], buf.data(), size, &len);
+				r.data.assign(buf.data(), len);
+				results.push(std::move(r));
+			}
+		}));
+	}
+
+	/* Every file has exactly one result */
+	for (size_t done = 0; done < paths.size(); done++) {
+		result r;
+
+		results.pop(r);
+		cb(r.idx, r.error, r.data.data(), r.data.size());
+	}
+
+	for (auto &t : threads)
+		t.join();
+}
+
+int file_batch::run(const batch_read_cb &cb)
+{
+	if (paths.size() < BATCH_MIN) {
+		run_sync(cb);
+		return 0;
+	}
+
+#ifdef HAVE_IO_URING
+	int error = run_uring(cb);
+
+	if (error <= 0)
+		return error;
+#endif
+
+	run_threads(cb);
+
+	return 0;
+}
+
+static bool is_hex(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (!isxdigit((unsigned char)s[i]))
+			return false;
+	}
+
+	return s[len] == 0;
+}
+
+static bool oid_less(const git_oid &a, const git_oid &b)
+{
+	return git_oid_cmp(&a, &b) < 0;
+}
+
+void loose_objects::load(const std::string &objects_dir)
+{
+	struct dirent *e;
+	DIR *d;
+
+	dir = objects_dir;
+	oids.clear();
+
+	d = opendir(dir.c_str());
+	if (d == NULL)
+		return;
+
+	/* The fan-out directories, pack/ and info/ are skipped */
+	while ((e = readdir(d)) != NULL) {
+		char hex[GIT_OID_HEXSZ];
+		struct dirent *o;
+		DIR *sub;
+
+		if (!is_hex(e->d_name, 2))
+			continue;
+
+		sub = opendir((dir + e->d_name).c_str());
+		if (sub == NULL)
+			continue;
+
+		memcpy(hex, e->d_name, 2);
+
+		while ((o = readdir(sub)) != NULL) {
+			git_oid oid;
+
+			if (!is_hex(o->d_name, GIT_OID_HEXSZ - 2))
+				continue;
+
+			memcpy(hex + 2, o->d_name, GIT_OID_HEXSZ - 2);
+			if (git_oid_fromstrn(&oid, hex, GIT_OID_HEXSZ) == 0)
+				oids.push_back(oid);
+		}
+
+		closedir(sub);
+	}
+
+	closedir(d);
+
+	std::sort(oids.begin(), oids.end(), oid_less);
+}
+
+bool loose_objects::contains(const git_oid *oid) const
+{
+	return std::binary_search(oids.begin(), oids.end(), *oid, oid_less);
+}
+
+std::string loose_objects::path(const git_oid *oid) const
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	git_oid_tostr(hex, sizeof(hex), oid);
+
+	return dir + std::string(hex, 2) + "/" + (hex + 2);
+}
+
+bool loose_commit_time(const char *data, size_t len, git_time_t *out)
+{
+	char buf[LOOSE_HEADER_MAX];
+	const char *p, *end;
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK)
+		return false;
+
+	zs.next_in   = (Bytef *)data;
+	zs.avail_in  = len;
+	zs.next_out  = (Bytef *)buf;
+	zs.avail_out = sizeof(buf);
+
+	/* Only the start is needed, so the stream usually does not end here */
+	ret = inflate(&zs, Z_SYNC_FLUSH);
+	inflateEnd(&zs);
+	if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		return false;
+
+	end = buf + (sizeof(buf) - zs.avail_out);
+
+	if (end - buf < 7 || memcmp(buf, "commit ", 7) != 0)
+		return false;
+
+	p = (const char *)memchr(buf, 0, end - buf);
+	if (p == NULL)
+		return false;
+	p++;
+
+	/* Header lines up to the empty line before the message */
+	while (p < end && *p != '\n') {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		const char *gt, *num;
+		char *num_end;
+
+		if (eol == NULL)
+			return false;
+
+		if (eol - p < 10 || memcmp(p, "committer ", 10) != 0) {
+			p = eol + 1;
+			continue;
+		}
+
+		/* Like libgit2, the time follows the last '>' of the line */
+		gt = (const char *)memrchr(p, '>', eol - p);
+		if (gt == NULL)
+			return false;
+
+		num = gt + 1;
+		while (num < eol && *num == ' ')
+			num++;
+
+		*out = strtoll(num, &num_end, 10);
+
+		return num_end != num && num_end <= eol;
+	}
+
+	return false;
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * batchio.h - Batched reads of loose refs and loose objects
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __BATCHIO_H
+#define __BATCHIO_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <git2.h>
+
+/* error is 0 or a negative errno, data holds at most the size of the batch */
+typedef std::function<void(size_t idx, int error, const char *data, size_t len)> batch_read_cb;
+
+/*
+ * Reads the beginning of many small files. All reads are submitted at once
+ * with io_uring and passed to the callback as they complete, so the latency
+ * of cold caches and network filesystems is paid once per batch instead of
+ * once per file. Without io_uring, a pool of threads does the reads. The
+ * callback always runs in the thread calling run().
+ */
+class file_batch {
+	size_t size;
+	std::vector<std::string> paths;
+
+	void run_sync(const batch_read_cb &cb);
+	int run_uring(const batch_read_cb &cb);
+	void run_threads(const batch_read_cb &cb);
+
+public:
+	/* Reads at most s bytes of every file */
+	explicit file_batch(size_t s)
+		: size(s)
+	{}
+
+	/* Returns the idx of the file in the callback */
+	size_t add(const std::string &path);
+
+	int run(const batch_read_cb &cb);
+};
+
+/*
+ * Object ids of the loose objects of a repository, from the directory
+ * listings of the object directory, so only objects which are really loose
+ * are read from files.
+ */
+class loose_objects {
+	std::string dir;
+	std::vector<git_oid> oids;
+
+public:
+	void load(const std::string &objects_dir);
+
+	bool empty() const
+	{
+		return oids.empty();
+	}
+
+	bool contains(const git_oid *oid) const;
+	std::string path(const git_oid *oid) const;
+};
+
+/*
+ * Parses the committer time out of the start of a loose object file.
+ * Returns false if it is not a commit or the time is not in data.
+ */
+bool loose_commit_time(const char *data, size_t len, git_time_t *out);
+
+#endif
@@ -0,0 +1,644 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0+
+#
+# bench-check - Fail when the tools got slower than the stored baseline
+#
+# Runs every scenario several times on generated repositories, takes the
+# median and compares it against bench-baseline.json.
+#
+# Before that, the output of the tools is compared against git itself on
+# small repositories with criss-cross and octopus merges, orphan branches,
+# annotated and lightweight tags and commits sharing their dates. With
+# --check only this comparison runs.
+#
+# Copyright (C) 2021 SUSE
+#
+# Author: Joerg Roedel <jroedel@suse.de>
+
+import argparse
+import difflib
+import fnmatch
+import json
+import os
+import random
+import resource
+import statistics
+import subprocess
+import struct
+import sys
+import tempfile
+import threading
+import time
+
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'bench-baseline.json')
+
+# Bump when the generated repositories change, so cached ones are rebuilt
+REPO_VERSION = 1
+
+
+def data(s):
+    return ['data %d' % len(s), s]
+
+
+def fast_import(path, commits, branches, tag_every, seed, bitmaps=False):
+    """Create a repository with a linear history and branches forking off it"""
+    rng = random.Random(seed)
+    t = 1600000000
+    lines = ['reset refs/heads/main']
+
+    for i in range(commits):
+        lines += ['commit refs/heads/main', 'mark :%d' % (i + 1),
+                  'committer A <a@example.com> %d +0000' % (t + i * 60),
+                  ] + data('c%d' % i)
+        if i:
+            lines.append('from :%d' % i)
+        lines += ['M 644 inline f'] + data('%05d' % i)
+        if tag_every and i % tag_every == tag_every // 2:
+            lines += ['tag v%d' % i, 'from :%d' % (i + 1),
+                      'tagger A <a@example.com> %d +0000' % (t + i * 60),
+                      ] + data('v%d' % i)
+
+    for b in range(branches):
+        base = rng.randint(1, commits)
+        if b % 2:
+            # Half of the branches get a commit of their own
+            lines += ['commit refs/heads/b%06d' % b,
+                      'committer A <a@example.com> %d +0000' % (t + base * 60 + rng.randint(1, 5000)),
+                      ] + data('b') + ['from :%d' % base, 'M 644 inline g'] + data('b')
+        else:
+            lines += ['reset refs/heads/b%06d' % b, 'from :%d' % base]
+        lines.append('')
+
+    subprocess.run(['git', 'init', '-q', path], check=True)
+    subprocess.run(['git', '-C', path, 'fast-import', '--quiet'],
+                   input=('\n'.join(lines) + '\n').encode(), check=True)
+    subprocess.run(['git', '-C', path, 'symbolic-ref', 'HEAD', 'refs/heads/main'], check=True)
+    subprocess.run(['git', '-C', path, 'pack-refs', '--all'], check=True)
+    if bitmaps:
+        subprocess.run(['git', '-C', path, 'repack', '-adbq'], check=True)
+
+
+def fast_import_tricky(path, seed, bitmaps=False, midx=False):
+    """Create a small repository with the topologies that are easy to get wrong"""
+    rng = random.Random(seed)
+    t = 1600000000
+    lines = []
+    commits = []        # Marks in creation order
+    tips = {}           # Line name -> mark of its newest commit
+
+    def commit(ref, parents, date):
+        mark = len(commits) + 1
+        lines.extend(['commit %s' % ref, 'mark :%d' % mark,
+                      'committer A <a@example.com> %d +0000' % date] + data('c%d' % mark))
+        if parents:
+            lines.append('from :%d' % parents[0])
+        for p in parents[1:]:
+            lines.append('merge :%d' % p)
+        lines.extend(['M 644 inline f%d' % (mark % 7)] + data('%d' % mark))
+        commits.append(mark)
+        return mark
+
+    # Groups of three commits share their commit date
+    date = lambda: t + (len(commits) // 3) * 60
+
+    tips['main'] = commit('refs/heads/main', [], date())
+    for i in range(400):
+        r = rng.random()
+        if r < 0.45:
+            tips['main'] = commit('refs/heads/main', [tips['main']], date())
+        elif r < 0.65:
+            # A topic forking off anywhere
+            name = 'topic%d' % rng.randint(0, 9)
+            base = tips.get(name, rng.choice(commits))
+            tips[name] = commit('refs/heads/' + name, [base], date())
+        elif r < 0.75:
+            # Merge a topic into main
+            topic = rng.choice([n for n in tips if n.startswith('topic')] or ['main'])
+            if topic != 'main':
+                tips['main'] = commit('refs/heads/main', [tips['main'], tips[topic]], date())
+        elif r < 0.82:
+            # Criss-cross: two lines merging each other's previous tips
+            a = commit('refs/heads/cross-a', [rng.choice(commits)], date())
+            b = commit('refs/heads/cross-b', [a], date())
+            a2 = commit('refs/heads/cross-a', [a], date())
+            tips['cross-a'] = commit('refs/heads/cross-a', [a2, b], date())
+            tips['cross-b'] = commit('refs/heads/cross-b', [b, a2], date())
+        elif r < 0.87:
+            # Orphan history, with a root commit of its own
+            name = 'orphan%d' % rng.randint(0, 3)
+            parents = [tips[name]] if name in tips else []
+            tips[name] = commit('refs/heads/' + name, parents, date())
+        else:
+            # Octopus merge of whatever lines exist
+            others = rng.sample(sorted(tips), min(3, len(tips)))
+            tips['main'] = commit('refs/heads/main', [tips['main']] +
+                                  [tips[o] for o in others if o != 'main'], date())
+
+    # An orphan history which is never merged anywhere
+    tips['lonely'] = commit('refs/heads/lonely', [], date())
+    for i in range(3):
+        tips['lonely'] = commit('refs/heads/lonely', [tips['lonely']], date())
+
+    # Annotated tags, some sharing the tagger date, and lightweight tags
+    for i, mark in enumerate(rng.sample(commits, 40)):
+        lines.extend(['tag v%d.%d' % (i // 10, i % 10), 'from :%d' % mark,
+                      'tagger A <a@example.com> %d +0000' % (t + (i // 4) * 600)] + data('v%d' % i))
+    for i, mark in enumerate(rng.sample(commits, 20)):
+        lines.extend(['reset refs/tags/lw%d' % i, 'from :%d' % mark, ''])
+
+    # Many branches share their tip, names sort differently as refs and short
+    names = ['a-b', 'a/b', 'a.b', 'a0', 'Z', 'z/y/x', 'main2', 'topic', 'x-1', 'x10', 'x2']
+    for i in range(150):
+        name = names[i] if i < len(names) else 'b%03d' % i
+        lines.extend(['reset refs/heads/%s' % name, 'from :%d' % rng.choice(commits), ''])
+    for i in range(30):
+        lines.extend(['reset refs/remotes/origin/r%02d' % i, 'from :%d' % rng.choice(commits), ''])
+    for name, mark in tips.items():
+        lines.extend(['reset refs/heads/%s' % name, 'from :%d' % mark, ''])
+
+    subprocess.run(['git', 'init', '-q', path], check=True)
+    subprocess.run(['git', '-C', path, 'fast-import', '--quiet'],
+                   input=('\n'.join(lines) + '\n').encode(), check=True)
+    subprocess.run(['git', '-C', path, 'symbolic-ref', 'HEAD', 'refs/heads/main'], check=True)
+    subprocess.run(['git', '-C', path, 'pack-refs', '--all'], check=True)
+    if bitmaps:
+        subprocess.run(['git', '-C', path, 'repack', '-adbq'], check=True)
+    if midx:
+        # Both a pack and a multi-pack bitmap, the latter sorts first
+        subprocess.run(['git', '-C', path, 'repack', '-adbq'], check=True)
+        subprocess.run(['git', '-C', path, 'multi-pack-index', 'write', '--bitmap'], check=True)
+
+
+REPOS = {
+    'branches-10k': dict(commits=5000, branches=10000, tag_every=100, seed=1),
+    'refs-50k':     dict(commits=2000, branches=50000, tag_every=0, seed=2),
+    'bitmap-50k':   dict(commits=2000, branches=50000, tag_every=0, seed=2, bitmaps=True),
+}
+
+
+def repo(args, name):
+    path = os.path.join(args.repo_dir, '%s-v%d' % (name, REPO_VERSION))
+    if not os.path.isdir(path):
+        print('Generating %s repository...' % name, file=sys.stderr)
+        fast_import(path, **REPOS[name])
+    return path
+
+
+def tool(args, name):
+    return os.path.join(args.bin_dir, name)
+
+
+def drop_cache(path):
+    """Drops the files below path from the page cache, where nobody maps them"""
+    for dirpath, _, files in os.walk(path):
+        for name in files:
+            fd = os.open(os.path.join(dirpath, name), os.O_RDONLY)
+            try:
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+            finally:
+                os.close(fd)
+
+
+def scenarios(args):
+    """Yields (name, function returning the samples of one run as {key: (value, unit)})"""
+
+    def run(cmd, cwd, cold=None):
+        def once():
+            if cold:
+                drop_cache(cold)
+            faults = resource.getrusage(resource.RUSAGE_CHILDREN).ru_minflt
+            start = time.perf_counter()
+            subprocess.run(cmd, cwd=cwd, stdout=subprocess.DEVNULL, check=True)
+            end = time.perf_counter()
+            faults = resource.getrusage(resource.RUSAGE_CHILDREN).ru_minflt - faults
+            return {None: (end - start, 's'), 'faults': (faults, 'faults')}
+        return once
+
+    r10k = repo(args, 'branches-10k')
+    r50k = repo(args, 'refs-50k')
+    b50k = repo(args, 'bitmap-50k')
+
+    yield ('git-recent/10k', run([tool(args, 'git-recent'), '--repo', r10k], None))
+    # Without root, only the objects can be dropped from the page cache
+    yield ('git-recent-cold/10k', run([tool(args, 'git-recent'), '--repo', r10k], None,
+                                      cold=os.path.join(r10k, '.git', 'objects')))
+    yield ('git-recent-arena/10k', run([tool(args, 'git-recent'), '--arena', '--repo', r10k], None))
+    yield ('git-recent-d/10k', run([tool(args, 'git-recent'), '-d', '--no-index', '--repo', r10k], None))
+    # All but the first run find the branches in the describe index
+    yield ('git-recent-d-index/10k', run([tool(args, 'git-recent'), '-d', '--repo', r10k], None))
+    yield ('git-ff-list/50k', run([tool(args, 'git-ff'), '--list', 'main'], r50k))
+    yield ('git-ff-list-bitmap/50k', run([tool(args, 'git-ff'), '--list', '--counts', 'main'], b50k))
+
+    def micro():
+        out = subprocess.run([tool(args, 'git-tools-bench'), '--max', str(args.micro_max)],
+                             stdout=subprocess.PIPE, check=True, text=True).stdout
+        samples = {}
+        for line in out.splitlines()[1:]:
+            name, refs, ns, allocs = line.split()
+            samples['%s/%s' % (name, refs)] = (float(ns), 'ns/op')
+        return samples
+
+    yield ('micro', micro)
+
+
+def measure(args):
+    results = {}
+
+    for name, fn in scenarios(args):
+        if args.scenario and not any(fnmatch.fnmatch(name, p) for p in args.scenario):
+            continue
+
+        samples = {}
+        units = {}
+        for _ in range(args.runs):
+            for sub, (value, unit) in fn().items():
+                key = name if sub is None else '%s/%s' % (name, sub)
+                samples.setdefault(key, []).append(value)
+                units[key] = unit
+
+        for key, values in samples.items():
+            results[key] = {
+                'unit': units[key],
+                'median': statistics.median(values),
+                'stdev': statistics.stdev(values) if len(values) > 1 else 0.0,
+            }
+
+    return results
+
+
+def fmt(value, unit):
+    return '%.3f%s' % (value, unit) if unit == 's' else '%.1f %s' % (value, unit)
+
+
+def compare(baseline, results, threshold):
+    failed = False
+    rows = [('scenario', 'baseline', 'current', 'stdev', 'change', '')]
+
+    for key in sorted(set(baseline) | set(results)):
+        if key not in results:
+            rows.append((key, fmt(baseline[key]['median'], baseline[key]['unit']),
+                         '-', '-', '-', 'missing'))
+            continue
+
+        # A scenario nobody recorded would never be gated
+        r = results[key]
+        if key not in baseline:
+            rows.append((key, '-', fmt(r['median'], r['unit']),
+                         fmt(r['stdev'], r['unit']), '-', 'NO BASELINE'))
+            failed = True
+            continue
+
+        b = baseline[key]
+        change = (r['median'] - b['median']) * 100.0 / b['median'] if b['median'] else 0.0
+        status = 'ok'
+        if change > threshold:
+            status = 'REGRESSION'
+            failed = True
+        elif change < -threshold:
+            status = 'faster'
+
+        rows.append((key, fmt(b['median'], b['unit']), fmt(r['median'], r['unit']),
+                     fmt(r['stdev'], r['unit']), '%+.1f%%' % change, status))
+
+    widths = [max(len(row[i]) for row in rows) for i in range(len(rows[0]))]
+    for row in rows:
+        print('  '.join(col.ljust(widths[i]) if i == 0 else col.rjust(widths[i])
+                        for i, col in enumerate(row)).rstrip())
+
+    return failed
+
+
+# Repositories the tools are checked against git on, generated for every check
+CHECK_REPOS = {
+    'tricky-1': dict(seed=1),
+    'tricky-2': dict(seed=2, bitmaps=True),
+    'tricky-3': dict(seed=3, midx=True),
+}
+
+DESCRIBE_OPTIONS = [[], ['--tags'], ['--first-parent'], ['--long'], ['--tags', '--long'],
+                    ['--match=v1.*'], ['--exclude=v0.*'], ['--candidates=2']]
+
+
+def git(path, *cmd, check=True):
+    return subprocess.run(['git', '-C', path] + list(cmd), stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL, check=check, text=True)
+
+
+def lines(cmd, cwd=None):
+    return subprocess.run(cmd, cwd=cwd, stdout=subprocess.PIPE, check=True,
+                          text=True).stdout.splitlines()
+
+
+def timed(fn):
+    start = time.perf_counter()
+    out = fn()
+    return out, time.perf_counter() - start
+
+
+def order_checks(args, path):
+    """Yields (case, tool function, git function), both returning the lines to compare"""
+    recent = [tool(args, 'git-recent'), '--repo', path, '-a']
+    for_each_ref = ['git', '-C', path, 'for-each-ref', '--sort=-committerdate']
+    refs = ['refs/heads', 'refs/remotes']
+    f = '%(refname) %(objectname) %(committerdate:unix)'
+
+    yield ('for-each-ref', lambda: lines(recent + ['--format', f]),
+           lambda: lines(for_each_ref + ['--format', f] + refs))
+    yield ('for-each-ref short', lambda: lines(recent + ['-s']),
+           lambda: lines(for_each_ref + ['--format=%(refname:short)'] + refs))
+
+
+def describe_checks(args, path, opts, index=False, case=None):
+    """git-recent -d against git describe of every branch"""
+    recent = [tool(args, 'git-recent'), '--repo', path, '-d'] + opts
+    if not index:
+        recent.append('--no-index')
+
+    def run_tool():
+        # Branches without description end in a blank
+        return sorted(line.rstrip() for line in lines(recent + ['--format', '%(refname) %(describe)']))
+
+    def run_git():
+        # git-recent prints the tag only unless --long, with 12 digit ids
+        git_opts = opts + (['--abbrev=12'] if '--long' in opts else ['--abbrev=0'])
+        result = []
+        for ref in git(path, 'for-each-ref', '--format=%(refname)', 'refs/heads').stdout.split():
+            r = git(path, 'describe', *git_opts, ref, check=False)
+            result.append(('%s %s' % (ref, r.stdout.strip())).rstrip())
+        return sorted(result)
+
+    yield (case or ' '.join(['describe'] + opts), run_tool, run_git)
+
+
+def list_checks(args, path, target):
+    """git-ff --list --counts against git merge-base --is-ancestor and rev-list --count"""
+
+    def run_tool():
+        result = []
+        for line in lines([tool(args, 'git-ff'), '--list', '--counts', target], cwd=path):
+            name, rest = line[2:].split(None, 1)
+            ff = not rest.startswith('non-fast-forward')
+            ahead = behind = 0
+            if '(' in rest:
+                for count in rest[rest.index('(') + 1:-1].split(', '):
+                    n, what = count.split()
+                    if what == 'ahead':
+                        ahead = int(n)
+                    else:
+                        behind = int(n)
+            result.append('%s %s %d %d' % (name, ff, ahead, behind))
+        return result
+
+    def run_git():
+        result = []
+        for name in git(path, 'for-each-ref', '--format=%(refname:short)', 'refs/heads').stdout.split():
+            ff = git(path, 'merge-base', '--is-ancestor', name, target, check=False).returncode == 0
+            ahead, behind = git(path, 'rev-list', '--left-right', '--count',
+                                '%s...%s' % (name, target)).stdout.split()
+            result.append('%s %s %s %s' % (name, ff, ahead, behind))
+        return result
+
+    yield ('list %s' % target, run_tool, run_git)
+
+
+def grow(path):
+    """Add commits on top of some branches and a tag, as happens between two runs"""
+    refs = git(path, 'for-each-ref', '--format=%(refname)', 'refs/heads').stdout.split()
+    env = dict(os.environ, GIT_AUTHOR_NAME='A', GIT_AUTHOR_EMAIL='a@example.com',
+               GIT_COMMITTER_NAME='A', GIT_COMMITTER_EMAIL='a@example.com',
+               GIT_AUTHOR_DATE='1700000000 +0000', GIT_COMMITTER_DATE='1700000000 +0000')
+
+    for i, ref in enumerate(refs[::7]):
+        tip = git(path, 'rev-parse', ref).stdout.strip()
+        tree = git(path, 'rev-parse', ref + '^{tree}').stdout.strip()
+        for _ in range(i % 3 + 1):
+            tip = subprocess.run(['git', '-C', path, 'commit-tree', tree, '-p', tip, '-m', 'grow'],
+                                 env=env, stdout=subprocess.PIPE, check=True, text=True).stdout.strip()
+        git(path, 'update-ref', ref, tip)
+        if i == 3:
+            subprocess.run(['git', '-C', path, 'tag', '-a', '-m', 'new', 'v9.0', tip],
+                           env=env, check=True)
+
+
+def serve_checks(args, path):
+    """Descriptions sent by git-recent --serve for new branches and tags, and the index it writes"""
+    recent = tool(args, 'git-recent')
+    index = os.path.join(path, '.git', 'git-tools', 'describe-index')
+    tags = [t for t in git(path, 'for-each-ref', '--format=%(objecttype) %(refname:short)',
+                          'refs/tags').stdout.splitlines() if t.startswith('tag ')]
+    new_tag = 'v9.9'
+
+    def read_index(oid=None):
+        """Checks the index like git-recent reads it, and that it has a result for oid"""
+        with open(index, 'rb') as f:
+            data = f.read()
+        _, _, _, _, num_tags, num_entries, names_size, _ = struct.unpack_from('=4s7I', data)
+        entries = 32 + num_tags * 40 + names_size
+        if not num_tags or len(data) != entries + num_entries * 28:
+            return False
+        found = oid is None
+        for i in range(num_entries):
+            tag = struct.unpack_from('=I', data, entries + i * 28 + 20)[0]
+            if tag != 0xffffffff and tag >= num_tags:
+                return False
+            found = found or data[entries + i * 28:entries + i * 28 + 20] == bytes.fromhex(oid)
+        return found
+
+    def run_tool():
+        result = []
+        lines([recent, '--repo', path, '-d'])
+        serve = subprocess.Popen([recent, '--repo', path, '--serve', '-d'],
+                                 stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        sub = None
+        try:
+            sock = os.path.join(path, '.git', 'git-tools', 'recent.sock')
+            while not os.path.exists(sock) and serve.poll() is None:
+                time.sleep(0.01)
+            sub = subprocess.Popen([recent, '--repo', path, '--subscribe'],
+                                   stdout=subprocess.PIPE, text=True)
+            # A service which stops sending fails the check instead of hanging it
+            timer = threading.Timer(60, sub.kill)
+            timer.start()
+
+            def described(refs):
+                got = {}
+                for line in sub.stdout if refs else []:
+                    event = json.loads(line)
+                    if event['event'] == 'described' and event['ref'] in refs:
+                        got[event['ref']] = event['describe']
+                        if len(got) == len(refs):
+                            break
+                return got
+
+            # Branches described before are sent with their description
+            pending = set()
+            for line in sub.stdout:
+                event = json.loads(line)
+                if event['event'] == 'synced':
+                    break
+                if 'describe' not in event:
+                    pending.add(event['ref'])
+            described(pending)
+
+            # Branches on tagged commits, described by the index or from their parents
+            refs = set()
+            for t in tags:
+                name = t.split()[1]
+                git(path, 'update-ref', 'refs/heads/serve/' + name, name + '^{commit}')
+                refs.add('refs/heads/serve/' + name)
+            got = described(refs)
+            result.append('index: %s' % ('valid' if read_index() else 'invalid'))
+
+            # A new tag on a new commit, so no other description changes
+            env = dict(os.environ, GIT_AUTHOR_NAME='A', GIT_AUTHOR_EMAIL='a@example.com',
+                       GIT_COMMITTER_NAME='A', GIT_COMMITTER_EMAIL='a@example.com')
+            base = tags[0].split()[1] + '^{commit}'
+            commit = subprocess.run(['git', '-C', path, 'commit-tree', base + '^{tree}', '-p', base,
+                                     '-m', 'new'], env=env, stdout=subprocess.PIPE, check=True,
+                                    text=True).stdout.strip()
+            subprocess.run(['git', '-C', path, 'tag', '-a', '-m', 'new', new_tag, commit],
+                           env=env, check=True)
+            git(path, 'update-ref', 'refs/heads/serve/' + new_tag, commit)
+            got.update(described({'refs/heads/serve/' + new_tag}))
+            timer.cancel()
+
+            # Saved with the new tag once all branches are described again
+            deadline = time.time() + 10
+            while not read_index(commit) and time.time() < deadline:
+                time.sleep(0.05)
+            result.append('index: %s' % ('valid' if read_index(commit) else 'invalid'))
+
+            result.extend(sorted('%s %s' % (ref, desc) for ref, desc in got.items()))
+        finally:
+            if sub:
+                sub.kill()
+                sub.wait()
+            serve.terminate()
+            serve.wait()
+        return result
+
+    def run_git():
+        refs = git(path, 'for-each-ref', '--format=%(refname)', 'refs/heads/serve').stdout.split()
+        result = ['index: valid', 'index: valid']
+        result.extend(sorted('%s %s' % (ref, git(path, 'describe', '--abbrev=0', ref).stdout.strip())
+                             for ref in refs))
+        return result
+
+    yield ('describe (serve)', run_tool, run_git)
+
+
+def check(args):
+    """Compares the output of the tools against git, returns True on mismatches"""
+    failed = False
+    rows = [('repository', 'case', 'tool', 'git', 'speedup', '')]
+
+    with tempfile.TemporaryDirectory(prefix='git-tools-check-') as tmp:
+        for repo_name, params in sorted(CHECK_REPOS.items()):
+            path = os.path.join(tmp, repo_name)
+            fast_import_tricky(path, **params)
+
+            def cases():
+                yield from order_checks(args, path)
+                for opts in DESCRIBE_OPTIONS:
+                    yield from describe_checks(args, path, opts)
+                for target in ['main', 'cross-a', 'lonely']:
+                    yield from list_checks(args, path, target)
+                # Fill the describe index, then describe from it after the history grew
+                yield from describe_checks(args, path, [], True, 'describe (index)')
+                grow(path)
+                yield from describe_checks(args, path, [], True, 'describe (index, grown)')
+                yield from describe_checks(args, path, [], False, 'describe (grown)')
+                yield from serve_checks(args, path)
+
+            for case, run_tool, run_git in cases():
+                try:
+                    got, tool_time = timed(run_tool)
+                except subprocess.CalledProcessError as e:
+                    got, tool_time = ['exited with %d' % e.returncode], 0.0
+                want, git_time = timed(run_git)
+
+                status = 'ok'
+                if got != want:
+                    status = 'MISMATCH'
+                    failed = True
+                    diff = list(difflib.unified_diff(want, got, 'git', 'tool', lineterm='', n=0))
+                    print('%s: %s differs from git:' % (repo_name, case), file=sys.stderr)
+                    for line in diff[:20]:
+                        print('  ' + line, file=sys.stderr)
+
+                ratio = '%.1fx' % (git_time / tool_time) if tool_time else '-'
+                rows.append((repo_name, case, fmt(tool_time, 's'), fmt(git_time, 's'), ratio, status))
+
+    widths = [max(len(row[i]) for row in rows) for i in range(len(rows[0]))]
+    for row in rows:
+        print('  '.join(col.ljust(widths[i]) if i < 2 else col.rjust(widths[i])
+                        for i, col in enumerate(row)).rstrip())
+
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark regression gate for git-tools')
+    parser.add_argument('--runs', type=int, default=5, help='runs per scenario (default 5)')
+    parser.add_argument('--threshold', type=float, default=10.0,
+                        help='allowed slowdown of the median in per cent (default 10)')
+    parser.add_argument('--update', action='store_true', help='store the results as new baseline')
+    parser.add_argument('--baseline', default=BASELINE, help='baseline file')
+    parser.add_argument('--bin-dir', default=os.path.dirname(BASELINE),
+                        help='directory with the tool binaries')
+    parser.add_argument('--repo-dir', default=os.path.join(os.environ.get('TMPDIR', '/tmp'),
+                                                           'git-tools-bench-repos'),
+                        help='where generated repositories are cached')
+    parser.add_argument('--micro-max', type=int, default=100000,
+                        help='largest ref count for git-tools-bench (default 100000)')
+    parser.add_argument('--scenario', action='append', metavar='GLOB',
+                        help='only run the scenarios matching GLOB, with --update only '
+                             'their baseline is replaced')
+    parser.add_argument('--check', action='store_true',
+                        help='only compare the output of the tools against git')
+    args = parser.parse_args()
+
+    # Being fast is worth nothing when the answers are wrong
+    if check(args):
+        print('Output differs from git', file=sys.stderr)
+        return 1
+
+    if args.check:
+        return 0
+
+    os.makedirs(args.repo_dir, exist_ok=True)
+
+    results = measure(args)
+
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)['scenarios']
+    except FileNotFoundError:
+        if not args.update:
+            print('No baseline, create one with --update', file=sys.stderr)
+            return 1
+        baseline = {}
+
+    if args.update:
+        # Without --scenario everything was measured, stale entries go away
+        if not args.scenario:
+            baseline = {}
+        baseline.update(results)
+        with open(args.baseline, 'w') as f:
+            json.dump({'scenarios': baseline}, f, indent=1, sort_keys=True)
+            f.write('\n')
+        print('Baseline written to %s' % args.baseline)
+        return 0
+
+    if args.scenario:
+        baseline = {k: v for k, v in baseline.items() if k in results}
+
+    if compare(baseline, results, args.threshold):
+        print('Benchmarks regressed by more than %.1f%%' % args.threshold, file=sys.stderr)
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
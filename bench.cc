@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * git-tools-bench - Micro-benchmarks for the per-ref helpers of the tools
+ *
+ * Runs every helper on synthetic inputs of growing size and reports the
+ * time and the number of heap allocations per operation.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <git2.h>
+
+#include "version.h"
+#include "branch.h"
+#include "refs.h"
+
+/* Every benchmark runs at least this long per input size */
+#define MIN_RUNTIME_NS	200000000ULL
+
+/*
+ * Count all heap allocations, including those of libgit2, by wrapping the
+ * glibc allocator.
+ */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+static unsigned long long allocations;
+
+extern "C" void *malloc(size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/* Discards everything, so only the formatting is measured */
+class null_buf : public std::streambuf {
+protected:
+	int overflow(int c)
+	{
+		return c;
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize n)
+	{
+		return n;
+	}
+};
+
+struct measurement {
+	unsigned long long ns;
+	unsigned long long allocs;
+	unsigned long long ops;
+};
+
+/* Runs fn, which does ops operations, once and adds the cost to m */
+template <typename F>
+static void measure_once(measurement &m, unsigned long long ops, F fn)
+{
+	unsigned long long a = allocations;
+	auto start = std::chrono::steady_clock::now();
+
+	fn();
+
+	auto end = std::chrono::steady_clock::now();
+
+	m.ns     += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	m.allocs += allocations - a;
+	m.ops    += ops;
+}
+
+/* Runs fn, which does ops operations per call, until enough time passed */
+template <typename F>
+static measurement measure(unsigned long long ops, F fn)
+{
+	measurement m = { 0, 0, 0 };
+
+	while (m.ns < MIN_RUNTIME_NS)
+		measure_once(m, ops, fn);
+
+	return m;
+}
+
+static void report(const char *name, size_t n, const measurement &m)
+{
+	std::cout << std::left << std::setw(16) << name
+		  << std::right << std::setw(10) << n
+		  << std::fixed << std::setprecision(1)
+		  << std::setw(12) << (double)m.ns / m.ops
+		  << std::setprecision(2)
+		  << std::setw(12) << (double)m.allocs / m.ops << std::endl;
+}
+
+static std::vector<std::string> ref_names(size_t n)
+{
+	static const char *namespaces[] = {
+		"refs/heads/", "refs/remotes/origin/", "refs/remotes/upstream/", "refs/tags/",
+	};
+	std::vector<std::string> names;
+	char buf[64];
+
+	for (size_t i = 0; i < n; i++) {
+		snprintf(buf, sizeof(buf), "%sbranch-%07zu", namespaces[i % 4], i);
+		names.push_back(buf);
+	}
+
+	return names;
+}
+
+static std::vector<branch> branches(size_t n, std::mt19937 &rng)
+{
+	std::vector<std::string> names = ref_names(n);
+	std::vector<branch> b;
+	git_oid oid;
+
+	memset(&oid, 0, sizeof(oid));
+
+	/* Few distinct dates, so the tie-breaker gets exercised too */
+	for (size_t i = 0; i < n; i++)
+		b.push_back(branch(names[i], names[i].substr(11), i == 0,
+				   1600000000 + rng() % (n / 4 + 1), oid));
+
+	return b;
+}
+
+static void bench_is_prefix(size_t n)
+{
+	std::vector<std::string> names = ref_names(n);
+	volatile size_t matches = 0;
+
+	report("is_prefix", n, measure(n, [&] {
+		for (auto &name : names)
+			matches += is_prefix(name, "refs/remotes/origin/");
+	}));
+}
+
+static void bench_sort(size_t n, std::mt19937 &rng)
+{
+	std::vector<branch> input = branches(n, rng), b;
+	measurement m = { 0, 0, 0 };
+
+	/* Copying the unsorted input must not be measured */
+	while (m.ns < MIN_RUNTIME_NS) {
+		b = input;
+
+		measure_once(m, n, [&] {
+			std::sort(b.begin(), b.end());
+		});
+	}
+
+	report("branch_sort", n, m);
+}
+
+static void bench_print(size_t n, std::mt19937 &rng)
+{
+	std::vector<branch> b = branches(n, rng);
+	std::string::size_type max_len = 0;
+	null_buf buf;
+	std::ostream out(&buf);
+
+	for (auto &br : b) {
+		br.describe = "v5.10-rc1-123-g0123456789ab";
+		max_len = std::max(max_len, br.name.size());
+	}
+
+	report("print_branch", n, measure(n, [&] {
+		for (auto &br : b)
+			print_branch(out, br, max_len, "based on ");
+	}));
+}
+
+/* Creates a bare repository with n refs in packed-refs */
+static std::string create_repo(size_t n, git_oid *commit_oid)
+{
+	char dir[] = "/tmp/git-tools-bench-XXXXXX";
+	git_repository *repo;
+	git_oid tree, tag;
+	std::string data;
+	char hex[3][41];
+	git_odb *odb;
+
+	if (mkdtemp(dir) == NULL || git_repository_init(&repo, dir, 1) < 0 ||
+	    git_repository_odb(&odb, repo) < 0)
+		return "";
+
+	git_odb_write(&tree, odb, "", 0, GIT_OBJ_TREE);
+	git_oid_tostr(hex[0], sizeof(hex[0]), &tree);
+
+	data = std::string("tree ") + hex[0] + "\n" +
+	       "author A <a@example.com> 1600000000 +0000\n" +
+	       "committer A <a@example.com> 1600000000 +0000\n\nbench\n";
+	git_odb_write(commit_oid, odb, data.c_str(), data.size(), GIT_OBJ_COMMIT);
+	git_oid_tostr(hex[1], sizeof(hex[1]), commit_oid);
+
+	data = std::string("object ") + hex[1] + "\ntype commit\ntag bench\n" +
+	       "tagger A <a@example.com> 1600000000 +0000\n\nbench\n";
+	git_odb_write(&tag, odb, data.c_str(), data.size(), GIT_OBJ_TAG);
+	git_oid_tostr(hex[2], sizeof(hex[2]), &tag);
+
+	git_odb_free(odb);
+	git_repository_free(repo);
+
+	std::vector<std::string> names = ref_names(n);
+	std::sort(names.begin(), names.end());
+
+	std::ofstream packed(std::string(dir) + "/packed-refs");
+	packed << "# pack-refs with: peeled fully-peeled sorted \n";
+	for (auto &name : names) {
+		if (name.compare(0, 10, "refs/tags/") == 0)
+			packed << hex[2] << ' ' << name << "\n^" << hex[1] << "\n";
+		else
+			packed << hex[1] << ' ' << name << "\n";
+	}
+
+	return dir;
+}
+
+static void bench_lookup_target(size_t n, std::mt19937 &rng)
+{
+	std::vector<std::string> names = ref_names(n), queries;
+	git_repository *repo;
+	std::string path;
+	git_oid commit;
+	char hex[41];
+	ref_store refs;
+
+	path = create_repo(n, &commit);
+	if (path.empty() || git_repository_open(&repo, path.c_str()) < 0) {
+		std::cerr << "Can't create benchmark repository" << std::endl;
+		return;
+	}
+
+	refs.open(repo);
+
+	/* Names as given on the command line of git-ff */
+	git_oid_tostr(hex, sizeof(hex), &commit);
+	for (size_t i = 0; i < std::min<size_t>(n, 10000); i++) {
+		const std::string &name = names[rng() % n];
+
+		if (i % 8 == 0)
+			queries.push_back(hex);
+		else if (name.compare(0, 13, "refs/remotes/") == 0)
+			queries.push_back(name.substr(13));
+		else
+			queries.push_back(name.substr(name.find('/', 5) + 1));
+	}
+
+	report("lookup_target", n, measure(queries.size(), [&] {
+		git_oid oid;
+
+		for (auto &q : queries) {
+			if (!lookup_target(q.c_str(), refs, &oid))
+				std::cerr << "Can't resolve " << q << std::endl;
+		}
+	}));
+
+	git_repository_free(repo);
+
+	if (system(("rm -rf " + path).c_str()) != 0)
+		std::cerr << "Can't remove " << path << std::endl;
+}
+
+static void usage(const char *cmd)
+{
+	std::cout << "Usage: " << cmd << " [options] [benchmarks...]" << std::endl;
+	std::cout << "Options:" << std::endl;
+	std::cout << "  --help, -h       Print this help message" << std::endl;
+	std::cout << "  --version        Print version and exit" << std::endl;
+	std::cout << "  --max, -m <n>    Largest number of refs to run with (default 1000000)" << std::endl;
+	std::cout << "Benchmarks: is_prefix branch_sort print_branch lookup_target" << std::endl;
+}
+
+enum {
+	OPTION_HELP,
+	OPTION_VERSION,
+	OPTION_MAX,
+};
+
+static struct option options[] = {
+	{ "help",		no_argument,		0, OPTION_HELP           },
+	{ "version",		no_argument,		0, OPTION_VERSION        },
+	{ "max",		required_argument,	0, OPTION_MAX            },
+	{ 0,			0,			0, 0                     }
+};
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> selected;
+	size_t max = 1000000;
+	std::mt19937 rng(42);
+
+	while (true) {
+		int c, opt_idx;
+
+		c = getopt_long(argc, argv, "hm:", options, &opt_idx);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case OPTION_HELP:
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		case OPTION_VERSION:
+			std::cout << "git-tools-bench version " << GITTTOOLSVERSION << std::endl;
+			return 0;
+		case OPTION_MAX:
+		case 'm':
+			max = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	while (optind < argc)
+		selected.push_back(argv[optind++]);
+
+	auto enabled = [&](const char *name) {
+		return selected.empty() ||
+		       std::find(selected.begin(), selected.end(), name) != selected.end();
+	};
+
+	git_libgit2_init();
+	ref_store_init();
+
+	std::cout << std::left << std::setw(16) << "benchmark"
+		  << std::right << std::setw(10) << "refs"
+		  << std::setw(12) << "ns/op"
+		  << std::setw(12) << "allocs/op" << std::endl;
+
+	for (size_t n = 1000; n <= max; n *= 10) {
+		if (enabled("is_prefix"))
+			bench_is_prefix(n);
+		if (enabled("branch_sort"))
+			bench_sort(n, rng);
+		if (enabled("print_branch"))
+			bench_print(n, rng);
+		if (enabled("lookup_target"))
+			bench_lookup_target(n, rng);
+	}
+
+	git_libgit2_shutdown();
+
+	return 0;
+}
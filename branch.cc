@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * branch.cc - Branch list helpers of git-recent
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iomanip>
+
+#include "branch.h"
+
+bool is_prefix(std::string str, std::string prefix)
+{
+	if (str.size() < prefix.size())
+		return false;
+
+	return (str.substr(0, prefix.size()) == prefix);
+}
+
+std::string::size_type name_offset(const std::string &ns)
+{
+	return ns.rfind('/') + 1;
+}
+
+void print_branch(std::ostream &out, const branch &b, std::string::size_type max_len,
+		  const std::string &desc_prefix)
+{
+	std::string prefix = b.current ? "* " : "  ";
+	struct tm *tm;
+	char t[32];
+
+	tm = localtime(&b.last);
+	strftime(t, 32, "%Y-%m-%d %H:%M:%S", tm);
+	out << prefix << std::left << std::setw(max_len + 2) << b.name << "(" << t << ")";
+	if (b.describe.size() > 0)
+		out << " ["<< desc_prefix << b.describe << "]";
+	else if (b.pending)
+		out << " [describe pending]";
+	if (b.contained.size() > 0)
+		out << " [contained in " << b.contained << "]";
+	out << std::endl;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * branch.h - Branch list helpers of git-recent
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __BRANCH_H
+#define __BRANCH_H
+
+#include <ostream>
+#include <string>
+
+#include <time.h>
+#include <git2.h>
+
+struct branch {
+	std::string ref;
+	std::string name;
+	bool current;
+	time_t last;
+	std::string describe;
+	/* Not described within the time budget */
+	bool pending;
+	std::string contained;
+	git_oid oid;
+
+	branch()
+		: ref(), name(), current(false), last(0), describe(), pending(false),
+		  contained(), oid()
+	{
+	}
+
+	branch(std::string r, std::string n, bool c, time_t l, const git_oid &o)
+		: ref(r), name(n), current(c), last(l), describe(), pending(false),
+		  contained(), oid(o)
+	{
+	}
+
+	/* Same order as git for-each-ref --sort=-committerdate */
+	bool operator<(const struct branch &b) const
+	{
+		if (last != b.last)
+			return last > b.last;
+
+		return ref < b.ref;
+	}
+};
+
+bool is_prefix(std::string str, std::string prefix);
+
+/*
+ * Where branch names start in refs of the namespace ns, which is a ref
+ * prefix like refs/heads/ or refs/changes/12/. Names keep the part of the
+ * prefix after its last slash.
+ */
+std::string::size_type name_offset(const std::string &ns);
+
+/* Prints one line of the default git-recent output */
+void print_branch(std::ostream &out, const branch &b, std::string::size_type max_len,
+		  const std::string &desc_prefix);
+
+#endif
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * commitgraph.cc - Read-only access to git's commit-graph files
+ *
+ * Supports a single objects/info/commit-graph file as well as split
+ * commit-graphs listed in objects/info/commit-graphs/commit-graph-chain.
+ * Only the chunks needed to walk history are used: OID fanout, OID lookup,
+ * commit data and extra edges. Generation numbers are the topological
+ * levels from the commit data chunk, which both version 1 and 2 files have.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <fstream>
+#include <memory>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "commitgraph.h"
+
+#define GRAPH_HEADER		8
+#define GRAPH_CHUNK_ENTRY	12
+#define GRAPH_DATA_SIZE		(GIT_OID_RAWSZ + 16)
+
+#define CHUNK_OID_FANOUT	0x4f494446	// "OIDF"
+#define CHUNK_OID_LOOKUP	0x4f49444c	// "OIDL"
+#define CHUNK_DATA		0x43444154	// "CDAT"
+#define CHUNK_EXTRA_EDGES	0x45444745	// "EDGE"
+
+#define PARENT_NONE		0x70000000
+#define PARENT_EDGES		0x80000000
+#define EDGE_LAST		0x80000000
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+commit_graph_layer::~commit_graph_layer()
+{
+	if (map)
+		munmap((void *)map, size);
+}
+
+int commit_graph_layer::open(const std::string &path)
+{
+	unsigned num_chunks;
+	struct stat st;
+	void *m;
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return GIT_ENOTFOUND;
+
+	if (fstat(fd, &st) < 0 || st.st_size < GRAPH_HEADER) {
+		close(fd);
+		return -1;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	map  = (const unsigned char *)m;
+	size = st.st_size;
+
+	/* Version 1, SHA-1 only */
+	if (memcmp(map, "CGPH", 4) != 0 || map[4] != 1 || map[5] != 1)
+		return -1;
+
+	num_chunks = map[6];
+	if (GRAPH_HEADER + (num_chunks + 1) * GRAPH_CHUNK_ENTRY > size)
+		return -1;
+
+	for (unsigned i = 0; i < num_chunks; i++) {
+		const unsigned char *e = map + GRAPH_HEADER + i * GRAPH_CHUNK_ENTRY;
+		uint64_t off = get_be64(e + 4);
+		uint64_t end = get_be64(e + 4 + GRAPH_CHUNK_ENTRY);
+
+		if (off > end || end > size)
+			return -1;
+
+		switch (get_be32(e)) {
+		case CHUNK_OID_FANOUT:
+			if (end - off != 256 * 4)
+				return -1;
+			fanout = map + off;
+			break;
+		case CHUNK_OID_LOOKUP:
+			oids = map + off;
+			num_commits = (end - off) / GIT_OID_RAWSZ;
+			break;
+		case CHUNK_DATA:
+			data = map + off;
+			if ((end - off) / GRAPH_DATA_SIZE < num_commits)
+				return -1;
+			break;
+		case CHUNK_EXTRA_EDGES:
+			edges = map + off;
+			break;
+		}
+	}
+
+	if (fanout == NULL || oids == NULL || data == NULL ||
+	    get_be32(fanout + 255 * 4) != num_commits)
+		return -1;
+
+	return 0;
+}
+
+commit_graph::~commit_graph()
+{
+	for (auto l : layers)
+		delete l;
+}
+
+int commit_graph::open(const std::string &objdir)
+{
+	std::string dir = objdir + "/info/commit-graphs/";
+	std::ifstream chain(dir + "commit-graph-chain");
+	std::vector<std::string> paths;
+	std::string line;
+
+	if (chain) {
+		while (std::getline(chain, line)) {
+			if (!line.empty())
+				paths.push_back(dir + "graph-" + line + ".graph");
+		}
+	} else {
+		paths.push_back(objdir + "/info/commit-graph");
+	}
+
+	for (auto &path : paths) {
+		std::unique_ptr<commit_graph_layer> l(new commit_graph_layer());
+		int error;
+
+		error = l->open(path);
+		if (error < 0)
+			return error;
+
+		l->base      = num_commits;
+		num_commits += l->num_commits;
+		layers.push_back(l.release());
+	}
+
+	return 0;
+}
+
+const commit_graph_layer *commit_graph::layer(uint32_t pos) const
+{
+	for (auto l = layers.rbegin(); l != layers.rend(); ++l) {
+		if (pos >= (*l)->base)
+			return *l;
+	}
+
+	return NULL;
+}
+
+const unsigned char *commit_graph::commit_data(uint32_t pos) const
+{
+	const commit_graph_layer *l = layer(pos);
+
+	return l->data + (size_t)(pos - l->base) * GRAPH_DATA_SIZE;
+}
+
+bool commit_graph::find(const git_oid *oid, uint32_t *pos) const
+{
+	for (auto l : layers) {
+		uint8_t first = oid->id[0];
+		uint32_t lo = first ? get_be32(l->fanout + (first - 1) * 4) : 0;
+		uint32_t hi = get_be32(l->fanout + first * 4);
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			int cmp = memcmp(l->oids + (size_t)mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+
+			if (cmp == 0) {
+				*pos = l->base + mid;
+				return true;
+			}
+
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	return false;
+}
+
+void commit_graph::oid(uint32_t pos, git_oid *out) const
+{
+	const commit_graph_layer *l = layer(pos);
+
+	memcpy(out->id, l->oids + (size_t)(pos - l->base) * GIT_OID_RAWSZ, GIT_OID_RAWSZ);
+}
+
+uint32_t commit_graph::generation(uint32_t pos) const
+{
+	return get_be32(commit_data(pos) + GIT_OID_RAWSZ + 8) >> 2;
+}
+
+git_time_t commit_graph::time(uint32_t pos) const
+{
+	const unsigned char *d = commit_data(pos) + GIT_OID_RAWSZ + 8;
+
+	return ((git_time_t)(get_be32(d) & 3) << 32) | get_be32(d + 4);
+}
+
+void commit_graph::parents(uint32_t pos, std::vector<uint32_t> &out) const
+{
+	const commit_graph_layer *l = layer(pos);
+	const unsigned char *d = commit_data(pos) + GIT_OID_RAWSZ;
+	uint32_t p1 = get_be32(d), p2 = get_be32(d + 4);
+
+	out.clear();
+
+	if (p1 == PARENT_NONE)
+		return;
+	out.push_back(p1);
+
+	if (p2 == PARENT_NONE)
+		return;
+
+	if (!(p2 & PARENT_EDGES)) {
+		out.push_back(p2);
+		return;
+	}
+
+	/* Octopus merge, the other parents are in the extra edges list */
+	if (l->edges == NULL)
+		return;
+
+	for (const unsigned char *e = l->edges + (size_t)(p2 & ~PARENT_EDGES) * 4;
+	     e + 4 <= l->map + l->size; e += 4) {
+		uint32_t v = get_be32(e);
+
+		out.push_back(v & ~EDGE_LAST);
+		if (v & EDGE_LAST)
+			break;
+	}
+}
+
+int write_commit_graph(git_repository *repo)
+{
+	std::string git_dir = std::string("--git-dir=") + git_repository_path(repo);
+	const char *args[] = {
+		"git", git_dir.c_str(),
+		"-c", "commitGraph.generationVersion=2",
+		"commit-graph", "write", "--reachable", "--split", "--changed-paths",
+		NULL
+	};
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		std::cerr << "Error: Can't start git commit-graph: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	if (pid == 0) {
+		execvp(args[0], (char * const *)args);
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return 1;
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "Error: git commit-graph write failed" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+void commit_graph_hint(const char *cmd, const commit_graph *graph, size_t tips, size_t missing)
+{
+	if (!isatty(STDERR_FILENO))
+		return;
+
+	/* A few new commits on top of the graph are cheap to walk */
+	if (graph && (missing < 16 || missing * 4 < tips))
+		return;
+
+	std::cerr << "Hint: " << (graph ? "The commit-graph is outdated" : "There is no commit-graph")
+		  << ", run '" << cmd << " --write-commit-graph' to speed this up" << std::endl;
+}
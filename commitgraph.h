@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * commitgraph.h - Read-only access to git's commit-graph files
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __COMMITGRAPH_H
+#define __COMMITGRAPH_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <git2.h>
+
+/* One mmap'ed commit-graph file, a layer of a split commit-graph */
+struct commit_graph_layer {
+	const unsigned char *map;
+	size_t size;
+
+	uint32_t num_commits;
+	uint32_t base;		// Commits in all layers below this one
+	const unsigned char *fanout;
+	const unsigned char *oids;
+	const unsigned char *data;
+	const unsigned char *edges;
+
+	commit_graph_layer()
+		: map(NULL), size(0), num_commits(0), base(0),
+		  fanout(NULL), oids(NULL), data(NULL), edges(NULL)
+	{}
+
+	~commit_graph_layer();
+
+	int open(const std::string &path);
+};
+
+/*
+ * All layers of the commit-graph. Positions are global over all layers, in
+ * the order git uses: the commits of the base layer first, each layer sorted
+ * by object id.
+ */
+class commit_graph {
+	std::vector<commit_graph_layer *> layers;	// Base layer first
+	uint32_t num_commits;
+
+	const commit_graph_layer *layer(uint32_t pos) const;
+	const unsigned char *commit_data(uint32_t pos) const;
+
+public:
+	commit_graph()
+		: num_commits(0)
+	{}
+
+	~commit_graph();
+
+	/* Returns GIT_ENOTFOUND if the repository has no commit-graph */
+	int open(const std::string &objdir);
+
+	uint32_t size() const
+	{
+		return num_commits;
+	}
+
+	bool find(const git_oid *oid, uint32_t *pos) const;
+
+	void oid(uint32_t pos, git_oid *out) const;
+
+	/* Topological level, always larger than the levels of all parents */
+	uint32_t generation(uint32_t pos) const;
+
+	git_time_t time(uint32_t pos) const;
+
+	void parents(uint32_t pos, std::vector<uint32_t> &out) const;
+};
+
+/*
+ * Runs 'git commit-graph write' for all commits reachable from refs, with
+ * generation data and changed-path Bloom filters. New commits are added as
+ * a new layer of a split commit-graph, so this is cheap to run often.
+ */
+int write_commit_graph(git_repository *repo);
+
+/*
+ * Suggests cmd --write-commit-graph on stderr if there is no commit-graph
+ * (graph is NULL) or if it misses a good part of the tips about to be
+ * walked. Nothing is printed if stderr is not a terminal.
+ */
+void commit_graph_hint(const char *cmd, const commit_graph *graph, size_t tips, size_t missing);
+
+#endif
@@ -0,0 +1,524 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * descindex.cc - Persistent index of describe results
+ *
+ * The file starts with a header, followed by the tag table the results were
+ * computed with, the tag names and the results sorted by commit id. It is a
+ * local cache and uses the byte order of the host.
+ *
+ * When the tag table changed since the index was written, every commit which
+ * got, lost or changed its tag is looked for in the history of the indexed
+ * commits. The walk stops at commits with a generation number too low to
+ * reach any of them, and the answer for each commit is remembered, so shared
+ * history is walked only once for all indexed commits.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <fstream>
+
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "descindex.h"
+
+#define INDEX_VERSION	1
+#define NO_TAG		0xffffffffU
+
+/* A background refresh taking longer than this is assumed to be dead */
+#define REFRESH_TIMEOUT	(10 * 60)
+
+#define FLAG_TAGS		1U
+#define FLAG_FIRST_PARENT	2U
+
+struct file_header {
+	char magic[4];
+	uint32_t version;
+	/* The describe options the results depend on */
+	uint32_t candidates;
+	uint32_t flags;
+	uint32_t num_tags;
+	uint32_t num_entries;
+	uint32_t names_size;
+	uint32_t reserved;
+};
+
+struct file_tag {
+	unsigned char oid[GIT_OID_RAWSZ];
+	uint32_t prio;
+	int64_t date;
+	uint32_t name;		// Offset into the names
+	uint32_t reserved;
+};
+
+static const char index_magic[4] = { 'G', 'T', 'D', 'I' };
+
+static int compare_entries(const describe_index::entry &a, const describe_index::entry &b)
+{
+	return memcmp(a.oid, b.oid, GIT_OID_RAWSZ);
+}
+
+int describe_index::read()
+{
+	std::ifstream in(path, std::ios::binary);
+	std::vector<file_tag> ftags;
+	std::vector<char> names;
+	file_header hdr;
+
+	if (!in)
+		return GIT_ENOTFOUND;
+
+	if (!in.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)) ||
+	    memcmp(hdr.magic, index_magic, sizeof(index_magic)) != 0 ||
+	    hdr.version != INDEX_VERSION)
+		return -1;
+
+	/* Computed with other options, the results are of no use */
+	if (hdr.candidates != candidates || hdr.flags != flags)
+		return -1;
+
+	ftags.resize(hdr.num_tags);
+	names.resize(hdr.names_size);
+	entries.resize(hdr.num_entries);
+
+	if (!in.read(reinterpret_cast<char *>(ftags.data()), ftags.size() * sizeof(file_tag)) ||
+	    !in.read(names.data(), names.size()) ||
+	    !in.read(reinterpret_cast<char *>(entries.data()), entries.size() * sizeof(entry)))
+		return -1;
+
+	if (!names.empty() && names.back() != 0)
+		return -1;
+
+	for (auto &f : ftags) {
+		stored_tag t;
+
+		if (f.name >= names.size())
+			return -1;
+
+		git_oid_fromraw(&t.oid, f.oid);
+		t.name = &names[f.name];
+		t.prio = f.prio;
+		t.date = f.date;
+		stored_tags.push_back(t);
+	}
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].tag != NO_TAG && entries[i].tag >= stored_tags.size())
+			return -1;
+		if (i && compare_entries(entries[i - 1], entries[i]) >= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int describe_index::invalidate(git_repository *repo, const commit_graph *graph)
+{
+	std::unordered_map<git_oid, bool, oid_hash, oid_equal> reaches;
+	std::unordered_set<git_oid, oid_hash, oid_equal> tagged, stored;
+	std::vector<uint32_t> parent_pos;
+	uint32_t min_gen = UINT32_MAX;
+	struct frame {
+		git_oid oid;
+		bool expanded;
+		std::vector<git_oid> parents;
+	};
+	std::vector<frame> stack;
+	int error;
+
+	/* Commits which got, lost or changed their tag */
+	for (size_t i = 0; i < stored_tags.size(); i++) {
+		stored.insert(stored_tags[i].oid);
+		if (current[i] == NULL)
+			tagged.insert(stored_tags[i].oid);
+	}
+
+	for (auto &t : *tags) {
+		if (stored.find(t.first) == stored.end())
+			tagged.insert(t.first);
+	}
+
+	invalid.assign(entries.size(), false);
+
+	if (tagged.empty())
+		return 0;
+
+	changed = true;
+
+	/*
+	 * The commit-graph contains the whole history of its commits, so its
+	 * commits can only reach tagged commits which are in it too.
+	 */
+	if (graph) {
+		for (auto &oid : tagged) {
+			uint32_t pos;
+
+			if (graph->find(&oid, &pos))
+				min_gen = std::min(min_gen, graph->generation(pos));
+		}
+	}
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		git_oid start;
+
+		git_oid_fromraw(&start, entries[i].oid);
+		stack.push_back({ start, false, {} });
+
+		while (!stack.empty()) {
+			frame &f = stack.back();
+			uint32_t pos;
+
+			if (reaches.find(f.oid) != reaches.end()) {
+				stack.pop_back();
+				continue;
+			}
+
+			if (f.expanded) {
+				bool r = false;
+
+				for (auto &p : f.parents)
+					r = r || reaches[p];
+
+				reaches[f.oid] = r;
+				stack.pop_back();
+				continue;
+			}
+
+			f.expanded = true;
+
+			if (tagged.find(f.oid) != tagged.end()) {
+				reaches[f.oid] = true;
+				continue;
+			}
+
+			if (graph && graph->find(&f.oid, &pos)) {
+				/* Parents have lower generations than their children */
+				if (min_gen == UINT32_MAX || graph->generation(pos) <= min_gen) {
+					reaches[f.oid] = false;
+					continue;
+				}
+
+				graph->parents(pos, parent_pos);
+				for (auto p : parent_pos) {
+					git_oid oid;
+
+					graph->oid(p, &oid);
+					f.parents.push_back(oid);
+				}
+			} else {
+				git_commit *commit;
+
+				/* Commits gone since are dropped from the index */
+				error = git_commit_lookup(&commit, repo, &f.oid);
+				if (error == GIT_ENOTFOUND) {
+					reaches[f.oid] = true;
+					continue;
+				} else if (error < 0) {
+					return error;
+				}
+
+				for (unsigned j = 0; j < git_commit_parentcount(commit); j++)
+					f.parents.push_back(*git_commit_parent_id(commit, j));
+
+				git_commit_free(commit);
+			}
+
+			/* f is invalid once the stack grows */
+			std::vector<git_oid> parents = f.parents;
+
+			for (auto &p : parents) {
+				if (reaches.find(p) == reaches.end())
+					stack.push_back({ p, false, {} });
+			}
+		}
+
+		invalid[i] = reaches[start];
+	}
+
+	return 0;
+}
+
+int describe_index::load(git_repository *r, const tag_table &t, const describe_options &opts,
+			 const commit_graph *g)
+{
+	int error;
+
+	/* Loaded again when the tags change, results of the old table are gone */
+	stored_tags.clear();
+	current.clear();
+	entries.clear();
+	invalid.clear();
+	changed = false;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		added.clear();
+	}
+
+	repo       = r;
+	graph      = g;
+	tags       = &t;
+	candidates = opts.candidates;
+	flags      = (opts.tags ? FLAG_TAGS : 0) | (opts.first_parent ? FLAG_FIRST_PARENT : 0);
+
+	/* One index per set of options, so switching between them is cheap */
+	path = std::string(git_repository_commondir(repo)) + "git-tools/describe-index";
+	if (opts.tags)
+		path += "-tags";
+	if (opts.first_parent)
+		path += "-first-parent";
+	if (opts.candidates != DESCRIBE_CANDIDATES)
+		path += "-" + std::to_string(opts.candidates);
+
+	if (read() < 0) {
+		stored_tags.clear();
+		entries.clear();
+		changed = true;
+		return 0;
+	}
+
+	for (auto &s : stored_tags) {
+		const tag_table::tag *cur = tags->find(&s.oid);
+
+		if (cur && cur->name == s.name && cur->prio == s.prio && cur->date == s.date)
+			current.push_back(cur);
+		else
+			current.push_back(NULL);
+	}
+
+	error = invalidate(repo, graph);
+	if (error < 0) {
+		/* Better start over than to return stale results */
+		entries.clear();
+		invalid.clear();
+		changed = true;
+	}
+
+	return 0;
+}
+
+bool describe_index::find(const git_oid *oid, const tag_table::tag **tag, unsigned *depth) const
+{
+	entry key;
+
+	memcpy(key.oid, oid->id, GIT_OID_RAWSZ);
+
+	auto it = std::lower_bound(entries.begin(), entries.end(), key,
+				   [](const entry &a, const entry &b) { return compare_entries(a, b) < 0; });
+	if (it == entries.end() || compare_entries(*it, key) != 0 || invalid[it - entries.begin()])
+		return false;
+
+	if (it->tag == NO_TAG) {
+		*tag = NULL;
+	} else {
+		*tag = current[it->tag];
+		if (*tag == NULL)
+			return false;
+	}
+
+	*depth = it->depth;
+
+	return true;
+}
+
+bool describe_index::single_parent(const git_oid *oid, git_oid *parent) const
+{
+	std::vector<uint32_t> parent_pos;
+	git_commit *commit;
+	uint32_t pos;
+	bool ret;
+
+	if (graph && graph->find(oid, &pos)) {
+		graph->parents(pos, parent_pos);
+		if (parent_pos.size() != 1)
+			return false;
+
+		graph->oid(parent_pos[0], parent);
+		return true;
+	}
+
+	if (git_commit_lookup(&commit, repo, oid) < 0)
+		return false;
+
+	ret = git_commit_parentcount(commit) == 1;
+	if (ret)
+		git_oid_cpy(parent, git_commit_parent_id(commit, 0));
+
+	git_commit_free(commit);
+
+	return ret;
+}
+
+bool describe_index::lookup(const git_oid *oid, const tag_table::tag **tag, unsigned *depth)
+{
+	git_oid parent;
+
+	if (find(oid, tag, depth))
+		return true;
+
+	/*
+	 * A commit on top of an indexed one, as after git commit or git am:
+	 * its walk is the walk of the parent, one step longer.
+	 */
+	if (!repo || tags->find(oid) || !single_parent(oid, &parent) ||
+	    !find(&parent, tag, depth))
+		return false;
+
+	if (*tag)
+		*depth += 1;
+
+	add(oid, *tag, *depth);
+
+	return true;
+}
+
+void describe_index::add(const git_oid *oid, const tag_table::tag *tag, unsigned depth)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	added.push_back({ *oid, { tag, depth } });
+}
+
+int describe_index::save()
+{
+	std::unordered_map<const tag_table::tag *, uint32_t> tag_idx;
+	std::vector<std::pair<git_oid, std::pair<const tag_table::tag *, unsigned>>> new_results;
+	std::vector<file_tag> ftags;
+	std::vector<entry> out;
+	std::string names;
+	std::string lock_path = path + ".lock";
+	std::string dir = path.substr(0, path.rfind('/'));
+	file_header hdr;
+	FILE *f;
+	int fd;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		new_results = added;
+	}
+
+	if (!changed && new_results.empty())
+		return 0;
+
+	for (auto &t : *tags) {
+		file_tag ft;
+
+		memset(&ft, 0, sizeof(ft));
+		memcpy(ft.oid, t.first.id, GIT_OID_RAWSZ);
+		ft.prio = t.second.prio;
+		ft.date = t.second.date;
+		ft.name = names.size();
+		names  += t.second.name;
+		names  += '\0';
+
+		tag_idx[&t.second] = ftags.size();
+		ftags.push_back(ft);
+	}
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		entry e = entries[i];
+
+		if (invalid[i])
+			continue;
+
+		e.tag = e.tag == NO_TAG ? NO_TAG : tag_idx[current[e.tag]];
+		out.push_back(e);
+	}
+
+	for (auto &a : new_results) {
+		entry e;
+
+		memcpy(e.oid, a.first.id, GIT_OID_RAWSZ);
+		e.tag   = a.second.first ? tag_idx[a.second.first] : NO_TAG;
+		e.depth = a.second.second;
+		out.push_back(e);
+	}
+
+	/* Branches sharing a commit add it more than once */
+	std::stable_sort(out.begin(), out.end(),
+			 [](const entry &a, const entry &b) { return compare_entries(a, b) < 0; });
+	out.erase(std::unique(out.begin(), out.end(),
+			      [](const entry &a, const entry &b) { return compare_entries(a, b) == 0; }),
+		  out.end());
+
+	memcpy(hdr.magic, index_magic, sizeof(index_magic));
+	hdr.version     = INDEX_VERSION;
+	hdr.candidates  = candidates;
+	hdr.flags       = flags;
+	hdr.num_tags    = ftags.size();
+	hdr.num_entries = out.size();
+	hdr.names_size  = names.size();
+	hdr.reserved    = 0;
+
+	mkdir(dir.c_str(), 0777);
+
+	/* Like git, a lock file keeps concurrent writers apart */
+	fd = open(lock_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -1;
+
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		goto err;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(ftags.data(), sizeof(file_tag), ftags.size(), f) != ftags.size() ||
+	    fwrite(names.data(), 1, names.size(), f) != names.size() ||
+	    fwrite(out.data(), sizeof(entry), out.size(), f) != out.size()) {
+		fclose(f);
+		goto err;
+	}
+
+	if (fclose(f) != 0)
+		goto err;
+
+	if (rename(lock_path.c_str(), path.c_str()) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	unlink(lock_path.c_str());
+
+	return -1;
+}
+
+bool describe_index::start_refresh()
+{
+	std::string mark = path + ".refresh";
+	struct stat st;
+	int fd;
+
+	mkdir(path.substr(0, path.rfind('/')).c_str(), 0777);
+
+	fd = open(mark.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0 && errno == EEXIST && stat(mark.c_str(), &st) == 0 &&
+	    st.st_mtime + REFRESH_TIMEOUT < time(NULL)) {
+		unlink(mark.c_str());
+		fd = open(mark.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	}
+
+	if (fd < 0)
+		return false;
+
+	close(fd);
+
+	return true;
+}
+
+void describe_index::end_refresh()
+{
+	unlink((path + ".refresh").c_str());
+}
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * descindex.h - Persistent index of describe results
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __DESCINDEX_H
+#define __DESCINDEX_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <stdint.h>
+#include <git2.h>
+
+#include "commitgraph.h"
+#include "describe.h"
+
+/*
+ * Remembers the nearest tag and the distance to it for every commit
+ * described before, so describing it again is a binary search. The index
+ * is stored in <common dir>/git-tools/describe-index, and only results for
+ * the same tag table are reused: when tags are added, removed or changed,
+ * the results of commits having one of the changed tags in their history
+ * are dropped. All other results stay valid, no matter how many commits or
+ * branches were added in between.
+ */
+class describe_index {
+public:
+	struct entry {
+		unsigned char oid[GIT_OID_RAWSZ];
+		uint32_t tag;		// Index into the stored tags or NO_TAG
+		uint32_t depth;
+	};
+
+private:
+	struct stored_tag {
+		git_oid oid;
+		std::string name;
+		int prio;
+		git_time_t date;
+	};
+
+	git_repository *repo;
+	const commit_graph *graph;
+	const tag_table *tags;
+	std::string path;
+	uint32_t candidates;
+	uint32_t flags;
+
+	/* Results read from the file, sorted by commit id */
+	std::vector<stored_tag> stored_tags;
+	std::vector<const tag_table::tag *> current;	// Same tag in the tag table
+	std::vector<entry> entries;
+	std::vector<bool> invalid;
+	bool changed;
+
+	/* Results of this run, added by the describe workers */
+	std::mutex lock;
+	std::vector<std::pair<git_oid, std::pair<const tag_table::tag *, unsigned>>> added;
+
+	int read();
+	int invalidate(git_repository *repo, const commit_graph *graph);
+	bool find(const git_oid *oid, const tag_table::tag **tag, unsigned *depth) const;
+	bool single_parent(const git_oid *oid, git_oid *parent) const;
+
+public:
+	describe_index()
+		: repo(NULL), graph(NULL), tags(NULL), candidates(0), flags(0), changed(false)
+	{}
+
+	/*
+	 * Reads the index of the repository. Not being able to read it is not
+	 * an error, the index just starts out empty then. The tag table must
+	 * stay valid while the index is used. Results not saved before loading
+	 * again are dropped.
+	 */
+	int load(git_repository *repo, const tag_table &t, const describe_options &opts,
+		 const commit_graph *graph);
+
+	/*
+	 * Returns true and the describe() result if the commit is in the index,
+	 * tag is NULL for commits no tag describes. An untagged commit with a
+	 * single parent in the index is described from its parent, and the
+	 * result is added for the next run. Safe to call from multiple threads.
+	 */
+	bool lookup(const git_oid *oid, const tag_table::tag **tag, unsigned *depth);
+
+	void add(const git_oid *oid, const tag_table::tag *tag, unsigned depth);
+
+	/*
+	 * Writes the index back if anything changed. Workers may still add
+	 * results meanwhile, those are left for the next run.
+	 */
+	int save();
+
+	/*
+	 * Marks that a background run is completing the index. Returns false if
+	 * another one is already at it, stale marks are ignored after a while.
+	 */
+	bool start_refresh();
+	void end_refresh();
+};
+
+#endif
@@ -0,0 +1,716 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * describe.cc - Describe commits relative to the nearest tag, like git describe
+ *
+ * This follows describe() in git's builtin/describe.c step by step, so the
+ * results are the same as the ones of git describe. Unlike libgit2, the tag
+ * table is built only once for all commits, and tags are read through the
+ * ref_store so describe works with reftable repositories too.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <unordered_set>
+#include <algorithm>
+#include <climits>
+
+#include <fnmatch.h>
+#include <stdio.h>
+
+#include "describe.h"
+
+/* Commit is queued or was visited, the other bits mark candidate tags */
+#define SEEN	1U
+
+struct describer::commit {
+	git_oid oid;
+	git_time_t time;
+	std::vector<commit *> parents;
+	bool parsed;
+	/* flags are only valid while epoch matches the one of the describer */
+	unsigned epoch;
+	unsigned flags;
+};
+
+static bool matches_any(const std::vector<std::string> &patterns, const char *name)
+{
+	for (auto &p : patterns) {
+		if (fnmatch(p.c_str(), name, 0) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+int tag_table::build(git_repository *repo, ref_store &refs, const describe_options &opts)
+{
+	return refs.foreach("refs/tags/", [&](const char *refname, const git_oid *oid) {
+		const char *name = refname + strlen("refs/tags/");
+		git_oid peeled;
+		git_object *obj;
+		tag t;
+
+		if (oid == NULL)
+			return 0;
+
+		if (matches_any(opts.exclude, name))
+			return 0;
+
+		if (!opts.match.empty() && !matches_any(opts.match, name))
+			return 0;
+
+		/* Like git, tags pointing to missing objects are not fatal */
+		if (git_object_lookup(&obj, repo, oid, GIT_OBJ_ANY) < 0)
+			return 0;
+
+		git_oid_cpy(&peeled, oid);
+		t.name = name;
+		t.prio = 1;
+		t.date = 0;
+
+		if (git_object_type(obj) == GIT_OBJ_TAG) {
+			git_tag *tag = reinterpret_cast<git_tag *>(obj);
+			const git_signature *tagger = git_tag_tagger(tag);
+			git_object *target;
+
+			if (git_tag_peel(&target, tag) == 0) {
+				git_oid_cpy(&peeled, git_object_id(target));
+				git_object_free(target);
+			}
+
+			t.prio = 2;
+			t.date = tagger ? tagger->when.time : 0;
+		}
+
+		git_object_free(obj);
+
+		/*
+		 * Annotated tags win over lightweight ones, the newest annotated
+		 * tag wins over older ones, otherwise the first one sticks.
+		 */
+		auto it = tags.find(peeled);
+		if (it == tags.end())
+			tags.emplace(peeled, t);
+		else if (it->second.prio < t.prio ||
+			 (t.prio == 2 && it->second.prio == 2 && it->second.date < t.date))
+			it->second = t;
+
+		return 0;
+	});
+}
+
+describer::~describer()
+{
+	for (auto &c : commits)
+		delete c.second;
+}
+
+describer::commit *describer::lookup(const git_oid *oid)
+{
+	auto it = commits.find(*oid);
+	commit *c;
+
+	if (it != commits.end())
+		return it->second;
+
+	c = new commit();
+	git_oid_cpy(&c->oid, oid);
+	c->time   = 0;
+	c->parsed = false;
+	c->epoch  = 0;
+	c->flags  = 0;
+
+	commits.emplace(*oid, c);
+
+	return c;
+}
+
+int describer::parse(commit *c)
+{
+	git_commit *gc;
+	uint32_t pos;
+	int error;
+
+	if (c->parsed)
+		return 0;
+
+	if (graph && graph->find(&c->oid, &pos)) {
+		std::vector<uint32_t> parents;
+
+		c->time = graph->time(pos);
+		graph->parents(pos, parents);
+		for (auto p : parents) {
+			git_oid oid;
+
+			graph->oid(p, &oid);
+			c->parents.push_back(lookup(&oid));
+		}
+		c->parsed = true;
+
+		return 0;
+	}
+
+	error = git_commit_lookup(&gc, repo, &c->oid);
+	if (error < 0)
+		return error;
+
+	c->time = git_commit_time(gc);
+	for (unsigned i = 0; i < git_commit_parentcount(gc); i++)
+		c->parents.push_back(lookup(git_commit_parent_id(gc, i)));
+	c->parsed = true;
+
+	git_commit_free(gc);
+
+	return 0;
+}
+
+/*
+ * git keeps the queue as list sorted by commit date, where commits with
+ * equal dates stay in insertion order. The sequence number does the same.
+ */
+struct describer::queued {
+	git_time_t time;
+	unsigned long seq;
+	commit *c;
+};
+
+struct describer::queue_less {
+	bool operator()(const queued &a, const queued &b) const
+	{
+		if (a.time != b.time)
+			return a.time < b.time;
+
+		return a.seq > b.seq;
+	}
+};
+
+namespace {
+
+struct possible_tag {
+	const tag_table::tag *name;
+	int depth;
+	int found_order;
+	unsigned flag_within;
+};
+
+}
+
+int describer::describe(const git_oid *oid, const tag_table::tag **tag, unsigned *depth)
+{
+	unsigned annotated_cnt = 0, match_cnt = 0;
+	std::vector<possible_tag> all_matches;
+	const tag_table::tag *n;
+	std::vector<queued> list;
+	commit *gave_up_on = NULL;
+	unsigned long seq = 0;
+	int seen_commits = 0;
+	commit *cmit;
+	int error;
+
+	auto flags = [this](commit *c) -> unsigned & {
+		if (c->epoch != epoch) {
+			c->epoch = epoch;
+			c->flags = 0;
+		}
+		return c->flags;
+	};
+
+	auto insert = [&](commit *c) {
+		list.push_back({ c->time, seq++, c });
+		std::push_heap(list.begin(), list.end(), queue_less());
+	};
+
+	auto pop = [&]() {
+		std::pop_heap(list.begin(), list.end(), queue_less());
+		commit *c = list.back().c;
+		list.pop_back();
+		return c;
+	};
+
+	/* Exact match, lightweight tags are only used with --tags */
+	n = tags.find(oid);
+	if (n && (opts.tags || n->prio == 2)) {
+		*tag   = n;
+		*depth = 0;
+		return 0;
+	}
+
+	if (opts.candidates == 0)
+		return GIT_ENOTFOUND;
+
+	epoch++;
+
+	cmit = lookup(oid);
+	error = parse(cmit);
+	if (error < 0)
+		return error;
+
+	flags(cmit) = SEEN;
+	insert(cmit);
+
+	while (!list.empty()) {
+		commit *c = pop();
+
+		seen_commits++;
+		n = tags.find(&c->oid);
+		if (n) {
+			if (!opts.tags && n->prio < 2) {
+				/* Only annotated tags count without --tags */
+			} else if (match_cnt < opts.candidates) {
+				possible_tag t;
+
+				match_cnt++;
+				t.name        = n;
+				t.depth       = seen_commits - 1;
+				t.flag_within = 1U << match_cnt;
+				t.found_order = match_cnt;
+				all_matches.push_back(t);
+
+				flags(c) |= t.flag_within;
+				if (n->prio == 2)
+					annotated_cnt++;
+			} else {
+				gave_up_on = c;
+				break;
+			}
+		}
+
+		for (auto &t : all_matches) {
+			if (!(flags(c) & t.flag_within))
+				t.depth++;
+		}
+
+		/* Stop if last remaining path already covered by best candidate(s) */
+		if (annotated_cnt && list.empty()) {
+			int best_depth = INT_MAX;
+			unsigned best_within = 0;
+
+			for (auto &t : all_matches) {
+				if (t.depth < best_depth) {
+					best_depth  = t.depth;
+					best_within = t.flag_within;
+				} else if (t.depth == best_depth) {
+					best_within |= t.flag_within;
+				}
+			}
+
+			if ((flags(c) & best_within) == best_within)
+				break;
+		}
+
+		for (auto p : c->parents) {
+			error = parse(p);
+			if (error < 0)
+				return error;
+
+			if (!(flags(p) & SEEN))
+				insert(p);
+			flags(p) |= flags(c);
+
+			if (opts.first_parent)
+				break;
+		}
+	}
+
+	if (!match_cnt)
+		return GIT_ENOTFOUND;
+
+	std::stable_sort(all_matches.begin(), all_matches.end(),
+			 [](const possible_tag &a, const possible_tag &b) {
+		if (a.depth != b.depth)
+			return a.depth < b.depth;
+		return a.found_order < b.found_order;
+	});
+
+	if (gave_up_on)
+		insert(gave_up_on);
+
+	/* Count the commits not reachable from the best candidate */
+	possible_tag &best = all_matches[0];
+
+	while (!list.empty()) {
+		commit *c = pop();
+
+		if (flags(c) & best.flag_within) {
+			bool all_within = true;
+
+			for (auto &q : list) {
+				if (!(flags(q.c) & best.flag_within)) {
+					all_within = false;
+					break;
+				}
+			}
+
+			if (all_within)
+				break;
+		} else {
+			best.depth++;
+		}
+
+		/* git does not honor --first-parent here either */
+		for (auto p : c->parents) {
+			error = parse(p);
+			if (error < 0)
+				return error;
+
+			if (!(flags(p) & SEEN))
+				insert(p);
+			flags(p) |= flags(c);
+		}
+	}
+
+	*tag   = best.name;
+	*depth = best.depth;
+
+	return 0;
+}
+
+int describer::describe(const git_oid *oid, std::string &out)
+{
+	const tag_table::tag *tag;
+	unsigned depth;
+	int error;
+
+	error = describe(oid, &tag, &depth);
+	if (error < 0)
+		return error;
+
+	format(oid, tag, depth, out);
+
+	return 0;
+}
+
+void describer::format(const git_oid *oid, const tag_table::tag *tag, unsigned depth,
+		       std::string &out) const
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	out = tag->name;
+
+	/* Exact matches only get a suffix in long format */
+	if (depth == 0 ? opts.long_format : opts.abbrev != 0) {
+		git_oid_tostr(hex, sizeof(hex), oid);
+		out += "-" + std::to_string(depth) + "-g" + std::string(hex, std::min(opts.abbrev, 40U));
+	}
+}
+
+/*
+ * Generation numbers come from the commit-graph. Commits not in it get one
+ * more than the highest of their parents, the same topological level the
+ * commit-graph stores. Without a commit-graph, that means reading all of the
+ * history once, but only once per describer.
+ */
+int approx_describer::lookup(const git_oid &oid, node **out)
+{
+	std::vector<git_oid> stack;
+	std::vector<uint32_t> parents;
+	int error;
+
+	auto it = nodes.find(oid);
+	if (it != nodes.end()) {
+		*out = &it->second;
+		return 0;
+	}
+
+	stack.push_back(oid);
+
+	while (!stack.empty()) {
+		git_oid cur = stack.back();
+		uint32_t pos, generation = 0;
+		bool missing = false;
+		node n;
+
+		if (nodes.find(cur) != nodes.end()) {
+			stack.pop_back();
+			continue;
+		}
+
+		n.linked = false;
+		n.epoch  = 0;
+
+		if (graph && graph->find(&cur, &pos)) {
+			n.generation = graph->generation(pos);
+			graph->parents(pos, parents);
+			for (auto p : parents) {
+				git_oid parent;
+
+				graph->oid(p, &parent);
+				n.parent_ids.push_back(parent);
+			}
+
+			nodes.emplace(cur, std::move(n));
+			stack.pop_back();
+			continue;
+		}
+
+		{
+			git_commit *commit;
+
+			error = git_commit_lookup(&commit, repo, &cur);
+			if (error < 0)
+				return error;
+
+			for (unsigned i = 0; i < git_commit_parentcount(commit); i++)
+				n.parent_ids.push_back(*git_commit_parent_id(commit, i));
+
+			git_commit_free(commit);
+		}
+
+		/* Parents first, the commit is looked up again afterwards */
+		for (auto &p : n.parent_ids) {
+			auto pit = nodes.find(p);
+
+			if (pit == nodes.end()) {
+				stack.push_back(p);
+				missing = true;
+			} else {
+				generation = std::max(generation, pit->second.generation);
+			}
+		}
+
+		if (missing)
+			continue;
+
+		n.generation = generation + 1;
+		nodes.emplace(cur, std::move(n));
+		stack.pop_back();
+	}
+
+	*out = &nodes.find(oid)->second;
+
+	return 0;
+}
+
+/* Nodes stay where they are in the map, so parents are kept as pointers */
+int approx_describer::link(node *n)
+{
+	int error;
+
+	if (n->linked)
+		return 0;
+
+	for (auto &id : n->parent_ids) {
+		node *p;
+
+		error = lookup(id, &p);
+		if (error < 0)
+			return error;
+
+		n->parents.push_back(p);
+	}
+	n->linked = true;
+
+	return 0;
+}
+
+int approx_describer::init_candidates()
+{
+	for (auto &t : tags) {
+		git_commit *commit;
+		candidate c;
+
+		if (!opts.tags && t.second.prio < 2)
+			continue;
+
+		/* Tags of trees or blobs are no candidates */
+		if (git_commit_lookup(&commit, repo, &t.first) < 0)
+			continue;
+
+		c.time = git_commit_time(commit);
+		git_commit_free(commit);
+
+		if (lookup(t.first, &c.n) < 0)
+			continue;
+
+		c.tag = &t.second;
+		candidates.push_back(c);
+	}
+
+	std::sort(candidates.begin(), candidates.end(),
+		  [](const candidate &a, const candidate &b) {
+		if (a.time != b.time)
+			return a.time > b.time;
+		/* Of commits made in the same second, the descendant is newer */
+		if (a.n->generation != b.n->generation)
+			return a.n->generation > b.n->generation;
+		return a.tag->name < b.tag->name;
+	});
+
+	have_candidates = true;
+
+	return 0;
+}
+
+/*
+ * Walks from the commit in order of decreasing generation. Before checking a
+ * candidate, every commit above its generation is expanded, so all commits
+ * of the history at or above it have been seen, and the candidate is in the
+ * history exactly when it was seen. The walk only goes down as far as the
+ * lowest generation of the candidates checked.
+ */
+int approx_describer::describe(const git_oid *oid, const tag_table::tag **tag, unsigned *distance)
+{
+	std::vector<node *> frontier;
+	node *tip;
+	int error;
+
+	auto lower = [](const node *a, const node *b) {
+		return a->generation < b->generation;
+	};
+
+	if (!have_candidates) {
+		error = init_candidates();
+		if (error < 0)
+			return error;
+	}
+
+	error = lookup(*oid, &tip);
+	if (error < 0)
+		return error;
+
+	epoch++;
+	tip->epoch = epoch;
+	frontier.push_back(tip);
+
+	for (auto &c : candidates) {
+		if (c.n->generation > tip->generation)
+			continue;
+
+		while (!frontier.empty() && frontier.front()->generation > c.n->generation) {
+			node *n = frontier.front();
+
+			std::pop_heap(frontier.begin(), frontier.end(), lower);
+			frontier.pop_back();
+
+			error = link(n);
+			if (error < 0)
+				return error;
+
+			for (auto p : n->parents) {
+				if (p->epoch != epoch) {
+					p->epoch = epoch;
+					frontier.push_back(p);
+					std::push_heap(frontier.begin(), frontier.end(), lower);
+				}
+
+				if (opts.first_parent)
+					break;
+			}
+		}
+
+		if (c.n->epoch == epoch) {
+			*tag      = c.tag;
+			*distance = tip->generation - c.n->generation;
+			return 0;
+		}
+	}
+
+	return GIT_ENOTFOUND;
+}
+
+void approx_describer::format(const git_oid *oid, const tag_table::tag *tag, unsigned distance,
+			      std::string &out) const
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	out = tag->name;
+
+	if (distance == 0 ? opts.long_format : opts.abbrev != 0) {
+		git_oid_tostr(hex, sizeof(hex), oid);
+		out += "-~" + std::to_string(distance) + "-g" + std::string(hex, std::min(opts.abbrev, 40U));
+	}
+}
+
+/*
+ * Walks from the tags in order of their age, oldest first, and labels every
+ * commit reached with the tag the walk started from. A commit labeled
+ * before is reachable from an older tag, and so is everything behind it, so
+ * the walk stops there. That way every commit is visited at most once for
+ * all tags together, and the labels of the tips are final as soon as they
+ * are set, which allows to stop once all tips have one.
+ */
+int contained_in(git_repository *repo, const tag_table &tags, const describe_options &opts,
+		 const std::vector<git_oid> &tips, std::vector<std::string> &out)
+{
+	std::unordered_map<git_oid, std::vector<size_t>, oid_hash, oid_equal> tip_index;
+	std::unordered_set<git_oid, oid_hash, oid_equal> labeled;
+	struct candidate {
+		git_time_t time;
+		const tag_table::tag *tag;
+		git_oid oid;
+	};
+	std::vector<candidate> candidates;
+	std::vector<git_oid> stack;
+	size_t remaining;
+	int error;
+
+	out.assign(tips.size(), std::string());
+
+	for (size_t i = 0; i < tips.size(); i++)
+		tip_index[tips[i]].push_back(i);
+	remaining = tip_index.size();
+
+	for (auto &t : tags) {
+		git_commit *commit;
+
+		if (!opts.tags && t.second.prio < 2)
+			continue;
+
+		/* Tags of trees or blobs contain no commits */
+		if (git_commit_lookup(&commit, repo, &t.first) < 0)
+			continue;
+
+		candidates.push_back({ git_commit_time(commit), &t.second, t.first });
+		git_commit_free(commit);
+	}
+
+	std::sort(candidates.begin(), candidates.end(),
+		  [](const candidate &a, const candidate &b) {
+		if (a.time != b.time)
+			return a.time < b.time;
+		return a.tag->name < b.tag->name;
+	});
+
+	for (auto &c : candidates) {
+		if (remaining == 0)
+			break;
+
+		stack.push_back(c.oid);
+
+		while (!stack.empty()) {
+			git_oid oid = stack.back();
+			git_commit *commit;
+
+			stack.pop_back();
+
+			if (!labeled.insert(oid).second)
+				continue;
+
+			auto tip = tip_index.find(oid);
+			if (tip != tip_index.end()) {
+				for (auto i : tip->second)
+					out[i] = c.tag->name;
+				if (--remaining == 0)
+					break;
+			}
+
+			error = git_commit_lookup(&commit, repo, &oid);
+			if (error < 0)
+				return error;
+
+			for (unsigned i = 0; i < git_commit_parentcount(commit); i++) {
+				const git_oid *parent = git_commit_parent_id(commit, i);
+
+				if (labeled.find(*parent) == labeled.end())
+					stack.push_back(*parent);
+			}
+
+			git_commit_free(commit);
+		}
+
+		stack.clear();
+	}
+
+	return 0;
+}
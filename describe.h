@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * describe.h - Describe commits relative to the nearest tag, like git describe
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __DESCRIBE_H
+#define __DESCRIBE_H
+
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <git2.h>
+
+#include "commitgraph.h"
+#include "refs.h"
+
+/* Same limits as git describe */
+#define DESCRIBE_CANDIDATES	10
+#define DESCRIBE_MAX_CANDIDATES	25
+
+struct describe_options {
+	std::vector<std::string> match;
+	std::vector<std::string> exclude;
+	unsigned candidates;
+	bool tags;
+	bool first_parent;
+	/* Append -<depth>-g<abbreviated id> even for exact matches */
+	bool long_format;
+	unsigned abbrev;
+
+	describe_options()
+		: candidates(DESCRIBE_CANDIDATES), tags(false), first_parent(false),
+		  long_format(false), abbrev(0)
+	{}
+};
+
+struct oid_hash {
+	size_t operator()(const git_oid &oid) const
+	{
+		size_t h;
+
+		memcpy(&h, oid.id, sizeof(h));
+
+		return h;
+	}
+};
+
+struct oid_equal {
+	bool operator()(const git_oid &a, const git_oid &b) const
+	{
+		return git_oid_equal(&a, &b);
+	}
+};
+
+/*
+ * The tags which can be used to describe a commit, keyed by the commit they
+ * point to. Built once and shared read-only by all describe workers, so the
+ * --match and --exclude patterns are only applied once per tag.
+ */
+class tag_table {
+public:
+	struct tag {
+		std::string name;
+		/* 2 for annotated and 1 for lightweight tags */
+		int prio;
+		git_time_t date;
+	};
+
+private:
+	std::unordered_map<git_oid, tag, oid_hash, oid_equal> tags;
+
+public:
+	int build(git_repository *repo, ref_store &refs, const describe_options &opts);
+
+	const tag *find(const git_oid *oid) const
+	{
+		auto it = tags.find(*oid);
+
+		return it == tags.end() ? NULL : &it->second;
+	}
+
+	bool empty() const
+	{
+		return tags.empty();
+	}
+
+	/* Iterates over (commit id, tag) pairs */
+	decltype(tags)::const_iterator begin() const
+	{
+		return tags.begin();
+	}
+
+	decltype(tags)::const_iterator end() const
+	{
+		return tags.end();
+	}
+};
+
+/*
+ * Describes commits with the algorithm of git describe. Parsed commits are
+ * cached between calls, so one describer per thread should be used for all
+ * commits it describes. Commits in the commit-graph are read from there
+ * instead of being parsed from the object database.
+ */
+class describer {
+	struct commit;
+	struct queued;
+	struct queue_less;
+
+	git_repository *repo;
+	const tag_table &tags;
+	const describe_options &opts;
+	const commit_graph *graph;
+	std::unordered_map<git_oid, commit *, oid_hash, oid_equal> commits;
+	unsigned epoch;
+
+	commit *lookup(const git_oid *oid);
+	int parse(commit *c);
+
+public:
+	describer(git_repository *r, const tag_table &t, const describe_options &o,
+		  const commit_graph *g = NULL)
+		: repo(r), tags(t), opts(o), graph(g), epoch(0)
+	{}
+
+	~describer();
+
+	/*
+	 * Finds the tag describing the commit and the number of commits not
+	 * reachable from it, which is 0 only for exact matches. Returns
+	 * GIT_ENOTFOUND if no tag describes the commit.
+	 */
+	int describe(const git_oid *oid, const tag_table::tag **tag, unsigned *depth);
+
+	int describe(const git_oid *oid, std::string &out);
+
+	/* Formats the result of describe() according to the options */
+	void format(const git_oid *oid, const tag_table::tag *tag, unsigned depth,
+		    std::string &out) const;
+};
+
+/*
+ * Finds the newest tag whose commit is in the history of a commit, ordered
+ * by the date of the tagged commits. Unlike describer, candidates are not
+ * ranked by distance, the first one found wins. The distance reported is
+ * the difference of the generation numbers, a lower bound of the real one.
+ */
+class approx_describer {
+	struct node {
+		uint32_t generation;
+		std::vector<git_oid> parent_ids;
+		/* Resolved when the node is first expanded */
+		std::vector<node *> parents;
+		bool linked;
+		/* Seen in the walk of the current describe() call */
+		unsigned epoch;
+	};
+
+	struct candidate {
+		git_time_t time;
+		const tag_table::tag *tag;
+		node *n;
+	};
+
+	git_repository *repo;
+	const tag_table &tags;
+	const describe_options &opts;
+	const commit_graph *graph;
+	std::unordered_map<git_oid, node, oid_hash, oid_equal> nodes;
+	std::vector<candidate> candidates;
+	bool have_candidates;
+	unsigned epoch;
+
+	int lookup(const git_oid &oid, node **out);
+	int link(node *n);
+	int init_candidates();
+
+public:
+	approx_describer(git_repository *r, const tag_table &t, const describe_options &o,
+			 const commit_graph *g = NULL)
+		: repo(r), tags(t), opts(o), graph(g), have_candidates(false), epoch(0)
+	{}
+
+	/* Returns GIT_ENOTFOUND if no tag is in the history of the commit */
+	int describe(const git_oid *oid, const tag_table::tag **tag, unsigned *distance);
+
+	/* Like describer::format(), with a ~ marking the distance as approximate */
+	void format(const git_oid *oid, const tag_table::tag *tag, unsigned distance,
+		    std::string &out) const;
+};
+
+/*
+ * Sets out[i] to the oldest tag containing tips[i], or leaves it empty if no
+ * tag contains it. Tags are ordered by the date of the tagged commit.
+ */
+int contained_in(git_repository *repo, const tag_table &tags, const describe_options &opts,
+		 const std::vector<git_oid> &tips, std::vector<std::string> &out);
+
+#endif
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * extsort.cc - Sorting refs by date with bounded memory
+ *
+ * A name entry is the object id, the 16 bit offset of the branch name in
+ * the ref name, and the zero terminated ref name. Records point to these
+ * entries by their offset in the names file, which is mapped for merging,
+ * so ties and the output read the names from the page cache instead of the
+ * heap.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <queue>
+
+#include <sys/mman.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "extsort.h"
+
+#define NAME_ENTRY_HEADER	(GIT_OID_RAWSZ + 2)
+
+/* Records per run read at once while merging, at least */
+#define MIN_MERGE_BUFFER	256
+
+/* Reported like libgit2 errors, so the pipeline passes them on */
+static int os_error(const std::string &what)
+{
+	std::string msg = what + ": " + strerror(errno);
+
+	giterr_set_str(GITERR_OS, msg.c_str());
+
+	return -1;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = (const char *)data;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p   += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+ref_sorter::~ref_sorter()
+{
+	if (names_map)
+		munmap((void *)names_map, names_size);
+	if (names_fd >= 0)
+		close(names_fd);
+	if (runs_fd >= 0)
+		close(runs_fd);
+}
+
+/* Removed right away, so nothing is left behind */
+int ref_sorter::temp_file()
+{
+	const char *dir = getenv("TMPDIR");
+	std::string path;
+	int fd;
+
+	path = std::string(dir && *dir ? dir : "/tmp") + "/git-recent-XXXXXX";
+
+	fd = mkostemp(&path[0], O_CLOEXEC);
+	if (fd < 0)
+		return os_error("Can't create temporary file " + path);
+
+	unlink(path.c_str());
+
+	return fd;
+}
+
+const char *ref_sorter::name_at(const char *base, uint64_t offset) const
+{
+	return base + offset + NAME_ENTRY_HEADER;
+}
+
+void ref_sorter::sort_run()
+{
+	const char *base = names.data() - names_base;
+
+	std::sort(records.begin(), records.end(), [this, base](const record &a, const record &b) {
+		if (a.last != b.last)
+			return a.last > b.last;
+		return strcmp(name_at(base, a.offset), name_at(base, b.offset)) < 0;
+	});
+}
+
+int ref_sorter::spill()
+{
+	run r;
+
+	if (names_fd < 0) {
+		names_fd = temp_file();
+		runs_fd  = temp_file();
+		if (names_fd < 0 || runs_fd < 0)
+			return -1;
+	}
+
+	sort_run();
+
+	r.start = runs.empty() ? 0 : runs.back().start + runs.back().count;
+	r.count = records.size();
+
+	if (write_all(names_fd, names.data(), names.size()) < 0 ||
+	    write_all(runs_fd, records.data(), records.size() * sizeof(record)) < 0)
+		return os_error("Can't write temporary file");
+
+	runs.push_back(r);
+	names_base += names.size();
+
+	/* The buffers are kept, the next run fills them again */
+	names.clear();
+	records.clear();
+
+	return 0;
+}
+
+int ref_sorter::add(time_t last, const std::string &ref, size_t name, const git_oid *oid)
+{
+	size_t entry = NAME_ENTRY_HEADER + ref.size() + 1;
+	uint16_t name_off = name;
+	record rec;
+	int error;
+
+	/* Growing the buffers may double them, half the limit is for that */
+	if (!records.empty() &&
+	    names.size() + entry + (records.size() + 1) * sizeof(record) > limit / 2) {
+		error = spill();
+		if (error)
+			return error;
+	}
+
+	rec.last   = last;
+	rec.offset = names_base + names.size();
+	records.push_back(rec);
+
+	names.append((const char *)oid->id, GIT_OID_RAWSZ);
+	names.append((const char *)&name_off, sizeof(name_off));
+	names.append(ref.c_str(), ref.size() + 1);
+
+	return 0;
+}
+
+int ref_sorter::foreach(const sorted_ref_cb &cb)
+{
+	struct cursor {
+		std::vector<record> buf;
+		size_t pos;
+		uint64_t next;		// Next record to read from the run
+		uint64_t end;
+	};
+	std::vector<cursor> cursors;
+	size_t per_run;
+	int error;
+
+	auto emit = [&cb, this](const char *base, const record &r) {
+		const char *entry = base + r.offset;
+		git_oid oid;
+		uint16_t name;
+
+		memcpy(oid.id, entry, GIT_OID_RAWSZ);
+		memcpy(&name, entry + GIT_OID_RAWSZ, sizeof(name));
+
+		return cb(r.last, name_at(base, r.offset), name, &oid);
+	};
+
+	/* Everything fit into memory */
+	if (runs.empty()) {
+		const char *base = names.data() - names_base;
+
+		sort_run();
+
+		for (auto &r : records) {
+			error = emit(base, r);
+			if (error)
+				return error;
+		}
+
+		return 0;
+	}
+
+	if (!records.empty()) {
+		error = spill();
+		if (error)
+			return error;
+	}
+
+	/* The run buffers are not needed any more */
+	std::string().swap(names);
+	std::vector<record>().swap(records);
+
+	names_size = names_base;
+	names_map  = (const char *)mmap(NULL, names_size, PROT_READ, MAP_PRIVATE, names_fd, 0);
+	if (names_map == MAP_FAILED) {
+		names_map = NULL;
+		return os_error("Can't map temporary file");
+	}
+	madvise((void *)names_map, names_size, MADV_RANDOM);
+
+	per_run = std::max<size_t>(limit / sizeof(record) / runs.size(), MIN_MERGE_BUFFER);
+
+	auto fill = [this, per_run](cursor &c) {
+		size_t n = std::min<uint64_t>(per_run, c.end - c.next);
+		ssize_t len;
+
+		c.buf.resize(n);
+		c.pos = 0;
+
+		len = pread(runs_fd, c.buf.data(), n * sizeof(record), c.next * sizeof(record));
+		if (len != (ssize_t)(n * sizeof(record)))
+			return false;
+
+		c.next += n;
+
+		return true;
+	};
+
+	/* The heap has the cursor with the first record in order on top */
+	auto after = [&cursors, this](size_t a, size_t b) {
+		const record &ra = cursors[a].buf[cursors[a].pos];
+		const record &rb = cursors[b].buf[cursors[b].pos];
+
+		if (ra.last != rb.last)
+			return ra.last < rb.last;
+		return strcmp(name_at(names_map, ra.offset), name_at(names_map, rb.offset)) > 0;
+	};
+	std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heap(after);
+
+	cursors.resize(runs.size());
+	for (size_t i = 0; i < runs.size(); i++) {
+		cursors[i].next = runs[i].start;
+		cursors[i].end  = runs[i].start + runs[i].count;
+		if (!fill(cursors[i]))
+			goto err_read;
+		heap.push(i);
+	}
+
+	while (!heap.empty()) {
+		size_t i = heap.top();
+		cursor &c = cursors[i];
+
+		heap.pop();
+
+		error = emit(names_map, c.buf[c.pos]);
+		if (error)
+			return error;
+
+		if (++c.pos == c.buf.size()) {
+			if (c.next == c.end)
+				continue;
+			if (!fill(c))
+				goto err_read;
+		}
+
+		heap.push(i);
+	}
+
+	return 0;
+
+err_read:
+	return os_error("Can't read temporary file");
+}
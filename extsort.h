@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * extsort.h - Sorting refs by date with bounded memory
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __EXTSORT_H
+#define __EXTSORT_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+#include <git2.h>
+
+/* Called in git-recent order, name is where the branch name starts in ref */
+typedef std::function<int(time_t last, const char *ref, size_t name, const git_oid *oid)> sorted_ref_cb;
+
+/*
+ * Sorts refs newest first, like branch::operator<, using about limit bytes
+ * of memory. Refs are collected into a run until it is full, then the run is
+ * sorted and written to a temporary file as (date, name offset) records,
+ * while the names go to a second file. The runs are merged in the end. As
+ * long as everything fits into one run, no file is written.
+ */
+class ref_sorter {
+	struct record {
+		int64_t last;
+		uint64_t offset;	// Into the names
+	};
+
+	struct run {
+		uint64_t start;		// Record index in the runs file
+		uint64_t count;
+	};
+
+	size_t limit;
+	std::string names;		// Names of the current run
+	uint64_t names_base;		// Offset of names in the names file
+	std::vector<record> records;	// Records of the current run
+	std::vector<run> runs;
+	int names_fd;
+	int runs_fd;
+	const char *names_map;
+	size_t names_size;
+
+	int temp_file();
+	int spill();
+	void sort_run();
+	const char *name_at(const char *base, uint64_t offset) const;
+
+public:
+	explicit ref_sorter(size_t l)
+		: limit(l), names_base(0), names_fd(-1), runs_fd(-1), names_map(NULL),
+		  names_size(0)
+	{}
+
+	~ref_sorter();
+
+	int add(time_t last, const std::string &ref, size_t name, const git_oid *oid);
+
+	/* Passes all refs to cb, in order. Stops when cb returns non-zero. */
+	int foreach(const sorted_ref_cb &cb);
+};
+
+#endif
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * format.cc - Output templates of git-recent --format
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iostream>
+
+#include <string.h>
+#include <time.h>
+
+#include "format.h"
+
+#define OID_SHORT	7
+
+static const char *weekdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *months[]   = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+				  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Zero-padded to width, without going through the locale of iostreams */
+static void append_number(std::string &out, unsigned long long v, int width = 0)
+{
+	char buf[24];
+	int i = sizeof(buf);
+
+	do {
+		buf[--i] = '0' + v % 10;
+		v /= 10;
+		width--;
+	} while (v);
+
+	while (width-- > 0)
+		buf[--i] = '0';
+
+	out.append(buf + i, sizeof(buf) - i);
+}
+
+static void append_tz(std::string &out, long offset, bool strict)
+{
+	unsigned long abs = offset < 0 ? -offset : offset;
+
+	out += offset < 0 ? '-' : '+';
+	append_number(out, abs / 3600, 2);
+	if (strict)
+		out += ':';
+	append_number(out, abs / 60 % 60, 2);
+}
+
+static void append_date(std::string &out, const struct tm &tm, char sep)
+{
+	append_number(out, tm.tm_year + 1900, 4);
+	out += '-';
+	append_number(out, tm.tm_mon + 1, 2);
+	out += '-';
+	append_number(out, tm.tm_mday, 2);
+	if (sep == 0)
+		return;
+	out += sep;
+	append_number(out, tm.tm_hour, 2);
+	out += ':';
+	append_number(out, tm.tm_min, 2);
+	out += ':';
+	append_number(out, tm.tm_sec, 2);
+}
+
+void branch_format::add_literal(const char *str, size_t len)
+{
+	if (len == 0)
+		return;
+
+	/* Text around escapes ends up in one op */
+	if (!ops.empty() && ops.back().type == OP_LITERAL &&
+	    ops.back().offset + ops.back().len == literals.size()) {
+		ops.back().len += len;
+	} else {
+		op o;
+
+		o.type   = OP_LITERAL;
+		o.offset = literals.size();
+		o.len    = len;
+		ops.push_back(o);
+	}
+
+	literals.append(str, len);
+}
+
+bool branch_format::compile(const std::string &tmpl)
+{
+	static const struct {
+		const char *name;
+		op_type type;
+	} fields[] = {
+		{ "refname",			OP_REFNAME		},
+		{ "refname:short",		OP_REFNAME_SHORT	},
+		{ "objectname",			OP_OBJECTNAME		},
+		{ "objectname:short",		OP_OBJECTNAME_SHORT	},
+		{ "committerdate",		OP_DATE			},
+		{ "committerdate:unix",		OP_DATE_UNIX		},
+		{ "committerdate:iso",		OP_DATE_ISO		},
+		{ "committerdate:iso8601",	OP_DATE_ISO		},
+		{ "committerdate:iso-strict",	OP_DATE_ISO_STRICT	},
+		{ "committerdate:iso8601-strict", OP_DATE_ISO_STRICT	},
+		{ "committerdate:short",	OP_DATE_SHORT		},
+		{ "HEAD",			OP_HEAD			},
+		{ "describe",			OP_DESCRIBE		},
+		{ "contained",			OP_CONTAINED		},
+	};
+	const char *s = tmpl.c_str();
+	size_t i = 0;
+
+	while (i < tmpl.size()) {
+		const char *pct = strchr(s + i, '%');
+		size_t close;
+
+		if (pct == NULL) {
+			add_literal(s + i, tmpl.size() - i);
+			break;
+		}
+
+		add_literal(s + i, pct - (s + i));
+		i = pct - s;
+
+		if (s[i + 1] == '%') {
+			add_literal("%", 1);
+			i += 2;
+		} else if (s[i + 1] == '(') {
+			std::string name;
+			bool found = false;
+
+			close = tmpl.find(')', i);
+			if (close == std::string::npos) {
+				std::cerr << "Error: Unterminated field in format: " << s + i << std::endl;
+				return false;
+			}
+
+			name = tmpl.substr(i + 2, close - i - 2);
+			for (auto &f : fields) {
+				op o;
+
+				if (name != f.name)
+					continue;
+
+				o.type   = f.type;
+				o.offset = 0;
+				o.len    = 0;
+				ops.push_back(o);
+				found = true;
+				break;
+			}
+
+			if (!found) {
+				std::cerr << "Error: Unknown field in format: %(" << name << ")" << std::endl;
+				return false;
+			}
+
+			i = close + 1;
+		} else if (hex_value(s[i + 1]) >= 0 && hex_value(s[i + 2]) >= 0) {
+			char c = hex_value(s[i + 1]) * 16 + hex_value(s[i + 2]);
+
+			add_literal(&c, 1);
+			i += 3;
+		} else {
+			add_literal("%", 1);
+			i += 1;
+		}
+	}
+
+	add_literal("\n", 1);
+
+	for (auto &o : ops) {
+		describe   |= o.type == OP_DESCRIBE;
+		contained  |= o.type == OP_CONTAINED;
+		local_time |= o.type == OP_DATE || o.type == OP_DATE_ISO ||
+			      o.type == OP_DATE_ISO_STRICT || o.type == OP_DATE_SHORT;
+	}
+
+	return true;
+}
+
+void branch_format::render(const branch &b, std::string &out) const
+{
+	char hex[GIT_OID_HEXSZ];
+	struct tm tm;
+
+	/* Converted once, even if the template has several dates */
+	if (local_time)
+		localtime_r(&b.last, &tm);
+
+	for (auto &o : ops) {
+		switch (o.type) {
+		case OP_LITERAL:
+			out.append(literals, o.offset, o.len);
+			break;
+		case OP_REFNAME:
+			out += b.ref;
+			break;
+		case OP_REFNAME_SHORT:
+			out += b.name;
+			break;
+		case OP_OBJECTNAME:
+			git_oid_fmt(hex, &b.oid);
+			out.append(hex, GIT_OID_HEXSZ);
+			break;
+		case OP_OBJECTNAME_SHORT:
+			git_oid_nfmt(hex, OID_SHORT, &b.oid);
+			out.append(hex, OID_SHORT);
+			break;
+		case OP_DATE:
+			/* Like git's default date format */
+			out += weekdays[tm.tm_wday];
+			out += ' ';
+			out += months[tm.tm_mon];
+			out += ' ';
+			append_number(out, tm.tm_mday);
+			out += ' ';
+			append_number(out, tm.tm_hour, 2);
+			out += ':';
+			append_number(out, tm.tm_min, 2);
+			out += ':';
+			append_number(out, tm.tm_sec, 2);
+			out += ' ';
+			append_number(out, tm.tm_year + 1900);
+			out += ' ';
+			append_tz(out, tm.tm_gmtoff, false);
+			break;
+		case OP_DATE_UNIX:
+			if (b.last < 0) {
+				out += '-';
+				append_number(out, -(long long)b.last);
+			} else {
+				append_number(out, b.last);
+			}
+			break;
+		case OP_DATE_ISO:
+			append_date(out, tm, ' ');
+			out += ' ';
+			append_tz(out, tm.tm_gmtoff, false);
+			break;
+		case OP_DATE_ISO_STRICT:
+			append_date(out, tm, 'T');
+			append_tz(out, tm.tm_gmtoff, true);
+			break;
+		case OP_DATE_SHORT:
+			append_date(out, tm, 0);
+			break;
+		case OP_HEAD:
+			out += b.current ? '*' : ' ';
+			break;
+		case OP_DESCRIBE:
+			out += b.describe;
+			break;
+		case OP_CONTAINED:
+			out += b.contained;
+			break;
+		}
+	}
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * format.h - Output templates of git-recent --format
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __FORMAT_H
+#define __FORMAT_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "branch.h"
+
+/*
+ * A template in the style of git for-each-ref --format. It is compiled once
+ * into a list of ops, rendering a branch then only appends to a buffer.
+ *
+ * Supported are %(refname), %(refname:short), %(objectname),
+ * %(objectname:short), %(committerdate) with the :unix, :iso, :iso-strict
+ * and :short variants, %(HEAD), %(describe), %(contained), as well as %%
+ * and %xx hex escapes.
+ */
+class branch_format {
+	enum op_type {
+		OP_LITERAL,
+		OP_REFNAME,
+		OP_REFNAME_SHORT,
+		OP_OBJECTNAME,
+		OP_OBJECTNAME_SHORT,
+		OP_DATE,
+		OP_DATE_UNIX,
+		OP_DATE_ISO,
+		OP_DATE_ISO_STRICT,
+		OP_DATE_SHORT,
+		OP_HEAD,
+		OP_DESCRIBE,
+		OP_CONTAINED,
+	};
+
+	struct op {
+		op_type type;
+		uint32_t offset;	// Literal text in literals
+		uint32_t len;
+	};
+
+	std::vector<op> ops;
+	std::string literals;
+	bool describe;
+	bool contained;
+	bool local_time;
+
+	void add_literal(const char *str, size_t len);
+
+public:
+	branch_format()
+		: describe(false), contained(false), local_time(false)
+	{}
+
+	/* Returns false and prints an error for unknown fields */
+	bool compile(const std::string &tmpl);
+
+	bool needs_describe() const
+	{
+		return describe;
+	}
+
+	bool needs_contained() const
+	{
+		return contained;
+	}
+
+	/* Appends the line of the branch, including the newline, to out */
+	void render(const branch &b, std::string &out) const;
+};
+
+#endif
@@ -9,123 +9,45 @@
  * TODO:
  *		- Man page
  */
+#include <condition_variable>
 #include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <queue>
 #include <map>
 #include <set>
 
 #include <getopt.h>
+#include <string.h>
 #include <git2.h>
 
+#include "packbitmap.h"
+#include "commitgraph.h"
+#include "perfcount.h"
 #include "version.h"
+#include "alloc.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "refs.h"
 
 #define CLEARLINE	"\033[1K\r"
 
-struct cb_payload {
-	const char *name;
-	git_repository *repo;
-	git_oid oid;
-	bool success;
-
-	cb_payload()
-		: name(0), repo(0), success(false)
-	{}
-};
-
-static int tag_foreach_cb(const char *name, git_oid *oid, void *payload)
-{
-	struct cb_payload *p = (struct cb_payload *)payload;
-	git_tag *tag;
-	int error;
-	std::string n1("refs/tags/"), n2(name);
-
-	n1 += p->name;
-
-	if (n1 != n2)
-		return 0;
-
-	error = git_tag_lookup(&tag, p->repo, oid);
-	if (error) {
-		std::cerr << "Can't lookup tag " << name << std::endl;
-		return 0;
-	}
-
-	if (git_tag_target_type(tag) != GIT_OBJ_COMMIT) {
-		std::cerr << "Tag " << name << " doesn't point to a commit" << std::endl;
-		return 0;
-	}
-
-	git_oid_cpy(&p->oid, git_tag_target_id(tag));
-	p->success = true;
-
-	git_tag_free(tag);
-
-	return 0;
-}
-
-static bool lookup_target(const char *name, git_repository *repo, git_oid *out_oid)
-{
-	git_reference *target_ref = NULL;
-	struct cb_payload p;
-	const git_oid *ref_oid;
-	bool ret = true;
-	std::string ref;
-	int error;
-
-	/* First check if it is a commit-id */
-	error = git_oid_fromstr(out_oid, name);
-	if (error == 0)
-		goto out;
-
-	/* Check local and remote branches */
-	error = git_branch_lookup(&target_ref, repo, name, GIT_BRANCH_LOCAL);
-	if (error == 0)
-		goto have_ref;
-
-	error = git_branch_lookup(&target_ref, repo, name, GIT_BRANCH_REMOTE);
-	if (error == 0)
-		goto have_ref;
-
-	/* Check tags */
-	p.name = name;
-	p.repo = repo;
-
-	git_tag_foreach(repo, tag_foreach_cb, &p);
-
-	if (!p.success) {
-		ret = false;
-		goto out;
-	}
-
-	git_oid_cpy(out_oid, &p.oid);
-
-out:
-	if (target_ref)
-		git_reference_free(target_ref);
-
-	return ret;
-
-have_ref:
-	ref_oid = git_reference_target(target_ref);
-	if (ref_oid == NULL) {
-		ret = false;
-		goto out;
-	}
-
-	git_oid_cpy(out_oid, ref_oid);
-
-	goto out;
-}
-
 struct result {
 	bool ff;
 	bool current;
 	bool up2date;
+	size_t ahead;
+	size_t behind;
 
 	result()
-		: ff(false), current(false), up2date(false)
+		: ff(false), current(false), up2date(false), ahead(0), behind(0)
 	{}
 };
 
@@ -135,65 +57,137 @@ struct parameters {
 	bool list;
 	bool verbose;
 	bool all;
+	bool fetch;
+	bool counts;
+	bool write_graph;
 
+	bool perf_counters;
 	std::set<std::string> branches;
 	const char *target;
+	const char *map;
+	run_stats *stats;
 
 	parameters()
 		: not_ff(false), only_ff(false), list(false),
-		  verbose(true), all(false)
+		  verbose(true), all(false), fetch(false),
+		  counts(false), write_graph(false), perf_counters(false),
+		  target(NULL), map(NULL), stats(NULL)
 	{}
 };
 
-static int do_list(git_repository *repo, parameters &params)
+/* Phases are only tracked with --perf-counters */
+static void begin_phase(run_stats *stats, const char *name)
 {
-	git_branch_t flags = GIT_BRANCH_LOCAL;
+	if (stats)
+		stats->begin(name);
+}
+
+/*
+ * With a pack bitmap, the merged check is a bit test in the bitmap of the
+ * commits reachable from the target, and ahead/behind counts are popcounts.
+ * Without one, every branch is checked with a merge-base walk.
+ */
+static int do_list(git_repository *repo, ref_store &refs, parameters &params)
+{
+	std::string objdir = std::string(git_repository_commondir(repo)) + "objects";
 	std::map<std::string, result> results;
 	std::string::size_type max_len = 0;
-	git_branch_iterator *it = NULL;
-	git_branch_t ref_type;
+	pack_bitmap_index bitmaps;
+	bool use_bitmaps = false;
+	std::string head_name;
+	bitmap target_bits;
+	commit_graph graph;
+	bool have_graph;
+	size_t tips = 1, missing = 0;
 	git_oid target_oid;
-	git_reference *ref;
+	uint32_t pos;
 	int error = 0;
 
-	if (!lookup_target(params.target, repo, &target_oid)) {
+	if (!lookup_target(params.target, refs, &target_oid)) {
 		std::cerr << "Can't resolve " << params.target << std::endl;
 		goto out;
 	}
 
-	error = git_branch_iterator_new(&it, repo, flags);
-	if (error < 0)
-		goto out;
+	head_name = refs.head();
 
-	while (git_branch_next(&ref, &ref_type, it) == 0) {
-		const git_oid *branch_oid;
-		const char *name;
+	begin_phase(params.stats, "reachability");
+
+	have_graph = graph.open(objdir) == 0;
+
+	/* Broken or missing bitmaps only make listing slower */
+	if (bitmaps.open(repo, objdir, have_graph ? &graph : NULL) == 0)
+		use_bitmaps = bitmaps.reachable(&target_oid, target_bits) == 0;
+
+	if (have_graph && !graph.find(&target_oid, &pos))
+		missing++;
+
+	error = refs.foreach("refs/heads/", [&](const char *refname, const git_oid *branch_oid) {
+		const char *name = refname + strlen("refs/heads/");
 		git_oid mb_oid;
+		result res;
+		int ret;
 
-		error = git_branch_name(&name, ref);
-		if (error < 0)
-			goto out;
+		if (branch_oid == NULL)
+			return 0;
 
 		if (!params.branches.empty() &&
 		     params.branches.find(name) == params.branches.end())
-			continue;
+			return 0;
 
-		branch_oid = git_reference_target(ref);
+		tips++;
+		if (have_graph && !graph.find(branch_oid, &pos))
+			missing++;
 
-		error = git_merge_base(&mb_oid, repo, branch_oid, &target_oid);
-		if (error < 0)
-			goto out;
+		PROBE2(branch, refname, branch_oid->id);
 
-		if (git_oid_cmp(branch_oid, &mb_oid) == 0) {
-			results[name].ff = true;
+		trace_span span(use_bitmaps ? "bitmap check" : "merge-base", name);
+
+		if (use_bitmaps) {
+			res.ff = bitmaps.contains(target_bits, branch_oid);
+
+			if (params.counts) {
+				bitmap branch_bits;
+
+				ret = bitmaps.reachable(branch_oid, branch_bits);
+				if (ret < 0)
+					return ret;
+
+				res.ahead  = bitmaps.count_commits(branch_bits, target_bits);
+				res.behind = bitmaps.count_commits(target_bits, branch_bits);
+			}
+		} else {
+			PROBE3(merge_base_start, name, branch_oid->id, target_oid.id);
+			ret = git_merge_base(&mb_oid, repo, branch_oid, &target_oid);
+			PROBE3(merge_base_end, name, ret == 0 ? mb_oid.id : NULL, ret);
+			if (ret < 0 && ret != GIT_ENOTFOUND)
+				return ret;
+
+			/* Unrelated histories have no merge base */
+			res.ff = ret == 0 && git_oid_cmp(branch_oid, &mb_oid) == 0;
+
+			if (params.counts) {
+				ret = git_graph_ahead_behind(&res.ahead, &res.behind, repo,
+							     branch_oid, &target_oid);
+				if (ret < 0)
+					return ret;
+			}
 		}
 
 		if (git_oid_cmp(branch_oid, &target_oid) == 0) {
-			results[name].up2date = true;
+			res.up2date = true;
 		}
 
-		results[name].current = (git_branch_is_head(ref) == 1);
-	}
+		res.current = (head_name == refname);
+		results[name] = res;
+
+		return 0;
+	});
+	if (error < 0)
+		goto out;
+
+	commit_graph_hint("git-ff", have_graph ? &graph : NULL, tips, missing);
+
+	begin_phase(params.stats, "output");
 
 	for (auto &s : results)
 		max_len = std::max(s.first.size(), max_len);
@@ -224,13 +218,21 @@ static int do_list(git_repository *repo, parameters &params)
 		else
 			std::cout << "non-fast-forward to " << params.target;
 
+		if (params.counts && !s.second.up2date) {
+			std::cout << " (";
+			if (s.second.ahead)
+				std::cout << s.second.ahead << " ahead";
+			if (s.second.ahead && s.second.behind)
+				std::cout << ", ";
+			if (s.second.behind)
+				std::cout << s.second.behind << " behind";
+			std::cout << ")";
+		}
+
 		std::cout << std::endl;
 	}
 
 out:
-	if (it)
-		git_branch_iterator_free(it);
-
 	return error;
 }
 
@@ -254,24 +256,115 @@ static void checkout_progress_cb(const char *path,
 {
 	unsigned per_cent = (completed_steps * 100) / total_steps;
 
+	PROBE3(checkout_progress, path, completed_steps, total_steps);
+
 	std::cout << CLEARLINE;
 	std::cout << "Checking out files: " << per_cent << "% ";
 	std::cout << "(" << completed_steps << '/' << total_steps << ')';
 	std::cout << std::flush;
 }
 
-static int do_ff(git_repository *repo, parameters &params)
+/*
+ * Fast-forward the branch behind ref to target_oid. Returns 1 if the
+ * work-tree could not be checked out, 0 if the branch was fast-forwarded or
+ * skipped and a libgit2 error code otherwise.
+ */
+static int ff_branch(git_repository *repo, git_reference *ref, const char *name,
+		     const git_oid *target_oid, const char *target, bool checkout,
+		     run_stats *stats)
+{
+	const git_oid *branch_oid;
+	git_reference *new_ref;
+	git_oid mb_oid;
+	int error;
+
+	branch_oid = git_reference_target(ref);
+
+	begin_phase(stats, "reachability");
+
+	{
+		trace_span span("merge-base", name);
+
+		PROBE3(merge_base_start, name, branch_oid->id, target_oid->id);
+		error = git_merge_base(&mb_oid, repo, branch_oid, target_oid);
+		PROBE3(merge_base_end, name, error == 0 ? mb_oid.id : NULL, error);
+		if (error < 0 && error != GIT_ENOTFOUND)
+			return error;
+	}
+
+	if (error == GIT_ENOTFOUND || git_oid_cmp(branch_oid, &mb_oid) != 0) {
+		std::cerr << "Not possible to fast-forward " << name << std::endl;
+		return 0;
+	}
+
+	if (git_oid_cmp(branch_oid, target_oid) == 0) {
+		std::cout << "Branch " << name << " already on " << target << std::endl;
+		return 0;
+	}
+
+	if (checkout) {
+		git_checkout_options opts;
+		git_object *obj;
+
+		// Updating HEAD, checkout new work-tree
+		begin_phase(stats, "checkout");
+
+		error = git_object_lookup(&obj, repo, target_oid, GIT_OBJ_COMMIT);
+		if (error < 0)
+			return error;
+
+		error = git_checkout_init_options(&opts, GIT_CHECKOUT_OPTIONS_VERSION);
+		if (error < 0) {
+			git_object_free(obj);
+			return error;
+		}
+
+		opts.checkout_strategy	= GIT_CHECKOUT_SAFE;
+		opts.notify_flags	= GIT_CHECKOUT_NOTIFY_CONFLICT;
+		opts.notify_cb		= notify_cb;
+		opts.notify_payload	= (void *)name;
+		opts.progress_cb	= checkout_progress_cb;
+
+		trace_span span("checkout", name);
+		error = git_checkout_tree(repo, obj, &opts);
+		span.end();
+
+		git_object_free(obj);
+
+		if (error != 0)
+			// Checkout conflict or error
+			return error;
+	}
+
+	begin_phase(stats, "update");
+
+	trace_span span("ref write", name);
+	error = git_reference_set_target(&new_ref, ref, target_oid, NULL);
+	span.end();
+	if (error < 0)
+		return error;
+
+	PROBE3(ref_update, git_reference_name(new_ref), branch_oid->id, target_oid->id);
+
+	std::cout << CLEARLINE;
+	std::cout << "fast-forwared " << name << " to " << target << std::endl;
+
+	git_reference_free(new_ref);
+
+	return 0;
+}
+
+static int do_ff(git_repository *repo, ref_store &refs, parameters &params)
 {
 	git_branch_t flags = GIT_BRANCH_LOCAL;
 	git_branch_iterator *it = NULL;
-	git_reference *new_ref;
 	git_branch_t ref_type;
 	git_oid target_oid;
 	git_reference *ref;
 	bool head_only;
 	int error = 0;
 
-	if (!lookup_target(params.target, repo, &target_oid)) {
+	if (!lookup_target(params.target, refs, &target_oid)) {
 		std::cerr << "Can't resolve " << params.target << std::endl;
 		goto out;
 	}
@@ -282,10 +375,10 @@ static int do_ff(git_repository *repo, parameters &params)
 
 	head_only = params.branches.empty() && !params.all;
 
+	begin_phase(params.stats, "scan");
+
 	while (git_branch_next(&ref, &ref_type, it) == 0) {
-		const git_oid *branch_oid;
 		const char *name;
-		git_oid mb_oid;
 
 		if (head_only && (git_branch_is_head(ref) != 1))
 			continue;
@@ -298,68 +391,673 @@ static int do_ff(git_repository *repo, parameters &params)
 		     params.branches.find(name) == params.branches.end())
 			continue;
 
-		branch_oid = git_reference_target(ref);
+		PROBE2(branch, git_reference_name(ref), git_reference_target(ref)->id);
 
-		error = git_merge_base(&mb_oid, repo, branch_oid, &target_oid);
+		error = ff_branch(repo, ref, name, &target_oid, params.target,
+				  head_only || (git_branch_is_head(ref) == 1), params.stats);
 		if (error < 0)
 			goto out;
 
-		if (git_oid_cmp(branch_oid, &mb_oid) != 0) {
-			std::cerr << "Not possible to fast-forward " << name << std::endl;
-			continue;
+		begin_phase(params.stats, "scan");
+	}
+out:
+	if (it)
+		git_branch_iterator_free(it);
+
+	return error;
+}
+
+/*
+ * Commits which are older than the oldest unresolved destination by more
+ * than this are not walked by check_pairs(). Pairs left unresolved at that
+ * point are checked one by one with git_graph_descendant_of().
+ */
+#define MAP_TIME_SLOP	(24 * 60 * 60)
+
+struct map_ref {
+	std::string key;	// Part of the ref name matched by '*'
+	std::string name;
+	git_oid oid;
+
+	bool operator<(const struct map_ref &r) const
+	{
+		return key < r.key;
+	}
+};
+
+struct map_pair {
+	const map_ref *src;
+	const map_ref *dst;	// NULL if the destination does not exist yet
+	size_t src_idx;		// Bit index of src->oid in the reachability walk
+	bool ff;
+	bool resolved;
+
+	map_pair(const map_ref *s, const map_ref *d)
+		: src(s), dst(d), src_idx(0), ff(false), resolved(false)
+	{}
+};
+
+struct map_node {
+	std::vector<uint64_t> bits;	// Sources this commit is reachable from
+	git_time_t time;
+	bool queued;
+
+	map_node()
+		: bits(), time(0), queued(false)
+	{}
+};
+
+struct oid_less {
+	bool operator()(const git_oid &a, const git_oid &b) const
+	{
+		return git_oid_cmp(&a, &b) < 0;
+	}
+};
+
+typedef std::map<git_oid, map_node, oid_less> map_nodes;
+
+static bool parse_map(const char *map, std::string pattern[2][2])
+{
+	std::string s(map);
+	std::string::size_type colon;
+
+	colon = s.find(':');
+	if (colon == std::string::npos)
+		return false;
+
+	std::string side[2] = { s.substr(0, colon), s.substr(colon + 1) };
+
+	for (int i = 0; i < 2; i++) {
+		std::string::size_type star = side[i].find('*');
+
+		if (star == std::string::npos ||
+		    side[i].find('*', star + 1) != std::string::npos)
+			return false;
+
+		pattern[i][0] = side[i].substr(0, star);
+		pattern[i][1] = side[i].substr(star + 1);
+	}
+
+	return true;
+}
+
+static int collect_map_refs(ref_store &refs, const std::string pattern[2],
+			    std::vector<map_ref> &out)
+{
+	const std::string &prefix = pattern[0], &suffix = pattern[1];
+	int error;
+
+	error = refs.foreach(prefix, [&](const char *refname, const git_oid *oid) {
+		std::string name(refname);
+
+		/* Symbolic refs like refs/remotes/<remote>/HEAD are not mapped */
+		if (oid == NULL ||
+		    name.size() < prefix.size() + suffix.size() ||
+		    name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+			return 0;
+
+		map_ref r;
+		r.key  = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+		r.name = name;
+		git_oid_cpy(&r.oid, oid);
+		out.push_back(r);
+
+		return 0;
+	});
+	if (error < 0)
+		return error;
+
+	std::sort(out.begin(), out.end());
+
+	return 0;
+}
+
+typedef std::pair<git_time_t, git_oid> map_entry;
+
+struct map_entry_cmp {
+	bool operator()(const map_entry &a, const map_entry &b) const
+	{
+		return a.first < b.first;
+	}
+};
+
+typedef std::priority_queue<map_entry, std::vector<map_entry>, map_entry_cmp> map_queue;
+
+static int paint_commit(git_repository *repo, map_nodes &nodes, map_queue &queue,
+			const git_oid *oid, const std::vector<uint64_t> &bits)
+{
+	map_node &node = nodes[*oid];
+	bool changed = false;
+
+	if (node.bits.empty()) {
+		git_commit *commit;
+		int error;
+
+		error = git_commit_lookup(&commit, repo, oid);
+		if (error < 0)
+			return error;
+
+		node.time = git_commit_time(commit);
+		node.bits.resize(bits.size(), 0);
+		git_commit_free(commit);
+	}
+
+	for (size_t i = 0; i < bits.size(); i++) {
+		if ((node.bits[i] | bits[i]) != node.bits[i]) {
+			node.bits[i] |= bits[i];
+			changed = true;
 		}
+	}
 
-		if (git_oid_cmp(branch_oid, &target_oid) == 0) {
-			std::cout << "Branch " << name << " already on " << params.target << std::endl;
+	/* Re-queue commits which learned new sources, e.g. due to clock skew */
+	if (changed && !node.queued) {
+		queue.push(map_entry(node.time, *oid));
+		node.queued = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Check for all pairs at once whether dst is reachable from src. Every
+ * distinct source gets a bit, the bits are painted down the history in
+ * commit-date order and a pair can be fast-forwarded when its destination
+ * commit gets painted with the bit of its source.
+ */
+static int check_pairs(git_repository *repo, std::vector<map_pair> &pairs)
+{
+	std::map<git_oid, std::vector<size_t>, oid_less> targets;
+	std::map<git_oid, size_t, oid_less> sources;
+	std::vector<size_t> by_age;
+	size_t words, oldest = 0;
+	map_queue queue;
+	map_nodes nodes;
+	int error;
+
+	for (size_t i = 0; i < pairs.size(); i++) {
+		map_pair &p = pairs[i];
+
+		if (p.dst == NULL || git_oid_cmp(&p.src->oid, &p.dst->oid) == 0) {
+			p.ff = p.resolved = true;
 			continue;
 		}
 
-		if (head_only || (git_branch_is_head(ref) == 1)) {
-			git_checkout_options opts;
-			git_object *obj;
+		if (sources.find(p.src->oid) == sources.end()) {
+			size_t idx = sources.size();
+			sources[p.src->oid] = idx;
+		}
 
-			// Updating HEAD, checkout new work-tree
-			error = git_object_lookup(&obj, repo, &target_oid, GIT_OBJ_COMMIT);
-			if (error < 0)
-				goto out;
+		p.src_idx = sources[p.src->oid];
+		targets[p.dst->oid].push_back(i);
+		by_age.push_back(i);
+	}
 
-			error = git_checkout_init_options(&opts, GIT_CHECKOUT_OPTIONS_VERSION);
-			if (error < 0) {
-				git_object_free(obj);
-				goto out;
+	if (by_age.empty())
+		return 0;
+
+	words = (sources.size() + 63) / 64;
+
+	/* Looks up the commit times of the targets without queueing them */
+	for (auto &t : targets) {
+		error = paint_commit(repo, nodes, queue, &t.first,
+				     std::vector<uint64_t>(words, 0));
+		if (error < 0)
+			return error;
+	}
+
+	std::sort(by_age.begin(), by_age.end(), [&](size_t a, size_t b) {
+		return nodes[pairs[a].dst->oid].time < nodes[pairs[b].dst->oid].time;
+	});
+
+	for (auto &s : sources) {
+		std::vector<uint64_t> bits(words, 0);
+
+		bits[s.second / 64] |= 1ULL << (s.second % 64);
+		error = paint_commit(repo, nodes, queue, &s.first, bits);
+		if (error < 0)
+			return error;
+	}
+
+	while (!queue.empty()) {
+		git_oid oid = queue.top().second;
+		git_commit *commit;
+
+		while (oldest < by_age.size() && pairs[by_age[oldest]].resolved)
+			oldest += 1;
+
+		if (oldest == by_age.size())
+			break;
+
+		if (queue.top().first + MAP_TIME_SLOP < nodes[pairs[by_age[oldest]].dst->oid].time)
+			break;
+
+		queue.pop();
+
+		map_node &node = nodes[oid];
+		node.queued = false;
+
+		auto t = targets.find(oid);
+		if (t != targets.end()) {
+			for (auto idx : t->second) {
+				map_pair &p = pairs[idx];
+
+				if (node.bits[p.src_idx / 64] & (1ULL << (p.src_idx % 64)))
+					p.ff = p.resolved = true;
 			}
+		}
 
-			opts.checkout_strategy	= GIT_CHECKOUT_SAFE;
-			opts.notify_flags	= GIT_CHECKOUT_NOTIFY_CONFLICT;
-			opts.notify_cb		= notify_cb;
-			opts.notify_payload	= (void *)name;
-			opts.progress_cb	= checkout_progress_cb;
+		error = git_commit_lookup(&commit, repo, &oid);
+		if (error < 0)
+			return error;
+
+		std::vector<uint64_t> bits = node.bits;
 
-			error = git_checkout_tree(repo, obj, &opts);
+		for (unsigned i = 0; i < git_commit_parentcount(commit); i++) {
+			error = paint_commit(repo, nodes, queue,
+					     git_commit_parent_id(commit, i), bits);
 			if (error < 0) {
-				git_object_free(obj);
-				goto out;
+				git_commit_free(commit);
+				return error;
 			}
+		}
 
-			git_object_free(obj);
+		git_commit_free(commit);
+	}
+
+	/* Whatever the walk could not decide is checked the slow way */
+	for (auto &p : pairs) {
+		if (p.resolved)
+			continue;
+
+		error = git_graph_descendant_of(repo, &p.src->oid, &p.dst->oid);
+		if (error < 0)
+			return error;
+
+		p.ff = (error == 1);
+		p.resolved = true;
+	}
+
+	return 0;
+}
+
+static int do_map(git_repository *repo, ref_store &refs, parameters &params)
+{
+	std::vector<map_ref> src_refs, dst_refs;
+	git_transaction *tx = NULL;
+	std::vector<map_pair> pairs;
+	std::string pattern[2][2];
+	std::string head_name;
+	size_t updates = 0;
+	int error = 0;
 
-			if (error > 0)
-				// Checkout conflict
+	if (!parse_map(params.map, pattern)) {
+		std::cerr << "Invalid mapping " << params.map << std::endl;
+		return 1;
+	}
+
+	begin_phase(params.stats, "scan");
+
+	error = collect_map_refs(refs, pattern[0], src_refs);
+	if (error < 0)
+		return error;
+
+	error = collect_map_refs(refs, pattern[1], dst_refs);
+	if (error < 0)
+		return error;
+
+	/* Both lists are sorted by key, pair them up */
+	auto s = src_refs.begin();
+	auto d = dst_refs.begin();
+	while (s != src_refs.end()) {
+		if (d == dst_refs.end() || s->key < d->key) {
+			pairs.emplace_back(map_pair(&*s, NULL));
+			++s;
+		} else if (d->key < s->key) {
+			++d;
+		} else {
+			pairs.emplace_back(map_pair(&*s, &*d));
+			++s;
+			++d;
+		}
+	}
+
+	begin_phase(params.stats, "reachability");
+
+	trace_span walk("reachability");
+	error = check_pairs(repo, pairs);
+	walk.end();
+	if (error < 0)
+		return error;
+
+	/* Never move the branch of a work-tree without checking it out */
+	if (!git_repository_is_bare(repo))
+		head_name = refs.head();
+
+	if (params.list) {
+		std::string::size_type max_len = 0;
+
+		begin_phase(params.stats, "output");
+
+		for (auto &p : pairs)
+			max_len = std::max(max_len, pattern[1][0].size() + p.src->key.size() +
+						    pattern[1][1].size());
+
+		for (auto &p : pairs) {
+			std::string dst = pattern[1][0] + p.src->key + pattern[1][1];
+			bool up2date = p.dst && git_oid_cmp(&p.src->oid, &p.dst->oid) == 0;
+
+			if ((p.ff && params.not_ff) || (!p.ff && params.only_ff))
 				continue;
+
+			if (!params.verbose) {
+				std::cout << dst << std::endl;
+				continue;
+			}
+
+			std::cout << (dst == head_name ? "* " : "  ");
+			std::cout << std::left << std::setw(max_len + 2) << dst;
+
+			if (p.dst == NULL)
+				std::cout << "new from " << p.src->name;
+			else if (up2date)
+				std::cout << "already on " << p.src->name;
+			else if (p.ff)
+				std::cout << "fast-forward to " << p.src->name;
+			else
+				std::cout << "non-fast-forward to " << p.src->name;
+
+			std::cout << std::endl;
 		}
 
-		error = git_reference_set_target(&new_ref, ref, &target_oid, NULL);
+		return 0;
+	}
+
+	begin_phase(params.stats, "update");
+
+	error = git_transaction_new(&tx, repo);
+	if (error < 0)
+		return error;
+
+	for (auto &p : pairs) {
+		std::string dst = pattern[1][0] + p.src->key + pattern[1][1];
+
+		if (p.dst && git_oid_cmp(&p.src->oid, &p.dst->oid) == 0)
+			continue;
+
+		if (!p.ff) {
+			std::cerr << "Not possible to fast-forward " << dst << std::endl;
+			continue;
+		}
+
+		if (dst == head_name) {
+			std::cerr << "Not updating checked-out branch " << dst << std::endl;
+			continue;
+		}
+
+		error = git_transaction_lock_ref(tx, dst.c_str());
+		if (error < 0)
+			goto out;
+
+		error = git_transaction_set_target(tx, dst.c_str(), &p.src->oid,
+						   NULL, "git-ff: fast-forward");
+		if (error < 0)
+			goto out;
+
+		updates += 1;
+	}
+
+	if (updates == 0)
+		goto out;
+
+	{
+		trace_span span("ref write");
+
+		error = git_transaction_commit(tx);
 		if (error < 0)
 			goto out;
+	}
 
-		std::cout << CLEARLINE;
-		std::cout << "fast-forwared " << name << " to " << params.target << std::endl;
+	for (auto &p : pairs) {
+		std::string dst = pattern[1][0] + p.src->key + pattern[1][1];
 
-		git_reference_free(new_ref);
+		if (!p.ff || dst == head_name ||
+		    (p.dst && git_oid_cmp(&p.src->oid, &p.dst->oid) == 0))
+			continue;
+
+		PROBE3(ref_update, dst.c_str(), p.dst ? p.dst->oid.id : NULL, p.src->oid.id);
+
+		if (p.dst)
+			std::cout << "fast-forwarded " << dst << " to " << p.src->name << std::endl;
+		else
+			std::cout << "created " << dst << " from " << p.src->name << std::endl;
 	}
+
 out:
-	if (it)
-		git_branch_iterator_free(it);
+	git_transaction_free(tx);
+
+	return error;
+}
+
+/* Maximum number of remotes fetched in parallel */
+#define FETCH_JOBS	8
+
+struct fetch_result {
+	std::string remote;
+	std::string message;
+	int error;
+};
+
+struct fetch_queue {
+	std::vector<std::string> remotes;
+	std::atomic<size_t> next;
+	std::string path;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<fetch_result> done;
+
+	fetch_queue()
+		: next(0)
+	{}
+};
+
+/*
+ * Fetch thread, every thread works on its own repository object because
+ * libgit2 objects must not be shared between threads.
+ */
+static void fetch_worker(fetch_queue *q)
+{
+	size_t idx;
+
+	trace_thread("fetch");
+
+	while ((idx = q->next++) < q->remotes.size()) {
+		git_repository *repo = NULL;
+		git_remote *remote = NULL;
+		fetch_result r;
+
+		r.remote = q->remotes[idx];
+
+		trace_span span("fetch", r.remote.c_str());
+
+		r.error = git_repository_open(&repo, q->path.c_str());
+		if (r.error == 0)
+			r.error = git_remote_lookup(&remote, repo, r.remote.c_str());
+		if (r.error == 0)
+			r.error = git_remote_fetch(remote, NULL, NULL, NULL);
+
+		if (r.error < 0) {
+			const git_error *e = giterr_last();
+			r.message = e ? e->message : "unknown error";
+		}
+
+		git_remote_free(remote);
+		git_repository_free(repo);
+
+		std::lock_guard<std::mutex> guard(q->lock);
+		q->done.push_back(r);
+		q->cond.notify_one();
+	}
+}
+
+struct tracking_branch {
+	std::string name;
+	std::string refname;
+	std::string remote;
+	std::string upstream;
+	git_oid before;
+	bool have_before;
+};
+
+static int collect_tracking(git_repository *repo, std::vector<tracking_branch> &tracking)
+{
+	git_branch_iterator *it = NULL;
+	git_branch_t ref_type;
+	git_reference *ref;
+	int error;
+
+	error = git_branch_iterator_new(&it, repo, GIT_BRANCH_LOCAL);
+	if (error < 0)
+		return error;
+
+	while (git_branch_next(&ref, &ref_type, it) == 0) {
+		git_buf remote = { 0 }, upstream = { 0 };
+		tracking_branch t;
+		const char *name;
+
+		if (git_branch_name(&name, ref) < 0 ||
+		    git_branch_upstream_remote(&remote, repo, git_reference_name(ref)) < 0 ||
+		    git_branch_upstream_name(&upstream, repo, git_reference_name(ref)) < 0) {
+			git_buf_dispose(&remote);
+			git_reference_free(ref);
+			continue;
+		}
+
+		t.name     = name;
+		t.refname  = git_reference_name(ref);
+		t.remote   = remote.ptr;
+		t.upstream = upstream.ptr;
+		t.have_before = git_reference_name_to_id(&t.before, repo, upstream.ptr) == 0;
+
+		tracking.push_back(t);
+
+		git_buf_dispose(&remote);
+		git_buf_dispose(&upstream);
+		git_reference_free(ref);
+	}
+
+	git_branch_iterator_free(it);
+
+	return 0;
+}
+
+/* Fast-forward all branches tracking remote whose upstream moved */
+static int ff_remote(git_repository *repo, const std::vector<tracking_branch> &tracking,
+		     const std::string &remote, run_stats *stats)
+{
+	int error = 0;
+
+	for (auto &t : tracking) {
+		std::string upstream = t.upstream;
+		git_reference *ref;
+		git_oid oid;
+		int ret;
+
+		if (t.remote != remote)
+			continue;
+
+		if (upstream.compare(0, 13, "refs/remotes/") == 0)
+			upstream = upstream.substr(13);
+
+		if (git_reference_name_to_id(&oid, repo, t.upstream.c_str()) < 0)
+			continue;
+
+		if (t.have_before && git_oid_cmp(&oid, &t.before) == 0)
+			continue;
+
+		ret = git_reference_lookup(&ref, repo, t.refname.c_str());
+		if (ret < 0)
+			return ret;
+
+		ret = ff_branch(repo, ref, t.name.c_str(), &oid, upstream.c_str(),
+				!git_repository_is_bare(repo) && (git_branch_is_head(ref) == 1), stats);
+
+		git_reference_free(ref);
+
+		if (ret < 0)
+			return ret;
+		else if (ret > 0)
+			error = ret;
+	}
+
+	return error;
+}
+
+/*
+ * Fetch all remotes in parallel and fast-forward the branches tracking a
+ * remote as soon as that remote is fetched.
+ */
+static int do_fetch(git_repository *repo, parameters &params)
+{
+	std::vector<tracking_branch> tracking;
+	std::vector<std::thread> workers;
+	git_strarray remotes = { 0 };
+	fetch_queue q;
+	int error;
+
+	error = collect_tracking(repo, tracking);
+	if (error < 0)
+		return error;
+
+	error = git_remote_list(&remotes, repo);
+	if (error < 0)
+		return error;
+
+	for (size_t i = 0; i < remotes.count; i++)
+		q.remotes.push_back(remotes.strings[i]);
+
+	git_strarray_dispose(&remotes);
+
+	q.path = git_repository_path(repo);
+
+	begin_phase(params.stats, "fetch");
+
+	for (size_t i = 0; i < std::min(q.remotes.size(), (size_t)FETCH_JOBS); i++)
+		workers.push_back(std::thread(fetch_worker, &q));
+
+	for (size_t i = 0; i < q.remotes.size(); i++) {
+		fetch_result r;
+		int ret;
+
+		{
+			std::unique_lock<std::mutex> guard(q.lock);
+
+			q.cond.wait(guard, [&q] { return !q.done.empty(); });
+			r = q.done.front();
+			q.done.pop_front();
+		}
+
+		if (r.error < 0) {
+			std::cerr << "Can't fetch " << r.remote << ": " << r.message << std::endl;
+			error = 1;
+			continue;
+		}
+
+		ret = ff_remote(repo, tracking, r.remote, params.stats);
+		if (ret < 0) {
+			const git_error *e = giterr_last();
+
+			std::cerr << "Error: " << (e ? e->message : "unknown error") << std::endl;
+		}
+
+		if (ret != 0)
+			error = 1;
+
+		begin_phase(params.stats, "fetch");
+	}
+
+	for (auto &w : workers)
+		w.join();
 
 	return error;
 }
@@ -371,6 +1069,12 @@ enum {
 	OPTION_NOT,
 	OPTION_ONLY,
 	OPTION_ALL,
+	OPTION_MAP,
+	OPTION_FETCH,
+	OPTION_COUNTS,
+	OPTION_WRITE_COMMIT_GRAPH,
+	OPTION_PERF_COUNTERS,
+	OPTION_TRACE,
 };
 
 static struct option options[] = {
@@ -380,12 +1084,21 @@ static struct option options[] = {
 	{ "not",		no_argument,		0, OPTION_NOT            },
 	{ "only",		no_argument,		0, OPTION_ONLY           },
 	{ "all",		no_argument,		0, OPTION_ALL            },
+	{ "map",		required_argument,	0, OPTION_MAP            },
+	{ "fetch",		no_argument,		0, OPTION_FETCH          },
+	{ "counts",		no_argument,		0, OPTION_COUNTS         },
+	{ "write-commit-graph",	no_argument,		0, OPTION_WRITE_COMMIT_GRAPH },
+	{ "perf-counters",	no_argument,		0, OPTION_PERF_COUNTERS  },
+	{ "trace",		required_argument,	0, OPTION_TRACE          },
 	{ 0,			0,			0, 0                     }
 };
 
 void usage(const char *cmd)
 {
 	std::cout << "Usage: " << cmd << " [options] <branches...> <target>" << std::endl;
+	std::cout << "       " << cmd << " [options] --map <src>:<dst>" << std::endl;
+	std::cout << "       " << cmd << " --fetch" << std::endl;
+	std::cout << "       " << cmd << " --write-commit-graph" << std::endl;
 	std::cout << "Options:" << std::endl;
 	std::cout << "  --help, -h  Print this help message" << std::endl;
 	std::cout << "  --version   Print version and exit" << std::endl;
@@ -396,13 +1109,34 @@ void usage(const char *cmd)
 	std::cout << "              fast-forwared to <target>" << std::endl;
 	std::cout << "  --only, -o  With --list, shows only branches that can be" << std::endl;
 	std::cout << "              fast-forwared to <target>" << std::endl;
+	std::cout << "  --counts    With --list, also shows how many commits a branch" << std::endl;
+	std::cout << "              has that <target> lacks and the other way round" << std::endl;
+	std::cout << "  --map <src>:<dst>" << std::endl;
+	std::cout << "              Fast-forward all refs matching <dst> to the refs" << std::endl;
+	std::cout << "              matching <src>, e.g. 'refs/remotes/origin/*:refs/heads/*'." << std::endl;
+	std::cout << "              Missing refs are created, no work-tree is checked out" << std::endl;
+	std::cout << "  --fetch, -f Fetch all remotes and fast-forward the branches" << std::endl;
+	std::cout << "              whose upstream changed" << std::endl;
+	std::cout << "  --write-commit-graph" << std::endl;
+	std::cout << "              Write or extend the commit-graph of the repository," << std::endl;
+	std::cout << "              which speeds up --list" << std::endl;
+	std::cout << "  --perf-counters" << std::endl;
+	std::cout << "              Print time, heap usage, cycles, instructions, IPC," << std::endl;
+	std::cout << "              cache misses and branch misses per phase to stderr" << std::endl;
+	std::cout << "  --trace <file>" << std::endl;
+	std::cout << "              Write a span per merge-base, checkout, ref write and" << std::endl;
+	std::cout << "              fetch to <file>, for chrome://tracing or Perfetto" << std::endl;
 }
 
 int main(int argc, char **argv)
 {
 	git_repository *repo = NULL;
+	const char *trace_path = NULL;
 	const char *target = NULL;
+	perf_counters counters;
 	bool opt_error = false;
+	run_stats stats;
+	ref_store refs;
 	int error;
 
 	struct parameters params;
@@ -410,7 +1144,7 @@ int main(int argc, char **argv)
 	while (true) {
 		int c, opt_idx;
 
-		c = getopt_long(argc, argv, "hlonua", options, &opt_idx);
+		c = getopt_long(argc, argv, "hlonuaf", options, &opt_idx);
 		if (c == -1)
 			break;
 
@@ -444,6 +1178,25 @@ int main(int argc, char **argv)
 		case 'a':
 			params.all = true;
 			break;
+		case OPTION_MAP:
+			params.map = optarg;
+			break;
+		case OPTION_FETCH:
+		case 'f':
+			params.fetch = true;
+			break;
+		case OPTION_COUNTS:
+			params.counts = true;
+			break;
+		case OPTION_WRITE_COMMIT_GRAPH:
+			params.write_graph = true;
+			break;
+		case OPTION_PERF_COUNTERS:
+			params.perf_counters = true;
+			break;
+		case OPTION_TRACE:
+			trace_path = optarg;
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
@@ -457,7 +1210,32 @@ int main(int argc, char **argv)
 		target = argv[optind++];
 	}
 
-	if (target == NULL) {
+	if (params.write_graph) {
+		if (target != NULL || params.map || params.all || params.fetch || params.list) {
+			std::cerr << "Error: --write-commit-graph takes no other options" << std::endl;
+			opt_error = true;
+		}
+	} else if (params.map) {
+		if (target != NULL) {
+			std::cerr << "Error: Can not specify branches or target with --map" << std::endl;
+			opt_error = true;
+		}
+
+		if (params.all || params.fetch) {
+			std::cerr << "Error: --all and --fetch not possible with --map" << std::endl;
+			opt_error = true;
+		}
+	} else if (params.fetch) {
+		if (target != NULL) {
+			std::cerr << "Error: Can not specify branches or target with --fetch" << std::endl;
+			opt_error = true;
+		}
+
+		if (params.all || params.list) {
+			std::cerr << "Error: --all and --list not possible with --fetch" << std::endl;
+			opt_error = true;
+		}
+	} else if (target == NULL) {
 		std::cerr << "Error: Need a fast-forward target" << std::endl;
 		opt_error = true;
 	}
@@ -469,6 +1247,11 @@ int main(int argc, char **argv)
 		opt_error = true;
 	}
 
+	if (!params.list && params.counts) {
+		std::cerr << "Error: --counts requires --list" << std::endl;
+		opt_error = true;
+	}
+
 	if (params.all && params.list) {
 		std::cerr << "Error: --all not possible with --list" << std::endl;
 		opt_error = true;
@@ -486,32 +1269,74 @@ int main(int argc, char **argv)
 
 	git_libgit2_init();
 
+	if (params.perf_counters) {
+		error = alloc_counting_init();
+		if (error < 0)
+			goto err;
+
+		/* Opened before the fetch workers start, so they are counted */
+		if (counters.open())
+			stats.use_counters(&counters);
+
+		params.stats = &stats;
+		stats.begin("open");
+	}
+
+	if (trace_path && !trace_open(trace_path))
+		goto out_err;
+
+	ref_store_init();
+
 	error = git_repository_open(&repo, ".");
 	if (error < 0)
 		goto err;
 
-	if (params.list)
-		error = do_list(repo, params);
+	error = refs.open(repo);
+	if (error < 0) {
+		std::cerr << "Error: Can't read reftable of repository" << std::endl;
+		goto out_err;
+	}
+
+	if (refs.is_reftable() && !params.list && !params.write_graph) {
+		std::cerr << "Error: Updating refs in reftable repositories is not supported" << std::endl;
+		goto out_err;
+	}
+
+	if (params.write_graph)
+		error = write_commit_graph(repo);
+	else if (params.map)
+		error = do_map(repo, refs, params);
+	else if (params.fetch)
+		error = do_fetch(repo, params);
+	else if (params.list)
+		error = do_list(repo, refs, params);
 	else
-		error = do_ff(repo, params);
+		error = do_ff(repo, refs, params);
 
-	if (error)
+	if (error < 0)
+		goto err;
+	else if (error)
 		goto out_err;
 
-	git_repository_free(repo);
+	if (params.stats)
+		params.stats->print(std::cerr);
 
-	git_libgit2_shutdown();
+	if (trace_write())
+		fast_exit(1);
 
-	return 0;
+	/* All refs are updated, tearing down the repository is wasted time */
+	fast_exit(0);
 
 err:
 
 	if (error < 0) {
 		const git_error *e = giterr_last();
-		std::cerr << "Error: " << e->message << std::endl;
+		std::cerr << "Error: " << (e ? e->message : "unknown error") << std::endl;
 	}
 
 out_err:
+	trace_write();
+
 	if (repo)
 		git_repository_free(repo);
 
@@ -9,36 +9,47 @@
  * TODO:
  *		- Man page
  */
+#include <condition_variable>
 #include <algorithm>
 #include <iostream>
-#include <iomanip>
+#include <memory>
+#include <chrono>
 #include <string>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 #include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <git2.h>
 
+#include "pipeline.h"
+#include "alloc.h"
 #include "version.h"
+#include "descindex.h"
+#include "describe.h"
+#include "branch.h"
+#include "format.h"
+#include "service.h"
+#include "extsort.h"
+#include "batchio.h"
+#include "packorder.h"
+#include "perfcount.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "refs.h"
 
 #define CLEARLINE	"\033[1K\r"
 
-struct branch {
-	std::string name;
-	bool current;
-	time_t last;
-	std::string describe;
-	const git_oid *oid;
-
-	branch(std::string n, bool c, time_t l, const git_oid *o)
-		: name(n), current(c), last(l), describe(), oid(o)
-	{
-	}
-
-	bool operator<(const struct branch &b) const
-	{
-		return last > b.last;
-	}
-};
+/* Refs scanned but not yet looked up */
+#define SCAN_QUEUE_SIZE	1024
 
 enum {
 	OPTION_HELP,
@@ -49,17 +60,61 @@ enum {
 	OPTION_DESCRIBE,
 	OPTION_LONG,
 	OPTION_SHORT,
+	OPTION_COUNT,
+	OPTION_SINCE,
+	OPTION_JOBS,
+	OPTION_STATS,
+	OPTION_ARENA,
+	OPTION_MATCH,
+	OPTION_EXCLUDE,
+	OPTION_CANDIDATES,
+	OPTION_TAGS,
+	OPTION_FIRST_PARENT,
+	OPTION_CONTAINED_IN,
+	OPTION_NO_INDEX,
+	OPTION_TIME_BUDGET,
+	OPTION_WRITE_COMMIT_GRAPH,
+	OPTION_FORMAT,
+	OPTION_SERVE,
+	OPTION_SUBSCRIBE,
+	OPTION_REFS,
+	OPTION_MAX_MEMORY,
+	OPTION_PERF_COUNTERS,
+	OPTION_TRACE,
 };
 
+static const char *short_options = "har:dlsn:j:";
+
 static struct option options[] = {
 	{ "help",		no_argument,		0, OPTION_HELP           },
 	{ "version",		no_argument,		0, OPTION_VERSION        },
 	{ "all",		no_argument,		0, OPTION_ALL            },
 	{ "repo",		required_argument,	0, OPTION_REPO		 },
 	{ "remote",		required_argument,	0, OPTION_REMOTE         },
-	{ "describe",		no_argument,		0, OPTION_DESCRIBE       },
+	{ "describe",		optional_argument,	0, OPTION_DESCRIBE       },
 	{ "long",		no_argument,		0, OPTION_LONG		 },
 	{ "short",		no_argument,		0, OPTION_SHORT          },
+	{ "count",		required_argument,	0, OPTION_COUNT          },
+	{ "since",		required_argument,	0, OPTION_SINCE          },
+	{ "jobs",		required_argument,	0, OPTION_JOBS           },
+	{ "stats",		no_argument,		0, OPTION_STATS          },
+	{ "arena",		no_argument,		0, OPTION_ARENA          },
+	{ "match",		required_argument,	0, OPTION_MATCH          },
+	{ "exclude",		required_argument,	0, OPTION_EXCLUDE        },
+	{ "candidates",		required_argument,	0, OPTION_CANDIDATES     },
+	{ "tags",		no_argument,		0, OPTION_TAGS           },
+	{ "first-parent",	no_argument,		0, OPTION_FIRST_PARENT   },
+	{ "contained-in",	no_argument,		0, OPTION_CONTAINED_IN   },
+	{ "no-index",		no_argument,		0, OPTION_NO_INDEX       },
+	{ "time-budget",	required_argument,	0, OPTION_TIME_BUDGET    },
+	{ "write-commit-graph",	no_argument,		0, OPTION_WRITE_COMMIT_GRAPH },
+	{ "format",		required_argument,	0, OPTION_FORMAT         },
+	{ "serve",		no_argument,		0, OPTION_SERVE          },
+	{ "subscribe",		no_argument,		0, OPTION_SUBSCRIBE      },
+	{ "refs",		required_argument,	0, OPTION_REFS           },
+	{ "max-memory",		required_argument,	0, OPTION_MAX_MEMORY     },
+	{ "perf-counters",	no_argument,		0, OPTION_PERF_COUNTERS  },
+	{ "trace",		required_argument,	0, OPTION_TRACE          },
 	{ 0,			0,			0, 0                     }
 };
 
@@ -72,40 +127,550 @@ static void usage(const char *cmd)
 	std::cout << "  --all, -a              Also show remote branches" << std::endl;
 	std::cout << "  --repo <path>          Path to git repository" << std::endl;
 	std::cout << "  --remote, -r <remote>  Only show branches of a given remote" << std::endl;
+	std::cout << "  --refs <pattern>       Show the refs matching <pattern>, like" << std::endl;
+	std::cout << "                         refs/changes/12/* or refs/pull/*, instead of" << std::endl;
+	std::cout << "                         branches" << std::endl;
 	std::cout << "  --describe, -d         Describe the top-commits of the branches" << std::endl;
+	std::cout << "  --describe=approx      Only find the newest tag in the history of each" << std::endl;
+	std::cout << "                         branch, much faster on large histories" << std::endl;
 	std::cout << "  --long, -l             Use long format for describe" << std::endl;
+	std::cout << "  --match <glob>         Only describe with tags matching <glob>" << std::endl;
+	std::cout << "  --exclude <glob>       Do not describe with tags matching <glob>" << std::endl;
+	std::cout << "  --candidates <n>       Consider up to <n> tags per branch (default 10)" << std::endl;
+	std::cout << "  --tags                 Also describe with lightweight tags" << std::endl;
+	std::cout << "  --first-parent         Only follow the first parent of merges" << std::endl;
+	std::cout << "  --contained-in         Show the oldest tag containing each branch" << std::endl;
+	std::cout << "  --no-index             Do not use or update the describe index" << std::endl;
+	std::cout << "  --time-budget <ms>     Print branches not described after <ms> as" << std::endl;
+	std::cout << "                         pending and describe them in the background" << std::endl;
+	std::cout << "  --write-commit-graph   Write or extend the commit-graph of the" << std::endl;
+	std::cout << "                         repository, which speeds up describing" << std::endl;
 	std::cout << "  --short, -s            Print sorted branch names only" << std::endl;
+	std::cout << "  --format <format>      Print branches like git for-each-ref --format," << std::endl;
+	std::cout << "                         %(describe) and %(contained) are described" << std::endl;
+	std::cout << "  --count, -n <n>        Only show the <n> most recent branches" << std::endl;
+	std::cout << "  --since <date>         Only show branches changed since <date>," << std::endl;
+	std::cout << "                         given as YYYY-MM-DD or seconds since the epoch" << std::endl;
+	std::cout << "  --serve                Keep running and send branch changes to" << std::endl;
+	std::cout << "                         subscribers, as JSON lines" << std::endl;
+	std::cout << "  --subscribe            Print the changes sent by git-recent --serve" << std::endl;
+	std::cout << "  --jobs, -j <n>         Number of threads per pipeline stage" << std::endl;
+	std::cout << "  --stats                Print time and heap usage per phase to stderr" << std::endl;
+	std::cout << "  --perf-counters        Like --stats, with cycles, instructions, IPC," << std::endl;
+	std::cout << "                         cache misses and branch misses per phase" << std::endl;
+	std::cout << "  --trace <file>         Write the lookup and describe of every branch" << std::endl;
+	std::cout << "                         to <file>, in the Chrome trace event format" << std::endl;
+	std::cout << "  --arena                Never free memory, faster but needs more memory" << std::endl;
+	std::cout << "  --max-memory <MiB>     Sort in temporary files beyond about <MiB> of" << std::endl;
+	std::cout << "                         memory, for plain listings of huge ref sets" << std::endl;
 }
 
-bool is_prefix(std::string str, std::string prefix)
+/*
+ * Patterns are ref prefixes, optionally ending in a *. Without it they name
+ * a directory of refs like git for-each-ref patterns do.
+ */
+static bool parse_ref_pattern(const char *pattern, std::vector<std::string> &out)
 {
-	if (str.size() < prefix.size())
+	std::string p(pattern);
+
+	if (!p.empty() && p.back() == '*')
+		p.pop_back();
+	else if (!p.empty() && p.back() != '/')
+		p += '/';
+
+	if (!is_prefix(p, "refs/") || p.find_first_of("*?[\\") != std::string::npos) {
+		std::cerr << "Error: --refs takes a ref prefix, optionally ending in *: " << pattern << std::endl;
 		return false;
+	}
+
+	out.push_back(p);
+
+	return true;
+}
+
+static bool parse_date(const char *str, time_t *out)
+{
+	struct tm tm;
+	char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(str, "%Y-%m-%d", &tm);
+	if (end && *end == 0) {
+		tm.tm_isdst = -1;
+		*out = mktime(&tm);
+		return true;
+	}
+
+	*out = strtoll(str, &end, 10);
+
+	return *str && *end == 0;
+}
+
+/*
+ * Every stage works on its own repository object, libgit2 objects must not
+ * be shared between threads.
+ */
+struct stage {
+	std::string path;
+	pipeline_error *error;
+};
+
+/*
+ * Collects the looked up branches. Branches before --since are dropped right
+ * away, with --count only the newest ones are kept, and with --max-memory
+ * the branches go to the external sorter instead of the results.
+ */
+struct branch_sink {
+	std::mutex lock;
+	std::vector<branch> *results;
+	size_t count;
+	bool have_since;
+	time_t since;
+	ref_sorter *sorter;
+	std::string::size_type max_len;
+
+	branch_sink(std::vector<branch> *r, size_t c, bool h, time_t s, ref_sorter *e)
+		: results(r), count(c), have_since(h), since(s), sorter(e), max_len(0)
+	{}
+
+	int add(branch &b)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (have_since && b.last < since)
+			return 0;
+
+		if (sorter) {
+			max_len = std::max(max_len, b.name.size());
+			return sorter->add(b.last, b.ref, b.ref.size() - b.name.size(), &b.oid);
+		}
+
+		if (!count) {
+			results->push_back(std::move(b));
+			return 0;
+		}
+
+		/* A heap with the oldest of the kept branches on top */
+		if (results->size() < count) {
+			results->push_back(std::move(b));
+			std::push_heap(results->begin(), results->end());
+		} else if (b < results->front()) {
+			std::pop_heap(results->begin(), results->end());
+			results->back() = std::move(b);
+			std::push_heap(results->begin(), results->end());
+		}
+
+		return 0;
+	}
+};
+
+/* Stage 2: Look up the commits of the scanned refs */
+static void lookup_worker(stage *st, bounded_queue<branch> *scanned, branch_sink *sink)
+{
+	git_repository *repo;
+	branch b;
+	int error;
+
+	trace_thread("lookup");
+
+	error = git_repository_open(&repo, st->path.c_str());
+	if (error < 0) {
+		st->error->set(error);
+		repo = NULL;
+	}
+
+	while (scanned->pop(b)) {
+		git_commit *commit;
+
+		/* Keep draining the queue so the producer does not block */
+		if (repo == NULL || st->error->get())
+			continue;
+
+		trace_span span("lookup", b.name.c_str());
+
+		error = git_commit_lookup(&commit, repo, &b.oid);
+		if (error < 0) {
+			st->error->set(error);
+			continue;
+		}
+
+		b.last = static_cast<time_t>(git_commit_time(commit));
+		git_commit_free(commit);
+
+		PROBE3(commit_lookup, b.name.c_str(), b.oid.id, (long)b.last);
+
+		/* Ends before the branch is moved away */
+		span.end();
+
+		error = sink->add(b);
+		if (error < 0)
+			st->error->set(error);
+	}
+
+	git_repository_free(repo);
+}
+
+/* Enough for the header of a commit with a few parents */
+#define LOOSE_READ_SIZE		1024
+
+/*
+ * Stage 2 for branches on loose commits: the objects are read in one batch
+ * and only their header is inflated for the date. Commits which can't be
+ * handled this way go to the libgit2 lookup workers.
+ */
+static int lookup_loose(const loose_objects &loose, std::vector<branch> &pending,
+			bounded_queue<branch> &scanned, branch_sink &sink, pipeline_error &status)
+{
+	trace_span span("read loose commits");
+	file_batch batch(LOOSE_READ_SIZE);
+
+	for (auto &b : pending)
+		batch.add(loose.path(&b.oid));
+
+	return batch.run([&](size_t i, int error, const char *data, size_t len) {
+		branch &b = pending[i];
+		git_time_t last;
+
+		if (error < 0 || !loose_commit_time(data, len, &last)) {
+			scanned.push(std::move(b));
+			return;
+		}
+
+		b.last = static_cast<time_t>(last);
+
+		PROBE3(commit_lookup, b.name.c_str(), b.oid.id, (long)b.last);
+
+		error = sink.add(b);
+		if (error < 0)
+			status.set(error);
+	});
+}
+
+/* Branches ordered at once, bounds the memory when sorting externally */
+#define ORDER_BATCH		65536
+
+/* Branches whose pack pages are checked before holding back a batch */
+#define ORDER_SAMPLE		64
+
+/* Read ahead per commit, and gaps up to which read ahead ranges are merged */
+#define READAHEAD_OBJECT	4096
+#define READAHEAD_GAP		(128 * 1024)
+
+/*
+ * Hands a batch of scanned branches to the lookup workers in the order of
+ * their commits in the packs, after starting to read the pack regions
+ * holding them. On cold caches this turns the random reads of lookups in
+ * ref name order into mostly sequential ones.
+ */
+static void order_lookups(pack_locator &packs, std::vector<branch> &batch,
+			  bounded_queue<branch> &scanned)
+{
+	struct location {
+		uint32_t pack;
+		uint64_t offset;
+		size_t idx;
+	};
+	trace_span span("order lookups");
+	std::vector<location> order;
+	std::vector<size_t> rest;
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		location l;
+
+		l.idx = i;
+		if (packs.find(&batch[i].oid, &l.pack, &l.offset))
+			order.push_back(l);
+		else
+			rest.push_back(i);
+	}
+
+	std::sort(order.begin(), order.end(), [](const location &a, const location &b) {
+		return a.pack != b.pack ? a.pack < b.pack : a.offset < b.offset;
+	});
+
+	for (size_t i = 0; i < order.size(); ) {
+		uint64_t start = order[i].offset;
+		uint64_t end = start + READAHEAD_OBJECT;
+		uint32_t pack = order[i].pack;
+
+		for (i++; i < order.size() && order[i].pack == pack &&
+			  order[i].offset <= end + READAHEAD_GAP; i++)
+			end = order[i].offset + READAHEAD_OBJECT;
+
+		packs.readahead(pack, start, end);
+	}
+
+	for (auto &l : order)
+		scanned.push(std::move(batch[l.idx]));
+
+	for (auto i : rest)
+		scanned.push(std::move(batch[i]));
+
+	batch.clear();
+}
+
+/*
+ * Ordering only pays off if the packs have to be read from disk. With warm
+ * caches it just holds back the lookups until the batch is complete, so the
+ * first branches of a run decide.
+ */
+static bool packs_cold(pack_locator &packs, const std::vector<branch> &batch)
+{
+	for (size_t i = 0; i < std::min<size_t>(batch.size(), ORDER_SAMPLE); i++) {
+		if (!packs.cached(&batch[i].oid))
+			return true;
+	}
+
+	return false;
+}
+
+static void push_lookups(std::vector<branch> &batch, bounded_queue<branch> &scanned)
+{
+	for (auto &b : batch)
+		scanned.push(std::move(b));
+
+	batch.clear();
+}
+
+/* Hands the described branches to the writer in sorted order */
+struct describe_queue {
+	std::vector<branch> *results;
+	std::atomic<size_t> next;
+	std::vector<bool> done;
+	/* Found in the describe index, set before the workers start */
+	std::vector<bool> cached;
+	const tag_table *tags;
+	const describe_options *opts;
+	const commit_graph *graph;
+	describe_index *index;
+	bool approx;
+
+	std::mutex lock;
+	std::condition_variable cond;
+
+	describe_queue(std::vector<branch> *r, const tag_table *t, const describe_options *o,
+		       const commit_graph *g, describe_index *i, bool a)
+		: results(r), next(0), done(r->size(), false), cached(r->size(), false),
+		  tags(t), opts(o), graph(g), index(i), approx(a)
+	{}
+
+	void complete(size_t idx)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		done[idx] = true;
+		cond.notify_all();
+	}
+
+	void wait(size_t idx)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		cond.wait(guard, [this, idx] { return done[idx]; });
+	}
+
+	/* Returns false if the branch is not described by the deadline */
+	bool wait_until(size_t idx, std::chrono::steady_clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		return cond.wait_until(guard, deadline, [this, idx] { return done[idx]; });
+	}
+};
+
+/* Stage 3: Describe the branches, newest first */
+static void describe_worker(stage *st, describe_queue *q)
+{
+	git_repository *repo;
+	size_t idx;
+	int error;
+
+	trace_thread("describe");
+
+	error = git_repository_open(&repo, st->path.c_str());
+	if (error < 0) {
+		st->error->set(error);
+		repo = NULL;
+	}
+
+	{
+		describer d(repo, *q->tags, *q->opts, q->graph);
+		approx_describer a(repo, *q->tags, *q->opts, q->graph);
+
+		while ((idx = q->next++) < q->results->size()) {
+			branch &b = (*q->results)[idx];
+			const tag_table::tag *tag;
+			unsigned depth;
+
+			if (q->cached[idx])
+				continue;
+
+			if (repo == NULL || st->error->get())
+				goto next;
+
+			{
+				trace_span span("describe", b.name.c_str());
+
+				PROBE2(describe_start, b.name.c_str(), b.oid.id);
+
+				if (q->approx)
+					error = a.describe(&b.oid, &tag, &depth);
+				else
+					error = d.describe(&b.oid, &tag, &depth);
+
+				PROBE3(describe_end, b.name.c_str(), b.oid.id, error);
+			}
+			if (error == GIT_ENOTFOUND) {
+				tag = NULL;
+			} else if (error < 0) {
+				st->error->set(error);
+				goto next;
+			}
+
+			if (q->index)
+				q->index->add(&b.oid, tag, depth);
+
+			/* Branches no tag describes are printed without description */
+			if (tag && q->approx)
+				a.format(&b.oid, tag, depth, b.describe);
+			else if (tag)
+				d.format(&b.oid, tag, depth, b.describe);
+next:
+			q->complete(idx);
+		}
+	}
+
+	git_repository_free(repo);
+}
+
+/*
+ * Runs git-recent again without the time budget and with all output
+ * discarded, so the branches left pending end up in the describe index.
+ * Options which only concern this run are dropped, the child must not
+ * overwrite the trace of its parent or report its stats.
+ */
+static void spawn_refresh(int argc, char **argv)
+{
+	std::vector<char *> args;
+	int c, next = 1;
+	int fd;
+
+	args.push_back(argv[0]);
+
+	/*
+	 * Parsed again to find the words of every option, including
+	 * abbreviations and --opt=value. Options consumed so far are
+	 * argv[next] to argv[optind - 1], short ones may share a word.
+	 */
+	opterr = 0;
+	optind = 0;
+	while ((c = getopt_long(argc, argv, short_options, options, NULL)) != -1) {
+		bool drop = false;
+
+		switch (c) {
+		case OPTION_TIME_BUDGET:
+		case OPTION_TRACE:
+		case OPTION_STATS:
+		case OPTION_PERF_COUNTERS:
+			drop = true;
+			break;
+		}
+
+		for (; next < optind; next++) {
+			if (!drop)
+				args.push_back(argv[next]);
+		}
+	}
 
-	return (str.substr(0, prefix.size()) == prefix);
+	for (; next < argc; next++)
+		args.push_back(argv[next]);
+	args.push_back(NULL);
+
+	if (fork() != 0)
+		return;
+
+	/* Other threads are gone in the child, so just exec */
+	setsid();
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+	}
+
+	execv("/proc/self/exe", args.data());
+	_exit(127);
+}
+
+/* Without a format, the format buffer is not used */
+static void print_result(const branch &b, const branch_format *format, std::string &line,
+			 std::string::size_type max_len, const std::string &desc_prefix)
+{
+	if (format == NULL) {
+		print_branch(std::cout, b, max_len, desc_prefix);
+		return;
+	}
+
+	line.clear();
+	format->render(b, line);
+	fwrite(line.data(), 1, line.size(), stdout);
 }
 
 int main(int argc, char **argv)
 {
+	auto start = std::chrono::steady_clock::now();
 	git_branch_t flags = GIT_BRANCH_LOCAL;
 	std::string::size_type max_len = 0;
+	std::vector<std::string> namespaces;
+	std::vector<std::thread> workers;
+	unsigned jobs = std::max(std::thread::hardware_concurrency(), 1U);
 	std::vector<branch> results;
 	git_repository *repo = NULL;
 	std::string repo_path = ".";
-	bool describe_long = false;
+	describe_options desc_opts;
 	bool print_short = false;
-	git_branch_iterator *it;
 	std::string desc_prefix;
-	git_branch_t ref_type;
 	bool describe = false;
-	git_reference *ref;
+	bool contained = false;
+	bool have_since = false;
+	bool print_stats = false;
+	bool use_counters = false;
+	const char *trace_path = NULL;
+	perf_counters counters;
+	bool use_index = true;
+	bool approx = false;
+	bool expired = false;
+	bool write_graph = false;
+	bool have_format = false;
+	std::vector<std::string> ref_patterns;
+	bool serve = false;
+	bool subscribe_only = false;
+	branch_format format;
+	std::string line;
+	long budget = -1;
+	bool arena = false;
+	std::unique_ptr<ref_sorter> sorter;
+	loose_objects loose;
+	pack_locator packs;
+	size_t max_memory = 0;
+	std::string head_name;
+	pipeline_error status;
+	size_t count = 0;
 	std::string prefix;
+	time_t since = 0;
+	describe_index index;
+	commit_graph graph;
+	bool have_graph;
+	run_stats stats;
+	tag_table tags;
+	ref_store refs;
+	stage st;
 	int error;
 
 	while (true) {
 		int c, opt_idx;
 
-		c = getopt_long(argc, argv, "har:dls", options, &opt_idx);
+		c = getopt_long(argc, argv, short_options, options, &opt_idx);
 		if (c == -1)
 			break;
 
@@ -134,146 +699,527 @@ int main(int argc, char **argv)
 		case OPTION_DESCRIBE:
 		case 'd':
 			describe = true;
+			if (optarg && strcmp(optarg, "approx") == 0) {
+				approx = true;
+			} else if (optarg) {
+				std::cerr << "Error: Unknown describe mode " << optarg << std::endl;
+				return 1;
+			}
 			break;
 		case OPTION_LONG:
 		case 'l':
-			describe_long = true;
+			desc_opts.long_format = true;
+			desc_opts.abbrev      = 12;
+			break;
 		case OPTION_SHORT:
 		case 's':
 			print_short = true;
 			break;
+		case OPTION_COUNT:
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case OPTION_SINCE:
+			if (!parse_date(optarg, &since)) {
+				std::cerr << "Error: Can't parse date " << optarg << std::endl;
+				return 1;
+			}
+			have_since = true;
+			break;
+		case OPTION_JOBS:
+		case 'j':
+			jobs = std::max(atoi(optarg), 1);
+			break;
+		case OPTION_STATS:
+			print_stats = true;
+			break;
+		case OPTION_ARENA:
+			arena = true;
+			break;
+		case OPTION_MATCH:
+			desc_opts.match.push_back(optarg);
+			break;
+		case OPTION_EXCLUDE:
+			desc_opts.exclude.push_back(optarg);
+			break;
+		case OPTION_CANDIDATES:
+			desc_opts.candidates = std::min(std::max(atoi(optarg), 0), DESCRIBE_MAX_CANDIDATES);
+			break;
+		case OPTION_TAGS:
+			desc_opts.tags = true;
+			break;
+		case OPTION_FIRST_PARENT:
+			desc_opts.first_parent = true;
+			break;
+		case OPTION_CONTAINED_IN:
+			contained = true;
+			break;
+		case OPTION_NO_INDEX:
+			use_index = false;
+			break;
+		case OPTION_TIME_BUDGET:
+			budget = std::max(atol(optarg), 0L);
+			break;
+		case OPTION_WRITE_COMMIT_GRAPH:
+			write_graph = true;
+			break;
+		case OPTION_REFS:
+			if (!parse_ref_pattern(optarg, ref_patterns))
+				return 1;
+			break;
+		case OPTION_SERVE:
+			serve = true;
+			break;
+		case OPTION_SUBSCRIBE:
+			subscribe_only = true;
+			break;
+		case OPTION_TRACE:
+			trace_path = optarg;
+			break;
+		case OPTION_PERF_COUNTERS:
+			print_stats  = true;
+			use_counters = true;
+			break;
+		case OPTION_MAX_MEMORY:
+			if (atol(optarg) <= 0) {
+				std::cerr << "Error: --max-memory takes a size in MiB" << std::endl;
+				return 1;
+			}
+			max_memory = (size_t)atol(optarg) << 20;
+			break;
+		case OPTION_FORMAT:
+			if (!format.compile(optarg))
+				return 1;
+			have_format = true;
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 	}
+
+	/* Only what the format shows is computed */
+	if (have_format) {
+		describe    = format.needs_describe();
+		contained   = format.needs_contained();
+		print_short = false;
+	}
+
+	desc_prefix = desc_opts.long_format ? "branch at " : "based on ";
+	describe    = describe && !print_short;
+
+	contained = contained && !print_short;
+
+	if (!ref_patterns.empty() && (flags != GIT_BRANCH_LOCAL)) {
+		std::cerr << "Error: --refs can't be used with --all or --remote" << std::endl;
+		return 1;
+	}
+
+	/* The service keeps all branches and never frees less than it allocates */
+	if (serve && (count || have_since || contained || have_format || print_short || arena)) {
+		std::cerr << "Error: --serve can't be used with --count, --since, --contained-in, "
+			  << "--format, --short or --arena" << std::endl;
+		return 1;
+	}
+
+	/* With --count, only count branches are kept anyway */
+	if (max_memory && !count) {
+		if (describe || contained || serve) {
+			std::cerr << "Error: --max-memory can't be used with --describe, --contained-in "
+				  << "or --serve" << std::endl;
+			return 1;
+		}
+
+		sorter.reset(new ref_sorter(max_memory));
+	}
+
 	git_libgit2_init();
 
+	if (arena) {
+		error = alloc_arena_init();
+		if (error < 0)
+			goto err;
+	}
+
+	if (print_stats) {
+		error = alloc_counting_init();
+		if (error < 0)
+			goto err;
+
+		/* Opened before any worker starts, so workers are counted */
+		if (use_counters && counters.open())
+			stats.use_counters(&counters);
+
+		stats.begin("open");
+	}
+
+	ref_store_init();
+
 	error = git_repository_open(&repo, repo_path.c_str());
 	if (error < 0)
 		goto err;
 
-	error = git_branch_iterator_new(&it, repo, flags);
+	if (write_graph) {
+		error = write_commit_graph(repo);
+		if (error)
+			goto err;
+
+		fast_exit(0);
+	}
+
+	if (subscribe_only) {
+		error = subscribe(repo);
+		if (error)
+			goto err;
+
+		fast_exit(0);
+	}
+
+	/* Before the first worker starts */
+	if (trace_path && !trace_open(trace_path))
+		goto out;
+
+	error = refs.open(repo);
+	if (error < 0) {
+		std::cerr << "Error: Can't read reftable of repository" << std::endl;
+		goto out;
+	}
+
+	head_name = refs.head();
+
+	if (!ref_patterns.empty())
+		namespaces = ref_patterns;
+	else if (flags & GIT_BRANCH_LOCAL)
+		namespaces.push_back("refs/heads/");
+	if (flags & GIT_BRANCH_REMOTE)
+		namespaces.push_back("refs/remotes/");
+
+	st.path  = git_repository_path(repo);
+	st.error = &status;
+
+	if (print_stats)
+		stats.begin("scan");
+
+	/* Stage 1 runs here and feeds the commit lookup workers */
+	{
+		bounded_queue<branch> scanned(SCAN_QUEUE_SIZE);
+		branch_sink sink(&results, count, have_since, since, sorter.get());
+		std::vector<branch> pending, ordered;
+		bool sampled = false, cold = false;
+
+		loose.load(std::string(git_repository_commondir(repo)) + "objects/");
+		packs.open(std::string(git_repository_commondir(repo)) + "objects");
+
+		for (unsigned i = 0; i < jobs; i++)
+			workers.push_back(std::thread(lookup_worker, &st, &scanned, &sink));
+
+		for (auto &ns : namespaces) {
+			error = refs.foreach(ns + prefix, [&](const char *refname, const git_oid *oid) {
+				std::string sname(refname + name_offset(ns));
+
+				if (oid == NULL) {
+					std::cerr << "Can't get commit for branch " << sname << std::endl;
+					return 0;
+				}
+
+				PROBE2(branch, refname, oid->id);
+
+				if (!loose.empty() && loose.contains(oid)) {
+					pending.push_back(branch(refname, sname, head_name == refname, 0, *oid));
+				} else if (!packs.empty()) {
+					ordered.push_back(branch(refname, sname, head_name == refname, 0, *oid));
+					if (!sampled && ordered.size() == ORDER_SAMPLE) {
+						cold    = packs_cold(packs, ordered);
+						sampled = true;
+					}
+
+					if (sampled && !cold)
+						push_lookups(ordered, scanned);
+					else if (ordered.size() == ORDER_BATCH)
+						order_lookups(packs, ordered, scanned);
+				} else {
+					scanned.push(branch(refname, sname, head_name == refname, 0, *oid));
+				}
+
+				return status.get();
+			});
+			if (error < 0)
+				break;
+		}
+
+		if (!sampled)
+			cold = packs_cold(packs, ordered);
+
+		if (error >= 0 && cold)
+			order_lookups(packs, ordered, scanned);
+		else if (error >= 0)
+			push_lookups(ordered, scanned);
+
+		if (error >= 0 && !pending.empty())
+			error = lookup_loose(loose, pending, scanned, sink, status);
+
+		scanned.close();
+
+		for (auto &w : workers)
+			w.join();
+		workers.clear();
+
+		max_len = sink.max_len;
+	}
+
+	/* The scan stops on errors of the workers, they have the message */
+	if (status.get() < 0)
+		goto err_status;
+
 	if (error < 0)
 		goto err;
 
-	while (git_branch_next(&ref, &ref_type, it) == 0) {
-		git_commit *commit;
-		const git_oid *oid;
-		std::string sname;
-		const char *name;
+	if (print_stats)
+		stats.begin("sort");
+
+	/* Sorted while printing, the branches were never all in memory */
+	if (sorter) {
+		error = sorter->foreach([&](time_t last, const char *ref, size_t name, const git_oid *oid) {
+			branch b(ref, ref + name, head_name == ref, last, *oid);
 
-		error = git_branch_name(&name, ref);
+			if (print_short)
+				std::cout << b.name << '\n';
+			else
+				print_result(b, have_format ? &format : NULL, line, max_len, desc_prefix);
+
+			return 0;
+		});
 		if (error < 0)
 			goto err;
 
-		sname = name;
-		max_len = std::max(max_len, sname.size());
+		if (print_stats)
+			stats.print(std::cerr);
 
-		if (!is_prefix(sname, prefix))
-			continue;
+		if (trace_write())
+			fast_exit(1);
 
-		oid = git_reference_target(ref);
-		if (oid == NULL) {
-			std::cerr << "Can't get commit for branch " << sname << std::endl;
-			continue;
+		fast_exit(0);
+	}
+
+	/* With --count, the results are the heap of the newest branches */
+	std::sort(results.begin(), results.end());
+
+	for (auto &b : results)
+		max_len = std::max(max_len, b.name.size());
+
+	/* The describe index only holds exact results */
+	use_index = use_index && !approx;
+
+	if (describe || contained) {
+		if (print_stats)
+			stats.begin("tags");
+
+		/* Built once, so tag patterns are not matched again per branch */
+		error = tags.build(repo, refs, desc_opts);
+		if (error < 0)
+			goto err;
+	}
+
+	/* Without a commit-graph, commits are read from the object database */
+	have_graph = describe && graph.open(std::string(git_repository_commondir(repo)) + "objects") == 0;
+
+	/* Not in prompts, which are what the time budget is for */
+	if (describe && budget < 0) {
+		size_t missing = 0;
+		uint32_t pos;
+
+		for (auto &b : results) {
+			if (have_graph && !graph.find(&b.oid, &pos))
+				missing++;
 		}
 
+		commit_graph_hint("git-recent", have_graph ? &graph : NULL, results.size(), missing);
+	}
+
+	if (describe && use_index) {
+		if (print_stats)
+			stats.begin("index");
 
-		error = git_commit_lookup(&commit, repo, oid);
+		error = index.load(repo, tags, desc_opts, have_graph ? &graph : NULL);
 		if (error < 0)
 			goto err;
+	}
 
-		results.emplace_back(branch(name,
-					    (git_branch_is_head(ref) == 1),
-					    static_cast<time_t>(git_commit_time(commit)),
-					    oid));
+	if (serve) {
+		{
+			recent_service service(repo, namespaces, prefix, desc_opts, describe, approx,
+					       have_graph ? &graph : NULL,
+					       describe && use_index ? &index : NULL);
 
-		git_commit_free(commit);
+			/* Runs until stopped by a signal */
+			error = service.run(results, tags);
+		}
+		if (error)
+			goto err;
+
+		if (trace_write())
+			fast_exit(1);
+
+		fast_exit(0);
 	}
 
-	git_branch_iterator_free(it);
+	if (contained) {
+		std::vector<std::string> names;
+		std::vector<git_oid> tips;
 
-	std::sort(results.begin(), results.end());
+		if (print_stats)
+			stats.begin("contained");
 
-	if (describe && !print_short) {
-		auto total = results.size();
-		decltype(total) current = 1;
+		for (auto &b : results)
+			tips.push_back(b.oid);
 
-		for (auto &b : results) {
-			git_describe_options desc_opts = GIT_DESCRIBE_OPTIONS_INIT;
-			git_describe_format_options fmt_opts;
-			git_describe_result *desc;
-			git_buf buf = { 0 };
-			git_object *obj;
-
-			std::cout << CLEARLINE << "Describing branch " << b.name;
-			std::cout << " (" << current++ << '/' << total << ')'<< std::flush;
-
-			error = git_object_lookup(&obj, repo, b.oid, GIT_OBJ_COMMIT);
-			if (error < 0) {
-				std::cout << CLEARLINE << std::flush;
-				goto err;
+		/* One walk for all branches, done before the first line is printed */
+		trace_span span("contained");
+		error = contained_in(repo, tags, desc_opts, tips, names);
+		if (error < 0)
+			goto err;
+
+		for (size_t i = 0; i < results.size(); i++)
+			results[i].contained = std::move(names[i]);
+	}
+
+	if (print_stats)
+		stats.begin(describe ? "describe" : "output");
+
+	{
+		std::unique_ptr<describe_queue> dq(new describe_queue(&results, &tags, &desc_opts,
+								      have_graph ? &graph : NULL,
+								      describe && use_index ? &index : NULL,
+								      approx));
+		auto deadline = start + std::chrono::milliseconds(budget);
+
+		/* Branches in the describe index are done before any waiting */
+		if (describe && use_index) {
+			describer fmt(repo, tags, desc_opts);
+
+			for (size_t i = 0; i < results.size(); i++) {
+				branch &b = results[i];
+				const tag_table::tag *tag;
+				unsigned depth;
+
+				if (!index.lookup(&b.oid, &tag, &depth))
+					continue;
+
+				if (tag)
+					fmt.format(&b.oid, tag, depth, b.describe);
+				dq->cached[i] = true;
+				dq->done[i]   = true;
 			}
+		}
 
-			error = git_describe_commit(&desc, obj, &desc_opts);
-			if (error < 0)
-				continue;
+		/* Stage 3 starts with the newest branch, so output can start early */
+		if (describe) {
+			for (unsigned i = 0; i < std::min<size_t>(jobs, results.size()); i++)
+				workers.push_back(std::thread(describe_worker, &st, dq.get()));
+		}
+
+		/* The format is rendered into the same buffer for every line */
+		auto print = [&](const branch &b) {
+			print_result(b, have_format ? &format : NULL, line, max_len, desc_prefix);
+		};
+
+		/* Stage 4 prints the branches in order as they become ready */
+		for (size_t i = 0; i < results.size(); i++) {
+			branch &b = results[i];
+			bool ready = true;
 
-			fmt_opts.version                = GIT_DESCRIBE_OPTIONS_VERSION;
-			if (describe_long) {
-				fmt_opts.abbreviated_size       = 12;
-				fmt_opts.always_use_long_format = 1;
-				desc_prefix = "branch at ";
-			} else {
-				fmt_opts.abbreviated_size       = 0;
-				fmt_opts.always_use_long_format = 0;
-				desc_prefix = "based on ";
+			if (print_short) {
+				std::cout << b.name << std::endl;
+				continue;
 			}
-			fmt_opts.dirty_suffix           = "";
 
-			git_describe_format(&buf, desc, &fmt_opts);
+			if (describe) {
+				if (!have_format) {
+					std::cout << CLEARLINE << "Describing branch " << b.name;
+					std::cout << " (" << i + 1 << '/' << results.size() << ')'<< std::flush;
+				}
+
+				if (budget < 0)
+					dq->wait(i);
+				else
+					ready = dq->wait_until(i, deadline);
+
+				if (!have_format)
+					std::cout << CLEARLINE;
+
+				if (!ready) {
+					/* A worker may still write the description */
+					branch p(b.ref, b.name, b.current, b.last, b.oid);
+
+					p.contained = b.contained;
+					p.pending   = true;
+					print(p);
+					expired = true;
+					continue;
+				}
 
-			b.describe = buf.ptr;
+				if (status.get() < 0)
+					break;
+			}
 
-			git_describe_result_free(desc);
-			git_object_free(obj);
+			print(b);
 		}
 
-		std::cout << CLEARLINE << std::flush;
+		/* Let the workers run out quickly after an error */
+		dq->next = results.size();
+
+		if (expired) {
+			/* A long walk would hold up the exit, the process ends anyway */
+			for (auto &w : workers)
+				w.detach();
+			dq.release();
+		} else {
+			for (auto &w : workers)
+				w.join();
+		}
+		workers.clear();
 	}
 
-	for (auto &b : results) {
-		std::string prefix = b.current ? "* " : "  ";
-		struct tm *tm;
-		char t[32];
+	/* Errors while describing pending branches do not matter any more */
+	if (status.get() < 0 && !expired)
+		goto err_status;
 
-		if (print_short) {
-			std::cout << b.name << std::endl;
-			continue;
-		}
+	if (describe && use_index) {
+		if (print_stats)
+			stats.begin("save index");
 
-		tm = localtime(&b.last);
-		strftime(t, 32, "%Y-%m-%d %H:%M:%S", tm);
-		std::cout << prefix << std::left << std::setw(max_len + 2) << b.name << "(" << t << ")";
-		if (b.describe.size() > 0)
-			std::cout << " ["<< desc_prefix << b.describe << "]";
-		std::cout << std::endl;
+		/* Only a cache, the next run just describes again */
+		index.save();
+
+		if (!expired)
+			index.end_refresh();
+		else if (index.start_refresh())
+			spawn_refresh(argc, argv);
 	}
 
-	git_repository_free(repo);
-	git_libgit2_shutdown();
+	if (print_stats)
+		stats.print(std::cerr);
+
+	/* Detached workers may still use the repository, so it is not freed */
+	if (trace_write())
+		fast_exit(1);
+
+	/* Tearing down the repository and all branches is wasted time */
+	fast_exit(0);
 
-	return 0;
+err_status:
+	std::cerr << "Error: " << status.message() << std::endl;
+	goto out;
 
 err:
 	if (error < 0) {
 		const git_error *e = giterr_last();
-		std::cerr << "Error: " << e->message << std::endl;
+		std::cerr << "Error: " << (e ? e->message : "unknown error") << std::endl;
 	}
 
-	if (it)
-		git_branch_iterator_free(it);
+out:
+	/* What happened up to the error */
+	trace_write();
 
 	if (repo)
 		git_repository_free(repo);
@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * packbitmap.cc - Reachability bitmaps of git packs
+ *
+ * git repack -b stores a bitmap of all reachable objects for a selection of
+ * commits next to the pack. The reachable set of any other commit is the
+ * union of the stored bitmaps of the commits where a walk from it first
+ * meets one, plus the commits walked on the way. Checking whether a commit
+ * is reachable is then a single bit test, and counting the commits on one
+ * side only is a popcount of an and-not.
+ *
+ * Stored bitmaps are EWAH compressed, and most of them are XORed with a
+ * bitmap stored shortly before. They are decompressed when first used.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <numeric>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "packbitmap.h"
+
+#define BITMAP_HEADER		32	// Magic, version, options, count, checksum
+#define BITMAP_OPT_FULL_DAG	1
+
+#define IDX_HEADER		8
+#define IDX_LARGE_OFFSET	0x80000000U
+
+#define REV_HEADER		12
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/* Maps a whole file read-only */
+static int map_file(const std::string &path, const unsigned char **map, size_t *size)
+{
+	struct stat st;
+	void *m;
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return GIT_ENOTFOUND;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	*map  = (const unsigned char *)m;
+	*size = st.st_size;
+
+	return 0;
+}
+
+void bitmap::or_with(const bitmap &other)
+{
+	if (other.words.size() > words.size())
+		words.resize(other.words.size(), 0);
+
+	for (size_t i = 0; i < other.words.size(); i++)
+		words[i] |= other.words[i];
+}
+
+void bitmap::xor_with(const bitmap &other)
+{
+	if (other.words.size() > words.size())
+		words.resize(other.words.size(), 0);
+
+	for (size_t i = 0; i < other.words.size(); i++)
+		words[i] ^= other.words[i];
+}
+
+size_t bitmap::count_andnot(const bitmap &other, const bitmap &mask) const
+{
+	size_t n = std::min(words.size(), mask.words.size());
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t w = words[i] & mask.words[i];
+
+		if (i < other.words.size())
+			w &= ~other.words[i];
+
+		count += __builtin_popcountll(w);
+	}
+
+	return count;
+}
+
+/* Size of an EWAH bitmap in bytes: bit count, word count, words, position */
+static size_t ewah_length(const unsigned char *data, size_t size)
+{
+	uint32_t num_words;
+
+	if (size < 12)
+		return 0;
+
+	num_words = get_be32(data + 4);
+	if ((size - 12) / 8 < num_words)
+		return 0;
+
+	return 12 + (size_t)num_words * 8;
+}
+
+/*
+ * The compressed words come in runs, each starting with a marker word: bit 0
+ * is the value of the run of identical words, bits 1-32 its length in words,
+ * and bits 33-63 the number of literal words following the marker.
+ */
+size_t bitmap::read_ewah(const unsigned char *data, size_t size)
+{
+	const unsigned char *p = data + 8;
+	uint32_t bit_size, num_words;
+	size_t length;
+	uint32_t i = 0;
+
+	length = ewah_length(data, size);
+	if (length == 0)
+		return 0;
+
+	bit_size  = get_be32(data);
+	num_words = get_be32(data + 4);
+
+	words.clear();
+	words.reserve((bit_size + 63) / 64);
+
+	while (i < num_words) {
+		uint64_t marker = get_be64(p + (size_t)i++ * 8);
+		uint64_t run    = (marker >> 1) & 0xffffffffULL;
+		uint64_t lit    = marker >> 33;
+
+		if (words.size() + run > (bit_size + 63) / 64)
+			return 0;
+		words.insert(words.end(), run, (marker & 1) ? ~0ULL : 0);
+
+		for (; lit && i < num_words; lit--)
+			words.push_back(get_be64(p + (size_t)i++ * 8));
+	}
+
+	return length;
+}
+
+pack_bitmap_index::~pack_bitmap_index()
+{
+	close_pack();
+}
+
+void pack_bitmap_index::close_pack()
+{
+	if (idx_map)
+		munmap((void *)idx_map, idx_size);
+	if (bitmap_map)
+		munmap((void *)bitmap_map, bitmap_size);
+
+	idx_map     = NULL;
+	idx_size    = 0;
+	bitmap_map  = NULL;
+	bitmap_size = 0;
+	num_objects = 0;
+	fanout      = NULL;
+	oids        = NULL;
+
+	pack_pos.clear();
+	commits = bitmap();
+	stored.clear();
+	stored_by_commit.clear();
+	extended.clear();
+}
+
+int pack_bitmap_index::open_pack(const std::string &base)
+{
+	const unsigned char *p, *end;
+	size_t used;
+	uint32_t count;
+	int error;
+
+	error = map_file(base + ".idx", &idx_map, &idx_size);
+	if (error < 0)
+		return error;
+
+	/* Version 2 only, version 1 indexes are not written since git 1.5 */
+	if (idx_size < IDX_HEADER + 256 * 4 + 40 ||
+	    memcmp(idx_map, "\377tOc", 4) != 0 || get_be32(idx_map + 4) != 2)
+		return -1;
+
+	fanout      = idx_map + IDX_HEADER;
+	num_objects = get_be32(fanout + 255 * 4);
+	oids        = fanout + 256 * 4;
+
+	if ((idx_size - IDX_HEADER - 256 * 4 - 40) / (GIT_OID_RAWSZ + 8) < num_objects)
+		return -1;
+
+	error = map_file(base + ".bitmap", &bitmap_map, &bitmap_size);
+	if (error < 0)
+		return error;
+
+	if (bitmap_size < BITMAP_HEADER || memcmp(bitmap_map, "BITM", 4) != 0 ||
+	    get_be32(bitmap_map + 4) >> 16 != 1 ||
+	    !(get_be32(bitmap_map + 4) & BITMAP_OPT_FULL_DAG))
+		return -1;
+
+	/* The bitmap must be the one of this pack and not of an older one */
+	if (memcmp(bitmap_map + 12, idx_map + idx_size - 40, GIT_OID_RAWSZ) != 0)
+		return -1;
+
+	count = get_be32(bitmap_map + 8);
+	p     = bitmap_map + BITMAP_HEADER;
+	end   = bitmap_map + bitmap_size;
+
+	/* Commits, trees, blobs and tags, only the commits are needed */
+	used = commits.read_ewah(p, end - p);
+	for (int i = 0; i < 4; i++) {
+		if (used == 0)
+			return -1;
+		p   += used;
+		used = ewah_length(p, end - p);
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		stored_bitmap s;
+		git_oid oid;
+
+		if (end - p < 6)
+			return -1;
+
+		s.idx_pos    = get_be32(p);
+		s.xor_offset = p[4];
+		s.ewah       = p + 6;
+		s.loaded     = false;
+
+		/* The bits are only read when used */
+		used = ewah_length(s.ewah, end - s.ewah);
+		if (used == 0 || s.idx_pos >= num_objects || s.xor_offset > i)
+			return -1;
+		s.ewah_size = used;
+		p = s.ewah + used;
+
+		git_oid_fromraw(&oid, oids + (size_t)s.idx_pos * GIT_OID_RAWSZ);
+		stored_by_commit[oid] = stored.size();
+		stored.push_back(std::move(s));
+	}
+
+	return read_pack_order(base);
+}
+
+/*
+ * Bits are numbered in pack order, the .rev file has it. Without one, the
+ * order is recovered by sorting the objects by their offset in the pack.
+ */
+int pack_bitmap_index::read_pack_order(const std::string &base)
+{
+	const unsigned char *rev, *offsets, *large;
+	std::vector<uint32_t> order;
+	size_t rev_size;
+
+	pack_pos.resize(num_objects);
+
+	if (map_file(base + ".rev", &rev, &rev_size) == 0) {
+		bool valid = rev_size >= REV_HEADER + (size_t)num_objects * 4 &&
+			     memcmp(rev, "RIDX", 4) == 0 && get_be32(rev + 4) == 1;
+
+		for (uint32_t i = 0; valid && i < num_objects; i++) {
+			uint32_t idx_pos = get_be32(rev + REV_HEADER + (size_t)i * 4);
+
+			if (idx_pos >= num_objects)
+				valid = false;
+			else
+				pack_pos[idx_pos] = i;
+		}
+
+		munmap((void *)rev, rev_size);
+
+		if (valid)
+			return 0;
+	}
+
+	offsets = oids + (size_t)num_objects * (GIT_OID_RAWSZ + 4);
+	large   = offsets + (size_t)num_objects * 4;
+
+	auto offset = [&](uint32_t i) -> uint64_t {
+		uint32_t o = get_be32(offsets + (size_t)i * 4);
+
+		if (!(o & IDX_LARGE_OFFSET))
+			return o;
+
+		return get_be64(large + (size_t)(o & ~IDX_LARGE_OFFSET) * 8);
+	};
+
+	order.resize(num_objects);
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(),
+		  [&](uint32_t a, uint32_t b) { return offset(a) < offset(b); });
+
+	for (uint32_t i = 0; i < num_objects; i++)
+		pack_pos[order[i]] = i;
+
+	return 0;
+}
+
+int pack_bitmap_index::open(git_repository *r, const std::string &objdir, const commit_graph *g)
+{
+	std::string dir = objdir + "/pack/";
+	std::vector<std::string> bases;
+	struct dirent *de;
+	DIR *d;
+
+	repo  = r;
+	graph = g;
+
+	d = opendir(dir.c_str());
+	if (d == NULL)
+		return GIT_ENOTFOUND;
+
+	/* multi-pack-index-*.bitmap has no .idx of its own */
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+		std::string base;
+
+		if (len <= 7 || strncmp(de->d_name, "pack-", 5) != 0 ||
+		    strcmp(de->d_name + len - 7, ".bitmap") != 0)
+			continue;
+
+		base = dir + std::string(de->d_name, len - 7);
+		if (access((base + ".idx").c_str(), R_OK) == 0)
+			bases.push_back(base);
+	}
+
+	closedir(d);
+
+	std::sort(bases.begin(), bases.end());
+
+	/* Like git, only one bitmap is used, the first one which can be read */
+	for (auto &base : bases) {
+		if (open_pack(base) == 0)
+			return 0;
+
+		close_pack();
+	}
+
+	return GIT_ENOTFOUND;
+}
+
+bool pack_bitmap_index::idx_find(const git_oid *oid, uint32_t *idx_pos) const
+{
+	uint8_t first = oid->id[0];
+	uint32_t lo = first ? get_be32(fanout + (first - 1) * 4) : 0;
+	uint32_t hi = get_be32(fanout + first * 4);
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(oids + (size_t)mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+
+		if (cmp == 0) {
+			*idx_pos = mid;
+			return true;
+		}
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+const bitmap *pack_bitmap_index::load(size_t i)
+{
+	stored_bitmap &s = stored[i];
+
+	if (s.loaded)
+		return &s.bits;
+
+	if (s.bits.read_ewah(s.ewah, s.ewah_size) == 0)
+		return NULL;
+
+	if (s.xor_offset) {
+		const bitmap *base = load(i - s.xor_offset);
+
+		if (base == NULL)
+			return NULL;
+		s.bits.xor_with(*base);
+	}
+
+	s.loaded = true;
+
+	return &s.bits;
+}
+
+uint32_t pack_bitmap_index::position(const git_oid *oid)
+{
+	uint32_t idx_pos, pos;
+
+	if (idx_find(oid, &idx_pos))
+		return pack_pos[idx_pos];
+
+	auto it = extended.find(*oid);
+	if (it != extended.end())
+		return it->second;
+
+	pos = num_objects + extended.size();
+	extended.emplace(*oid, pos);
+	commits.set(pos);
+
+	return pos;
+}
+
+int pack_bitmap_index::parents(const git_oid *oid, std::vector<git_oid> &out)
+{
+	git_commit *commit;
+	uint32_t pos;
+	int error;
+
+	out.clear();
+
+	if (graph && graph->find(oid, &pos)) {
+		std::vector<uint32_t> parents;
+
+		graph->parents(pos, parents);
+		for (auto p : parents) {
+			git_oid parent;
+
+			graph->oid(p, &parent);
+			out.push_back(parent);
+		}
+
+		return 0;
+	}
+
+	error = git_commit_lookup(&commit, repo, oid);
+	if (error < 0)
+		return error;
+
+	for (unsigned i = 0; i < git_commit_parentcount(commit); i++)
+		out.push_back(*git_commit_parent_id(commit, i));
+
+	git_commit_free(commit);
+
+	return 0;
+}
+
+int pack_bitmap_index::reachable(const git_oid *tip, bitmap &out)
+{
+	std::vector<git_oid> stack, ps;
+	int error;
+
+	stack.push_back(*tip);
+
+	while (!stack.empty()) {
+		git_oid oid = stack.back();
+		uint32_t pos;
+
+		stack.pop_back();
+
+		pos = position(&oid);
+		if (out.get(pos))
+			continue;
+
+		auto it = stored_by_commit.find(oid);
+		if (it != stored_by_commit.end()) {
+			const bitmap *bits = load(it->second);
+
+			if (bits == NULL)
+				return -1;
+
+			out.or_with(*bits);
+			continue;
+		}
+
+		out.set(pos);
+
+		error = parents(&oid, ps);
+		if (error < 0)
+			return error;
+
+		stack.insert(stack.end(), ps.begin(), ps.end());
+	}
+
+	return 0;
+}
+
+bool pack_bitmap_index::contains(const bitmap &bits, const git_oid *commit) const
+{
+	uint32_t idx_pos;
+
+	if (idx_find(commit, &idx_pos))
+		return bits.get(pack_pos[idx_pos]);
+
+	/* Commits reachable from a walked tip all got a position */
+	auto it = extended.find(*commit);
+
+	return it != extended.end() && bits.get(it->second);
+}
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * packbitmap.h - Reachability bitmaps of git packs
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __PACKBITMAP_H
+#define __PACKBITMAP_H
+
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <git2.h>
+
+#include "commitgraph.h"
+#include "describe.h"
+
+/* An uncompressed bitmap which grows as bits are set */
+class bitmap {
+	std::vector<uint64_t> words;
+
+public:
+	void set(size_t bit)
+	{
+		if (bit / 64 >= words.size())
+			words.resize(bit / 64 + 1, 0);
+		words[bit / 64] |= 1ULL << (bit % 64);
+	}
+
+	bool get(size_t bit) const
+	{
+		return bit / 64 < words.size() && (words[bit / 64] & (1ULL << (bit % 64)));
+	}
+
+	void or_with(const bitmap &other);
+	void xor_with(const bitmap &other);
+
+	/* Number of bits set in this bitmap and in mask, but not in other */
+	size_t count_andnot(const bitmap &other, const bitmap &mask) const;
+
+	/* Reads a bitmap in git's EWAH format, returns the bytes used or 0 */
+	size_t read_ewah(const unsigned char *data, size_t size);
+};
+
+/*
+ * The bitmap index of a pack. Bit positions are the positions of the objects
+ * in the pack, sorted by their offset. Commits which are not in the pack get
+ * positions after the objects of the pack when they are first seen.
+ */
+class pack_bitmap_index {
+	struct stored_bitmap {
+		uint32_t idx_pos;		// Position in the .idx
+		uint8_t xor_offset;
+		const unsigned char *ewah;
+		size_t ewah_size;
+		bool loaded;
+		bitmap bits;
+	};
+
+	git_repository *repo;
+	const commit_graph *graph;
+
+	const unsigned char *idx_map;
+	size_t idx_size;
+	const unsigned char *bitmap_map;
+	size_t bitmap_size;
+
+	uint32_t num_objects;
+	const unsigned char *fanout;
+	const unsigned char *oids;
+	std::vector<uint32_t> pack_pos;		// .idx position to bit position
+
+	bitmap commits;
+	std::vector<stored_bitmap> stored;
+	std::unordered_map<git_oid, size_t, oid_hash, oid_equal> stored_by_commit;
+	std::unordered_map<git_oid, uint32_t, oid_hash, oid_equal> extended;
+
+	int open_pack(const std::string &base);
+	void close_pack();
+	int read_pack_order(const std::string &base);
+	bool idx_find(const git_oid *oid, uint32_t *idx_pos) const;
+	const bitmap *load(size_t i);
+	uint32_t position(const git_oid *oid);
+	int parents(const git_oid *oid, std::vector<git_oid> &out);
+
+public:
+	pack_bitmap_index()
+		: repo(NULL), graph(NULL), idx_map(NULL), idx_size(0), bitmap_map(NULL),
+		  bitmap_size(0), num_objects(0), fanout(NULL), oids(NULL)
+	{}
+
+	~pack_bitmap_index();
+
+	/*
+	 * Opens the bitmap of a pack in objdir/pack. Returns GIT_ENOTFOUND if
+	 * there is none which can be read, multi-pack bitmaps are not used. The commit-graph, if given, is used to walk commits
+	 * which are not covered by a bitmap.
+	 */
+	int open(git_repository *r, const std::string &objdir, const commit_graph *g);
+
+	/*
+	 * Sets the bits of all commits reachable from tip. For the commits
+	 * covered by stored bitmaps this includes their trees and blobs, the
+	 * other commits are walked and only their own bits are set.
+	 */
+	int reachable(const git_oid *tip, bitmap &out);
+
+	/* True if commit has a bit set in bits */
+	bool contains(const bitmap &bits, const git_oid *commit) const;
+
+	/* Number of commits in a but not in b */
+	size_t count_commits(const bitmap &a, const bitmap &b) const
+	{
+		return a.count_andnot(b, commits);
+	}
+};
+
+#endif
@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * packorder.cc - Locating objects in packs to read them in pack order
+ *
+ * libgit2 reads packs through its own mappings, so read ahead is done on a
+ * separate mapping of the pack. Both end up in the same page cache.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "packorder.h"
+
+#define IDX_HEADER		8
+#define IDX_LARGE_OFFSET	0x80000000U
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/* Maps a whole file read-only */
+static int map_file(const std::string &path, const unsigned char **map, size_t *size)
+{
+	struct stat st;
+	void *m;
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return GIT_ENOTFOUND;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	*map  = (const unsigned char *)m;
+	*size = st.st_size;
+
+	return 0;
+}
+
+pack_locator::~pack_locator()
+{
+	for (auto &p : packs) {
+		munmap((void *)p.idx_map, p.idx_size);
+		if (p.pack_map)
+			munmap((void *)p.pack_map, p.pack_size);
+	}
+}
+
+int pack_locator::open_pack(const std::string &base)
+{
+	pack p;
+	int error;
+
+	error = map_file(base + ".idx", &p.idx_map, &p.idx_size);
+	if (error < 0)
+		return error;
+
+	/* Version 2 only, version 1 indexes are not written since git 1.5 */
+	if (p.idx_size < IDX_HEADER + 256 * 4 + 40 ||
+	    memcmp(p.idx_map, "\377tOc", 4) != 0 || get_be32(p.idx_map + 4) != 2)
+		goto err;
+
+	p.fanout      = p.idx_map + IDX_HEADER;
+	p.num_objects = get_be32(p.fanout + 255 * 4);
+	p.oids        = p.fanout + 256 * 4;
+
+	if ((p.idx_size - IDX_HEADER - 256 * 4 - 40) / (GIT_OID_RAWSZ + 8) < p.num_objects)
+		goto err;
+
+	p.offsets = p.oids + (size_t)p.num_objects * (GIT_OID_RAWSZ + 4);
+	p.large   = p.offsets + (size_t)p.num_objects * 4;
+	p.path    = base + ".pack";
+	p.pack_map  = NULL;
+	p.pack_size = 0;
+
+	packs.push_back(p);
+
+	return 0;
+
+err:
+	munmap((void *)p.idx_map, p.idx_size);
+	return -1;
+}
+
+int pack_locator::open(const std::string &objdir)
+{
+	std::string dir = objdir + "/pack/";
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir.c_str());
+	if (d == NULL)
+		return GIT_ENOTFOUND;
+
+	/* Broken indexes are skipped, libgit2 reports them when it matters */
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+
+		if (len > 4 && strcmp(de->d_name + len - 4, ".idx") == 0)
+			open_pack(dir + std::string(de->d_name, len - 4));
+	}
+
+	closedir(d);
+
+	return packs.empty() ? GIT_ENOTFOUND : 0;
+}
+
+bool pack_locator::find(const git_oid *oid, uint32_t *pack_idx, uint64_t *offset) const
+{
+	uint8_t first = oid->id[0];
+
+	for (uint32_t i = 0; i < packs.size(); i++) {
+		const pack &p = packs[i];
+		uint32_t lo = first ? get_be32(p.fanout + (first - 1) * 4) : 0;
+		uint32_t hi = get_be32(p.fanout + first * 4);
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			int cmp = memcmp(p.oids + (size_t)mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+
+			if (cmp < 0) {
+				lo = mid + 1;
+			} else if (cmp > 0) {
+				hi = mid;
+			} else {
+				uint32_t o = get_be32(p.offsets + (size_t)mid * 4);
+
+				if (o & IDX_LARGE_OFFSET)
+					*offset = get_be64(p.large + (size_t)(o & ~IDX_LARGE_OFFSET) * 8);
+				else
+					*offset = o;
+				*pack_idx = i;
+
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool pack_locator::map_pack(pack &p)
+{
+	if (p.pack_map == NULL && map_file(p.path, &p.pack_map, &p.pack_size) < 0) {
+		p.pack_map = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+bool pack_locator::cached(const git_oid *oid)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char resident;
+	uint32_t pack_idx;
+	uint64_t offset;
+
+	if (!find(oid, &pack_idx, &offset))
+		return true;
+
+	pack &p = packs[pack_idx];
+
+	if (!map_pack(p) || offset >= p.pack_size)
+		return true;
+
+	offset &= ~(uint64_t)(page - 1);
+
+	/* Mapped but never touched, so this does not fault the page in */
+	return mincore((void *)(p.pack_map + offset), 1, &resident) != 0 || (resident & 1);
+}
+
+void pack_locator::readahead(uint32_t pack_idx, uint64_t start, uint64_t end)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	pack &p = packs[pack_idx];
+	std::vector<unsigned char> resident;
+	size_t pages;
+
+	if (!map_pack(p))
+		return;
+
+	start &= ~(uint64_t)(page - 1);
+	end    = std::min<uint64_t>(end, p.pack_size);
+	if (start >= end)
+		return;
+
+	/* Asking for cached pages costs about as much as reading them again */
+	pages = (end - start + page - 1) / page;
+	resident.resize(pages);
+	if (mincore((void *)(p.pack_map + start), end - start, resident.data()) == 0 &&
+	    std::all_of(resident.begin(), resident.end(), [](unsigned char r) { return r & 1; }))
+		return;
+
+	/* Only a hint, the lookups read the objects anyway */
+	madvise((void *)(p.pack_map + start), end - start, MADV_WILLNEED);
+}
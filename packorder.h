@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * packorder.h - Locating objects in packs to read them in pack order
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __PACKORDER_H
+#define __PACKORDER_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <git2.h>
+
+/*
+ * The .idx files of all packs of a repository. Looking up many objects in
+ * the order of their names jumps all over large packs, which is slow on cold
+ * caches. With the pack and offset of every object known up front, the
+ * lookups can be sorted by them and the pack regions read ahead.
+ */
+class pack_locator {
+	struct pack {
+		std::string path;		// Of the .pack
+		const unsigned char *idx_map;
+		size_t idx_size;
+		uint32_t num_objects;
+		const unsigned char *fanout;
+		const unsigned char *oids;
+		const unsigned char *offsets;
+		const unsigned char *large;
+		const unsigned char *pack_map;	// Mapped on the first read ahead
+		size_t pack_size;
+	};
+
+	std::vector<pack> packs;
+
+	int open_pack(const std::string &base);
+	bool map_pack(pack &p);
+
+public:
+	~pack_locator();
+
+	/* Maps the indexes of the packs in objdir/pack */
+	int open(const std::string &objdir);
+
+	bool empty() const
+	{
+		return packs.empty();
+	}
+
+	/* False if oid is in none of the packs */
+	bool find(const git_oid *oid, uint32_t *pack, uint64_t *offset) const;
+
+	/*
+	 * True if the page of the pack holding oid is in the page cache, or if
+	 * oid is in none of the packs
+	 */
+	bool cached(const git_oid *oid);
+
+	/*
+	 * Starts reading [start, end) of a pack into the page cache, unless it
+	 * is there already
+	 */
+	void readahead(uint32_t pack, uint64_t start, uint64_t end);
+};
+
+#endif
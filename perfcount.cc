@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * perfcount.cc - Hardware performance counters of a run
+ *
+ * Every counter is its own event instead of a group, as groups can't be
+ * read with inherit set, and inherit is needed to count the worker threads.
+ * When the kernel multiplexes the counters, the values are scaled by the
+ * time the counter actually ran.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iostream>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "perfcount.h"
+
+static const uint64_t configs[COUNTER_MAX] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int open_counter(uint64_t config, bool user_only)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size           = sizeof(attr);
+	attr.type           = PERF_TYPE_HARDWARE;
+	attr.config         = config;
+	attr.inherit        = 1;
+	attr.exclude_kernel = user_only;
+	attr.exclude_hv     = 1;
+	attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+perf_counters::perf_counters()
+	: user_only(false)
+{
+	for (auto &fd : fds)
+		fd = -1;
+}
+
+perf_counters::~perf_counters()
+{
+	for (auto fd : fds) {
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
+bool perf_counters::open()
+{
+	int error = 0;
+	bool any = false;
+
+	/* With perf_event_paranoid at 2, only user space may be counted */
+	fds[0] = open_counter(configs[0], false);
+	if (fds[0] < 0 && (errno == EACCES || errno == EPERM)) {
+		user_only = true;
+		fds[0] = open_counter(configs[0], true);
+	}
+
+	for (int i = 0; i < COUNTER_MAX; i++) {
+		if (i > 0)
+			fds[i] = open_counter(configs[i], user_only);
+
+		if (fds[i] >= 0)
+			any = true;
+		else if (error == 0)
+			error = errno;
+	}
+
+	if (!any) {
+		std::cerr << "Warning: Performance counters not available: " << strerror(error);
+		if (error == EACCES || error == EPERM)
+			std::cerr << ", see /proc/sys/kernel/perf_event_paranoid";
+		std::cerr << std::endl;
+	}
+
+	return any;
+}
+
+void perf_counters::read(perf_values &out) const
+{
+	for (int i = 0; i < COUNTER_MAX; i++) {
+		uint64_t data[3];	// Value, time enabled, time running
+
+		out.v[i] = 0;
+
+		if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != sizeof(data))
+			continue;
+
+		if (data[2] == 0)
+			continue;
+
+		out.v[i] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+	}
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * perfcount.h - Hardware performance counters of a run
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __PERFCOUNT_H
+#define __PERFCOUNT_H
+
+#include <stdint.h>
+
+enum perf_counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_MAX,
+};
+
+struct perf_values {
+	uint64_t v[COUNTER_MAX];
+};
+
+/*
+ * Counters of the process and of all threads it starts later, read through
+ * perf_event_open. Counters the kernel or the CPU does not provide stay
+ * closed and read as zero.
+ */
+class perf_counters {
+	int fds[COUNTER_MAX];
+	bool user_only;
+
+public:
+	perf_counters();
+	~perf_counters();
+
+	/*
+	 * Must be called before the first thread is started. Returns false,
+	 * with a warning printed, if no counter can be used.
+	 */
+	bool open();
+
+	bool available(perf_counter c) const
+	{
+		return fds[c] >= 0;
+	}
+
+	/* True if kernel code is not counted, as the kernel does not permit it */
+	bool only_user() const
+	{
+		return user_only;
+	}
+
+	void read(perf_values &out) const;
+};
+
+#endif
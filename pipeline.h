@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * pipeline.h - Helpers to connect the stages of a processing pipeline
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <condition_variable>
+#include <string>
+#include <mutex>
+#include <deque>
+
+#include <git2.h>
+
+/*
+ * Queue between two pipeline stages. Producers block while the queue is
+ * full, consumers block while it is empty and not yet closed.
+ */
+template <typename T>
+class bounded_queue {
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+
+public:
+	explicit bounded_queue(size_t c)
+		: capacity(c), closed(false)
+	{}
+
+	void push(T item)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		not_full.wait(guard, [this] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+	}
+
+	/* Returns false when the queue is closed and drained */
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		not_empty.wait(guard, [this] { return !items.empty() || closed; });
+		if (items.empty())
+			return false;
+
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		closed = true;
+		not_empty.notify_all();
+	}
+};
+
+/*
+ * First error hit by any stage. libgit2 keeps error messages per thread, so
+ * the message is copied for the thread reporting the error.
+ */
+class pipeline_error {
+	std::mutex lock;
+	std::string msg;
+	int error;
+
+public:
+	pipeline_error()
+		: error(0)
+	{}
+
+	void set(int e)
+	{
+		const git_error *ge = giterr_last();
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (error)
+			return;
+
+		error = e;
+		msg   = ge ? ge->message : "unknown error";
+	}
+
+	int get()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		return error;
+	}
+
+	std::string message()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		return msg;
+	}
+};
+
+#endif
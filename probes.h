@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * probes.h - USDT probes for bpftrace and perf
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/*
+ * With <sys/sdt.h> from systemtap every probe is a nop plus a note in the
+ * ELF file which tells the tracer where the nop is and where to find the
+ * arguments. Arguments must be integers or pointers, object ids are passed
+ * as pointers to the raw 20 bytes. All probes are in the git_tools provider,
+ * e.g. usdt:./git-ff:git_tools:merge_base_end. Without <sys/sdt.h> the
+ * probes and their arguments compile to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT	1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE1(name, a)			DTRACE_PROBE1(git_tools, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(git_tools, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(git_tools, name, a, b, c)
+#else
+#define PROBE1(name, a)			do { } while (0)
+#define PROBE2(name, a, b)		do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#endif
+
+#endif
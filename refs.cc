@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * refs.cc - Ref access for the files and the reftable ref backends
+ *
+ * libgit2 can only read refs from the files backend. Repositories using
+ * reftable are read with the native reader in reftable.cc instead, while
+ * objects are still accessed through libgit2.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <algorithm>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "reftable.h"
+#include "batchio.h"
+#include "refs.h"
+
+/* Symbolic refs nested deeper than this are treated as broken */
+#define MAX_SYMREF_DEPTH	5
+
+#define PACKED_HEADER		"# pack-refs with:"
+#define PACKED_LINE_MIN		(GIT_OID_HEXSZ + 2)
+
+/* A loose ref file is an object id or a symbolic ref, both are short */
+#define LOOSE_REF_MAX		256
+
+/* A loose or packed ref of the files backend */
+struct file_ref {
+	std::string name;
+	bool symbolic;
+	git_oid oid;
+};
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str), slen = strlen(suffix);
+
+	return len >= slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+static bool parse_loose_ref(const char *buf, size_t len, file_ref &r)
+{
+	if (len >= 5 && memcmp(buf, "ref: ", 5) == 0) {
+		r.symbolic = true;
+		return true;
+	}
+
+	r.symbolic = false;
+
+	return len >= GIT_OID_HEXSZ && git_oid_fromstrn(&r.oid, buf, GIT_OID_HEXSZ) == 0;
+}
+
+/*
+ * Collects the names of the loose refs below dir whose names start with
+ * prefix. Only the directory the prefix ends in is read, and below it only
+ * the entries matching the rest of the prefix.
+ */
+static void list_loose_refs(const std::string &gitdir, const std::string &dir,
+			    const std::string &filter, std::vector<std::string> &out)
+{
+	struct dirent *e;
+	DIR *d;
+
+	d = opendir((gitdir + dir).c_str());
+	if (d == NULL)
+		return;
+
+	while ((e = readdir(d)) != NULL) {
+		std::string name = dir + e->d_name;
+		unsigned char type = e->d_type;
+
+		if (e->d_name[0] == '.' || has_suffix(e->d_name, ".lock"))
+			continue;
+
+		if (strncmp(e->d_name, filter.c_str(), filter.size()) != 0)
+			continue;
+
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (stat((gitdir + name).c_str(), &st) < 0)
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+
+		if (type == DT_DIR)
+			list_loose_refs(gitdir, name + "/", "", out);
+		else if (type == DT_REG)
+			out.push_back(std::move(name));
+	}
+
+	closedir(d);
+}
+
+/* All files are read in one batch, which hides the latency of cold caches */
+static int read_loose_refs(const std::string &gitdir, const std::string &dir,
+			   const std::string &filter, std::vector<file_ref> &out)
+{
+	std::vector<std::string> names;
+	file_batch batch(LOOSE_REF_MAX);
+
+	list_loose_refs(gitdir, dir, filter, names);
+
+	for (auto &name : names)
+		batch.add(gitdir + name);
+
+	return batch.run([&](size_t i, int error, const char *data, size_t len) {
+		file_ref r;
+
+		if (error == 0 && parse_loose_ref(data, len, r)) {
+			r.name = std::move(names[i]);
+			out.push_back(std::move(r));
+		}
+	});
+}
+
+/* Start of the line p is in, or start if there is no line break before */
+static const char *line_start(const char *start, const char *p)
+{
+	while (p > start && p[-1] != '\n')
+		p--;
+
+	return p;
+}
+
+static const char *next_line(const char *p, const char *end)
+{
+	const char *nl = (const char *)memchr(p, '\n', end - p);
+
+	return nl ? nl + 1 : end;
+}
+
+/* Skips the peeled lines following a ref */
+static const char *next_ref(const char *p, const char *end)
+{
+	p = next_line(p, end);
+	while (p < end && *p == '^')
+		p = next_line(p, end);
+
+	return p;
+}
+
+/* Compares the ref name of a packed-refs line with prefix, up to its length */
+static int compare_packed(const char *line, const char *end, const std::string &prefix)
+{
+	const char *name = line + GIT_OID_HEXSZ + 1;
+	const char *eol = (const char *)memchr(name, '\n', end - name);
+	size_t len = (eol ? eol : end) - name;
+	int cmp;
+
+	cmp = memcmp(name, prefix.c_str(), std::min(len, prefix.size()));
+	if (cmp != 0 || len >= prefix.size())
+		return cmp;
+
+	return -1;
+}
+
+/*
+ * The first ref line in [start, end) whose name is not smaller than prefix.
+ * git writes packed-refs sorted, so this is a binary search over the lines.
+ */
+static const char *find_packed(const char *start, const char *end, const std::string &prefix)
+{
+	const char *lo = start, *hi = end;
+
+	while (lo < hi) {
+		const char *mid = line_start(lo, lo + (hi - lo) / 2);
+
+		/* Peeled lines belong to the ref line before them */
+		if (*mid == '^' && mid > lo)
+			mid = line_start(lo, mid - 1);
+
+		if (end - mid < PACKED_LINE_MIN)
+			return end;
+
+		if (compare_packed(mid, end, prefix) < 0)
+			lo = next_ref(mid, hi);
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Collects the packed refs whose names start with prefix, sorted by name */
+static void read_packed_refs(const std::string &path, const std::string &prefix,
+			     std::vector<file_ref> &out)
+{
+	const char *start, *end, *p;
+	bool sorted = false;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	start = (const char *)map;
+	end   = start + st.st_size;
+
+	if (end - start > (ssize_t)strlen(PACKED_HEADER) &&
+	    memcmp(start, PACKED_HEADER, strlen(PACKED_HEADER)) == 0) {
+		const char *eol = next_line(start, end);
+
+		sorted = memmem(start, eol - start, " sorted", 7) != NULL;
+		start  = eol;
+	}
+
+	/* Files written by old gits are scanned completely */
+	p = sorted ? find_packed(start, end, prefix) : start;
+
+	for (; end - p >= PACKED_LINE_MIN; p = next_ref(p, end)) {
+		const char *name = p + GIT_OID_HEXSZ + 1;
+		int cmp = compare_packed(p, end, prefix);
+		file_ref r;
+
+		if (cmp > 0 && sorted)
+			break;
+
+		if (cmp != 0 || p[GIT_OID_HEXSZ] != ' ' ||
+		    git_oid_fromstrn(&r.oid, p, GIT_OID_HEXSZ) < 0)
+			continue;
+
+		r.name.assign(name, next_line(name, end) - name);
+		if (r.name.back() == '\n')
+			r.name.pop_back();
+		r.symbolic = false;
+		out.push_back(std::move(r));
+	}
+
+	munmap(map, st.st_size);
+
+	if (!sorted) {
+		std::sort(out.begin(), out.end(), [](const file_ref &a, const file_ref &b) {
+			return a.name < b.name;
+		});
+	}
+}
+
+ref_store::ref_store()
+	: repo(NULL), reftable(NULL)
+{
+}
+
+ref_store::~ref_store()
+{
+	delete reftable;
+}
+
+int ref_store::open(git_repository *r)
+{
+	std::string gitdir = git_repository_commondir(r);
+
+	repo = r;
+
+	if (!reftable_exists(gitdir))
+		return 0;
+
+	reftable = new reftable_stack();
+	if (reftable->open(gitdir) < 0) {
+		delete reftable;
+		reftable = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * For the files backend, refs are read directly instead of through a
+ * libgit2 iterator, which would read all packed refs and match each of them.
+ * Here the cost only depends on the number of refs with the prefix: the
+ * packed refs are binary searched and only the loose ref directory of the
+ * prefix is read. Loose refs take precedence over packed ones of the same
+ * name, and refs are passed to cb sorted by name.
+ */
+int ref_store::foreach(const std::string &prefix, const ref_cb &cb)
+{
+	std::string gitdir = git_repository_commondir(repo);
+	std::vector<file_ref> loose, packed;
+	std::string::size_type slash;
+	size_t l = 0, p = 0;
+	int error = 0;
+
+	if (reftable) {
+		return reftable->foreach(prefix, [&cb](const reftable_ref &r) {
+			return cb(r.name.c_str(), r.type == REFTABLE_SYMREF ? NULL : &r.oid);
+		});
+	}
+
+	/* Loose refs only live below refs/ */
+	if (prefix.compare(0, 5, "refs/") == 0) {
+		slash = prefix.rfind('/');
+		error = read_loose_refs(gitdir, prefix.substr(0, slash + 1), prefix.substr(slash + 1), loose);
+	} else {
+		error = read_loose_refs(gitdir, "refs/", "", loose);
+		loose.erase(std::remove_if(loose.begin(), loose.end(), [&prefix](const file_ref &r) {
+			return r.name.compare(0, prefix.size(), prefix) != 0;
+		}), loose.end());
+	}
+
+	if (error < 0)
+		return error;
+
+	std::sort(loose.begin(), loose.end(), [](const file_ref &a, const file_ref &b) {
+		return a.name < b.name;
+	});
+
+	read_packed_refs(gitdir + "packed-refs", prefix, packed);
+
+	/* Merged by name, a loose ref replaces the packed one */
+	while (error == 0 && (l < loose.size() || p < packed.size())) {
+		const file_ref *r;
+
+		if (p == packed.size() || (l < loose.size() && loose[l].name <= packed[p].name)) {
+			if (p < packed.size() && loose[l].name == packed[p].name)
+				p++;
+			r = &loose[l++];
+		} else {
+			r = &packed[p++];
+		}
+
+		error = cb(r->name.c_str(), r->symbolic ? NULL : &r->oid);
+	}
+
+	return error;
+}
+
+int ref_store::lookup(const std::string &name, git_oid *out)
+{
+	std::string n = name;
+	reftable_ref r;
+	int error;
+
+	if (!reftable)
+		return git_reference_name_to_id(out, repo, name.c_str());
+
+	for (int depth = 0; depth < MAX_SYMREF_DEPTH; depth++) {
+		error = reftable->lookup(n, r);
+		if (error < 0)
+			return error;
+
+		if (r.type != REFTABLE_SYMREF) {
+			git_oid_cpy(out, &r.oid);
+			return 0;
+		}
+
+		n = r.target;
+	}
+
+	return GIT_ENOTFOUND;
+}
+
+int ref_store::lookup_peeled(const std::string &name, git_oid *out)
+{
+	git_object *obj, *peeled;
+	reftable_ref r;
+	int error;
+
+	/* reftable stores the peeled value of annotated tags */
+	if (reftable && reftable->lookup(name, r) == 0 && r.type == REFTABLE_VAL2) {
+		git_oid_cpy(out, &r.peeled);
+		return 0;
+	}
+
+	error = lookup(name, out);
+	if (error < 0)
+		return error;
+
+	error = git_object_lookup(&obj, repo, out, GIT_OBJ_ANY);
+	if (error < 0)
+		return error;
+
+	error = git_object_peel(&peeled, obj, GIT_OBJ_COMMIT);
+	if (error == 0) {
+		git_oid_cpy(out, git_object_id(peeled));
+		git_object_free(peeled);
+	}
+
+	git_object_free(obj);
+
+	return error;
+}
+
+std::string ref_store::head()
+{
+	git_reference *head;
+	std::string name;
+	reftable_ref r;
+
+	if (reftable) {
+		if (reftable->lookup("HEAD", r) == 0 && r.type == REFTABLE_SYMREF)
+			name = r.target;
+		return name;
+	}
+
+	if (git_repository_head(&head, repo) == 0) {
+		if (git_reference_is_branch(head))
+			name = git_reference_name(head);
+		git_reference_free(head);
+	}
+
+	return name;
+}
+
+bool lookup_target(const char *name, ref_store &refs, git_oid *out_oid)
+{
+	std::string n(name);
+
+	/* First check if it is a commit-id */
+	if (git_oid_fromstr(out_oid, name) == 0)
+		return true;
+
+	/* Check local and remote branches, then tags */
+	return refs.lookup("refs/heads/" + n, out_oid) == 0 ||
+	       refs.lookup("refs/remotes/" + n, out_oid) == 0 ||
+	       refs.lookup_peeled("refs/tags/" + n, out_oid) == 0;
+}
+
+void ref_store_init()
+{
+	const char *extensions[] = { "refstorage" };
+
+	/* Let libgit2 open repositories which keep their refs in reftables */
+	git_libgit2_opts(GIT_OPT_SET_EXTENSIONS, extensions, 1);
+}
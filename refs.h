@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * refs.h - Ref access for the files and the reftable ref backends
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __REFS_H
+#define __REFS_H
+
+#include <functional>
+#include <string>
+
+#include <git2.h>
+
+class reftable_stack;
+
+/* oid is NULL for symbolic refs */
+typedef std::function<int(const char *name, const git_oid *oid)> ref_cb;
+
+class ref_store {
+	git_repository *repo;
+	reftable_stack *reftable;
+
+public:
+	ref_store();
+	~ref_store();
+
+	int open(git_repository *repo);
+
+	bool is_reftable() const
+	{
+		return reftable != NULL;
+	}
+
+	/* Calls cb for every ref whose name starts with prefix */
+	int foreach(const std::string &prefix, const ref_cb &cb);
+
+	/* Resolves name to an object id, following symbolic refs */
+	int lookup(const std::string &name, git_oid *out);
+
+	/* Like lookup(), but peels annotated tags to the tagged object */
+	int lookup_peeled(const std::string &name, git_oid *out);
+
+	/* Full name of the branch HEAD points to, empty if detached */
+	std::string head();
+};
+
+/* Resolves a commit-id, branch, remote branch or tag name given by the user */
+bool lookup_target(const char *name, ref_store &refs, git_oid *out_oid);
+
+/* Must be called after git_libgit2_init() and before opening a repository */
+void ref_store_init();
+
+#endif
@@ -0,0 +1,488 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * reftable.cc - Read-only access to reftable ref storage
+ *
+ * Only the ref section of the tables is used, the obj and log sections are
+ * skipped. Lookups go through the ref index when the table has one and use
+ * a binary search over the restart points inside a block.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <fstream>
+#include <memory>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "reftable.h"
+
+#define REFTABLE_V1_HEADER	24
+#define REFTABLE_V2_HEADER	28
+#define REFTABLE_FOOTER_EXTRA	44
+
+#define BLOCK_TYPE_REF		'r'
+#define BLOCK_TYPE_INDEX	'i'
+
+static uint64_t get_be(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < bytes; i++)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+/* The varint encoding of reftable, same as the pack OFS_DELTA offsets */
+static bool get_varint(const unsigned char *&p, const unsigned char *end, uint64_t &v)
+{
+	if (p >= end)
+		return false;
+
+	v = *p & 0x7f;
+	while (*p++ & 0x80) {
+		if (p >= end)
+			return false;
+		v = ((v + 1) << 7) | (*p & 0x7f);
+	}
+
+	return true;
+}
+
+struct reftable_block {
+	size_t off;		// File offset of the block
+	size_t records;		// File offset of the first record
+	size_t restarts;	// File offset of the restart table
+	size_t next;		// File offset of the next block
+	unsigned restart_count;
+	char type;
+};
+
+struct reftable_iter {
+	const reftable_file *table;
+	reftable_block block;
+	size_t pos;
+	bool valid;
+
+	/* The record pos points to, if valid */
+	std::string key;
+	uint64_t value_type;
+	const unsigned char *value;
+
+	reftable_ref ref;
+
+	reftable_iter()
+		: table(NULL), pos(0), valid(false), value_type(0), value(NULL)
+	{}
+
+	bool decode();
+	bool decode_ref();
+	bool next();
+};
+
+/* Decodes the key at pos, the previous key is still in key */
+bool reftable_iter::decode()
+{
+	const unsigned char *p   = table->map + pos;
+	const unsigned char *end = table->map + block.restarts;
+	uint64_t prefix, suffix;
+
+	if (!get_varint(p, end, prefix) || !get_varint(p, end, suffix))
+		return false;
+
+	value_type = suffix & 7;
+	suffix >>= 3;
+
+	if (prefix > key.size() || p + suffix > end)
+		return false;
+
+	key.resize(prefix);
+	key.append((const char *)p, suffix);
+	value = p + suffix;
+
+	return true;
+}
+
+bool reftable_iter::decode_ref()
+{
+	const unsigned char *p   = value;
+	const unsigned char *end = table->map + block.restarts;
+	uint64_t update_index, len;
+
+	if (!get_varint(p, end, update_index))
+		return false;
+
+	ref.name = key;
+	ref.type = value_type;
+	ref.target.clear();
+
+	switch (value_type) {
+	case REFTABLE_DELETION:
+		break;
+	case REFTABLE_VAL1:
+	case REFTABLE_VAL2:
+		if (p + GIT_OID_RAWSZ > end)
+			return false;
+		git_oid_fromraw(&ref.oid, p);
+		p += GIT_OID_RAWSZ;
+		if (value_type == REFTABLE_VAL1)
+			break;
+		if (p + GIT_OID_RAWSZ > end)
+			return false;
+		git_oid_fromraw(&ref.peeled, p);
+		p += GIT_OID_RAWSZ;
+		break;
+	case REFTABLE_SYMREF:
+		if (!get_varint(p, end, len) || p + len > end)
+			return false;
+		ref.target.assign((const char *)p, len);
+		p += len;
+		break;
+	default:
+		return false;
+	}
+
+	/* Remember where the next record starts */
+	value = p;
+
+	return true;
+}
+
+/* Moves to the next ref, continuing in the following ref block if needed */
+bool reftable_iter::next()
+{
+	const unsigned char *p   = value;
+	const unsigned char *end = table->map + block.restarts;
+	uint64_t v;
+
+	/* Skip the value of index records, ref values are skipped by decode_ref() */
+	if (block.type == BLOCK_TYPE_INDEX && !get_varint(p, end, v))
+		return valid = false;
+
+	pos = p - table->map;
+
+	if (pos >= block.restarts) {
+		if (block.type != BLOCK_TYPE_REF || block.next >= table->refs_end ||
+		    !table->read_block(block.next, block) ||
+		    block.type != BLOCK_TYPE_REF)
+			return valid = false;
+
+		pos = block.records;
+		key.clear();
+	}
+
+	if (!decode())
+		return valid = false;
+
+	if (block.type == BLOCK_TYPE_REF && !decode_ref())
+		return valid = false;
+
+	return valid = true;
+}
+
+reftable_file::reftable_file()
+	: map(NULL), size(0), block_size(0), header_len(0), ref_index(0), refs_end(0)
+{
+}
+
+reftable_file::~reftable_file()
+{
+	if (map)
+		munmap((void *)map, size);
+}
+
+int reftable_file::open(const std::string &path)
+{
+	size_t footer_len, footer;
+	uint64_t obj_pos, log_pos;
+	struct stat st;
+	void *m;
+	int fd;
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < REFTABLE_V1_HEADER) {
+		close(fd);
+		return -1;
+	}
+
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+
+	map  = (const unsigned char *)m;
+	size = st.st_size;
+
+	if (memcmp(map, "REFT", 4) != 0)
+		return -1;
+
+	switch (map[4]) {
+	case 1:
+		header_len = REFTABLE_V1_HEADER;
+		break;
+	case 2:
+		header_len = REFTABLE_V2_HEADER;
+		/* Only SHA-1 repositories are supported */
+		if (memcmp(map + 24, "sha1", 4) != 0)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	footer_len = header_len + REFTABLE_FOOTER_EXTRA;
+	if (size < header_len + footer_len)
+		return -1;
+
+	footer     = size - footer_len;
+	block_size = get_be(map + 5, 3);
+	ref_index  = get_be(map + footer + header_len, 8);
+	obj_pos    = get_be(map + footer + header_len + 8, 8) >> 5;
+	log_pos    = get_be(map + footer + header_len + 24, 8);
+
+	/* The ref blocks end where the next section starts */
+	refs_end = footer;
+	if (ref_index)
+		refs_end = std::min<size_t>(refs_end, ref_index);
+	if (obj_pos)
+		refs_end = std::min<size_t>(refs_end, obj_pos);
+	if (log_pos)
+		refs_end = std::min<size_t>(refs_end, log_pos);
+
+	return 0;
+}
+
+bool reftable_file::read_block(size_t off, reftable_block &b) const
+{
+	size_t header = (off == 0) ? header_len : 0;
+	size_t len, end = size - header_len - REFTABLE_FOOTER_EXTRA;
+
+	if (off + header + 4 > end)
+		return false;
+
+	b.off  = off;
+	b.type = map[off + header];
+	len    = get_be(map + off + header + 1, 3);
+
+	if (len < header + 4 + 2 || off + len > end)
+		return false;
+
+	b.restart_count = get_be(map + off + len - 2, 2);
+	if (header + 4 + 2 + 3 * b.restart_count > len)
+		return false;
+
+	b.records  = off + header + 4;
+	b.restarts = off + len - 2 - 3 * b.restart_count;
+
+	/*
+	 * Blocks are either padded with zeroes to block_size or the next
+	 * block starts right after this one.
+	 */
+	if (block_size == 0 || len >= block_size ||
+	    (off + len < end && map[off + len] != 0))
+		b.next = off + len;
+	else
+		b.next = off + block_size;
+
+	return true;
+}
+
+/* Positions it at the first record in b with a key >= key */
+bool reftable_file::seek_block(const reftable_block &b, const std::string &key,
+			       reftable_iter &it) const
+{
+	unsigned lo = 0, hi = b.restart_count;
+
+	it.table = this;
+	it.block = b;
+
+	/* Find the last restart point with a key <= key */
+	while (hi - lo > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		it.key.clear();
+		it.pos = b.off + get_be(map + b.restarts + 3 * mid, 3);
+		if (!it.decode())
+			return it.valid = false;
+
+		if (it.key <= key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	it.key.clear();
+	it.pos = b.restart_count ? b.off + get_be(map + b.restarts + 3 * lo, 3) : b.records;
+
+	if (it.pos >= b.restarts)
+		return it.valid = false;
+
+	if (!it.decode() || (b.type == BLOCK_TYPE_REF && !it.decode_ref()))
+		return it.valid = false;
+
+	it.valid = true;
+
+	while (it.valid && it.key < key)
+		it.next();
+
+	return it.valid;
+}
+
+bool reftable_file::seek(const std::string &key, reftable_iter &it) const
+{
+	reftable_block b;
+
+	it.valid = false;
+
+	if (ref_index) {
+		if (!read_block(ref_index, b))
+			return false;
+
+		/* Index records carry the last key of the block they point to */
+		while (b.type == BLOCK_TYPE_INDEX) {
+			const unsigned char *p;
+			uint64_t child;
+
+			if (!seek_block(b, key, it))
+				return false;
+
+			p = it.value;
+			if (!get_varint(p, map + b.restarts, child) || !read_block(child, b))
+				return false;
+		}
+	} else {
+		reftable_block n;
+
+		if (!read_block(0, b))
+			return false;
+
+		/* No index, skip the blocks whose first key is still <= key */
+		while (b.next < refs_end && read_block(b.next, n) && n.type == BLOCK_TYPE_REF) {
+			it.table = this;
+			it.block = n;
+			it.key.clear();
+			it.pos = n.records;
+			if (!it.decode() || it.key > key)
+				break;
+			b = n;
+		}
+	}
+
+	if (b.type != BLOCK_TYPE_REF)
+		return false;
+
+	if (seek_block(b, key, it))
+		return true;
+
+	/* All keys in this block are smaller, continue with the next one */
+	if (b.next >= refs_end || !read_block(b.next, b) || b.type != BLOCK_TYPE_REF)
+		return false;
+
+	return seek_block(b, key, it);
+}
+
+reftable_stack::~reftable_stack()
+{
+	for (auto t : tables)
+		delete t;
+}
+
+int reftable_stack::open(const std::string &gitdir)
+{
+	std::ifstream list(gitdir + "/reftable/tables.list");
+	std::string name;
+
+	if (!list)
+		return -1;
+
+	while (std::getline(list, name)) {
+		std::unique_ptr<reftable_file> t(new reftable_file());
+
+		if (name.empty())
+			continue;
+
+		if (t->open(gitdir + "/reftable/" + name) < 0)
+			return -1;
+
+		tables.push_back(t.release());
+	}
+
+	return 0;
+}
+
+int reftable_stack::lookup(const std::string &name, reftable_ref &out) const
+{
+	/* Newer tables override older ones */
+	for (auto t = tables.rbegin(); t != tables.rend(); ++t) {
+		reftable_iter it;
+
+		if (!(*t)->seek(name, it) || it.ref.name != name)
+			continue;
+
+		if (it.ref.type == REFTABLE_DELETION)
+			break;
+
+		out = it.ref;
+
+		return 0;
+	}
+
+	return GIT_ENOTFOUND;
+}
+
+int reftable_stack::foreach(const std::string &prefix,
+			    const std::function<int(const reftable_ref &)> &cb) const
+{
+	std::vector<reftable_iter> its(tables.size());
+
+	for (size_t i = 0; i < tables.size(); i++)
+		tables[i]->seek(prefix, its[i]);
+
+	/* Merge the tables, on equal names the newest table wins */
+	while (true) {
+		const reftable_ref *ref = NULL;
+		int error;
+
+		for (auto it = its.rbegin(); it != its.rend(); ++it) {
+			if (!it->valid || it->ref.name.compare(0, prefix.size(), prefix) != 0)
+				continue;
+
+			if (ref == NULL || it->ref.name < ref->name)
+				ref = &it->ref;
+		}
+
+		if (ref == NULL)
+			break;
+
+		reftable_ref r = *ref;
+
+		for (auto &it : its) {
+			if (it.valid && it.ref.name == r.name)
+				it.next();
+		}
+
+		if (r.type == REFTABLE_DELETION)
+			continue;
+
+		error = cb(r);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+bool reftable_exists(const std::string &gitdir)
+{
+	struct stat st;
+
+	return stat((gitdir + "/reftable/tables.list").c_str(), &st) == 0;
+}
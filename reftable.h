@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * reftable.h - Read-only access to reftable ref storage
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __REFTABLE_H
+#define __REFTABLE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <git2.h>
+
+enum {
+	REFTABLE_DELETION	= 0,
+	REFTABLE_VAL1		= 1,
+	REFTABLE_VAL2		= 2,
+	REFTABLE_SYMREF		= 3,
+};
+
+struct reftable_ref {
+	std::string name;
+	uint8_t type;
+	git_oid oid;		// REFTABLE_VAL1 and REFTABLE_VAL2
+	git_oid peeled;		// REFTABLE_VAL2 only
+	std::string target;	// REFTABLE_SYMREF only
+};
+
+struct reftable_block;
+struct reftable_iter;
+
+/* One mmap'ed table file */
+class reftable_file {
+	const unsigned char *map;
+	size_t size;
+
+	uint32_t block_size;
+	size_t header_len;
+	uint64_t ref_index;
+	size_t refs_end;
+
+	friend struct reftable_iter;
+
+	bool read_block(size_t off, reftable_block &b) const;
+	bool seek_block(const reftable_block &b, const std::string &key,
+			reftable_iter &it) const;
+
+public:
+	reftable_file();
+	~reftable_file();
+
+	int open(const std::string &path);
+
+	/* Position it at the first ref >= key */
+	bool seek(const std::string &key, reftable_iter &it) const;
+};
+
+/* The stack of tables listed in reftable/tables.list */
+class reftable_stack {
+	std::vector<reftable_file *> tables;	// Oldest first
+
+public:
+	~reftable_stack();
+
+	int open(const std::string &gitdir);
+
+	/* Returns GIT_ENOTFOUND if there is no such ref */
+	int lookup(const std::string &name, reftable_ref &out) const;
+
+	/* Calls cb in name order for all refs starting with prefix */
+	int foreach(const std::string &prefix,
+		    const std::function<int(const reftable_ref &)> &cb) const;
+};
+
+bool reftable_exists(const std::string &gitdir);
+
+#endif
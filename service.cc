@@ -0,0 +1,736 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * service.cc - Resident git-recent with a change feed for subscribers
+ *
+ * The service runs a single poll loop. Ref changes are collected from
+ * inotify until the refs were quiet for a moment, then all refs are listed
+ * again and compared with the branches in memory. Only branches which were
+ * created or moved need their commit looked up, so a rescan costs about as
+ * much as listing the refs. Branches are described one at a time between
+ * polls, newest changes first, so clients keep getting events meanwhile.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <chrono>
+
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+
+#include "service.h"
+
+/* Refs are rescanned when inotify was quiet for this long */
+#define QUIET_MS		50
+/* ... but not later than this after the first change */
+#define MAX_DELAY_MS		1000
+
+/* Clients not reading their events are dropped */
+#define MAX_CLIENT_BUFFER	(64UL << 20)
+
+#define WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+
+static volatile sig_atomic_t stopping;
+
+static void stop_handler(int sig)
+{
+	stopping = 1;
+}
+
+static void json_string(std::string &out, const std::string &s)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	out += '"';
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			out += "\\u00";
+			out += hex[c >> 4];
+			out += hex[c & 15];
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+std::string service_socket_path(git_repository *repo)
+{
+	return std::string(git_repository_commondir(repo)) + "git-tools/recent.sock";
+}
+
+static bool socket_address(const std::string &path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr->sun_path)) {
+		std::cerr << "Error: Socket path too long: " << path << std::endl;
+		return false;
+	}
+
+	memcpy(addr->sun_path, path.c_str(), path.size());
+
+	return true;
+}
+
+recent_service::recent_service(git_repository *r, const std::vector<std::string> &ns,
+			       const std::string &p, const describe_options &o, bool d, bool a,
+			       const commit_graph *g, describe_index *i)
+	: repo(r), namespaces(ns), prefix(p), opts(o), describe(d), approx(a), graph(g),
+	  index(i), tags(NULL), listen_fd(-1), inotify_fd(-1)
+{
+}
+
+recent_service::~recent_service()
+{
+	for (auto &c : clients)
+		close(c.fd);
+
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(socket_path.c_str());
+	}
+
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+}
+
+/* Watches dir and all directories below it, for loose refs */
+int recent_service::watch_tree(const std::string &dir)
+{
+	struct dirent *e;
+	DIR *d;
+	int error;
+
+	error = watch_dir(dir, false);
+	if (error < 0)
+		return error;
+
+	d = opendir(dir.c_str());
+	if (d == NULL)
+		return 0;
+
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_type != DT_DIR || strcmp(e->d_name, ".") == 0 ||
+		    strcmp(e->d_name, "..") == 0)
+			continue;
+
+		error = watch_tree(dir + e->d_name + "/");
+		if (error < 0)
+			break;
+	}
+
+	closedir(d);
+
+	return error;
+}
+
+/*
+ * In git directories only changes of HEAD and packed-refs matter, index
+ * and lock file updates would cause rescans for nothing.
+ */
+int recent_service::watch_dir(const std::string &dir, bool git_dir)
+{
+	int wd;
+
+	wd = inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+	if (wd < 0)
+		return errno == ENOENT ? 0 : -1;
+
+	watches[wd] = std::make_pair(dir, git_dir);
+
+	return 0;
+}
+
+/* Returns true if a ref may have changed */
+bool recent_service::read_inotify()
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			const struct inotify_event *e = (const struct inotify_event *)p;
+			auto it = watches.find(e->wd);
+
+			p += sizeof(*e) + e->len;
+
+			if (e->mask & IN_IGNORED) {
+				if (it != watches.end())
+					watches.erase(it);
+				continue;
+			}
+
+			if (it == watches.end())
+				continue;
+
+			if (it->second.second) {
+				if (e->len && (strcmp(e->name, "HEAD") == 0 ||
+					       strcmp(e->name, "packed-refs") == 0))
+					changed = true;
+				continue;
+			}
+
+			if ((e->mask & (IN_CREATE | IN_ISDIR)) == (IN_CREATE | IN_ISDIR))
+				watch_tree(it->second.first + e->name + "/");
+
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/* All tags with their ids, to notice any change of them */
+int recent_service::read_tags(ref_store &refs, std::string &state)
+{
+	state.clear();
+
+	return refs.foreach("refs/tags/", [&state](const char *refname, const git_oid *oid) {
+		state += refname;
+		state += '\0';
+		if (oid)
+			state.append((const char *)oid->id, GIT_OID_RAWSZ);
+		return 0;
+	});
+}
+
+size_t recent_service::position(const branch &b) const
+{
+	return order.order_of_key(&b);
+}
+
+void recent_service::branch_event(const char *type, const branch &b, size_t pos,
+				  std::string &out) const
+{
+	char hex[GIT_OID_HEXSZ];
+
+	git_oid_fmt(hex, &b.oid);
+
+	out += "{\"event\":\"";
+	out += type;
+	out += "\",\"ref\":";
+	json_string(out, b.ref);
+	out += ",\"name\":";
+	json_string(out, b.name);
+	out += ",\"oid\":\"";
+	out.append(hex, GIT_OID_HEXSZ);
+	out += "\",\"date\":";
+	out += std::to_string((long long)b.last);
+	out += ",\"current\":";
+	out += b.current ? "true" : "false";
+	out += ",\"index\":";
+	out += std::to_string(pos);
+	if (describe && !b.pending) {
+		out += ",\"describe\":";
+		json_string(out, b.describe);
+	}
+	out += "}\n";
+}
+
+void recent_service::broadcast(const std::string &line)
+{
+	for (auto &c : clients)
+		c.out += line;
+}
+
+void recent_service::accept_client()
+{
+	std::string line;
+	size_t pos = 0;
+	client c;
+
+	c.sent = 0;
+	c.fd   = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (c.fd < 0)
+		return;
+
+	/* The current list, so the client never has to scan itself */
+	for (auto b : order)
+		branch_event("created", *b, pos++, c.out);
+
+	line = "{\"event\":\"synced\",\"head\":";
+	json_string(line, head);
+	line += ",\"branches\":" + std::to_string(order.size()) + "}\n";
+	c.out += line;
+
+	clients.push_back(std::move(c));
+}
+
+/* Returns false if the client went away or does not keep up */
+bool recent_service::flush_client(client &c)
+{
+	while (c.sent < c.out.size()) {
+		ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		c.sent += n;
+	}
+
+	if (c.sent == c.out.size()) {
+		c.out.clear();
+		c.sent = 0;
+	}
+
+	return c.out.size() - c.sent <= MAX_CLIENT_BUFFER;
+}
+
+int recent_service::rescan()
+{
+	std::unordered_map<std::string, std::pair<git_oid, std::string>> now;
+	std::string line, new_head, state;
+	ref_store refs;
+	int error;
+
+	error = refs.open(repo);
+	if (error < 0)
+		return error;
+
+	for (auto &ns : namespaces) {
+		error = refs.foreach(ns + prefix, [&](const char *refname, const git_oid *oid) {
+			if (oid)
+				now[refname] = std::make_pair(*oid, std::string(refname + name_offset(ns)));
+			return 0;
+		});
+		if (error < 0)
+			return error;
+	}
+
+	new_head = refs.head();
+	if (new_head != head) {
+		auto old_it = branches.find(head);
+		auto new_it = branches.find(new_head);
+
+		if (old_it != branches.end())
+			old_it->second.current = false;
+		if (new_it != branches.end())
+			new_it->second.current = true;
+
+		head = new_head;
+		line = "{\"event\":\"head\",\"ref\":";
+		json_string(line, head);
+		line += "}\n";
+		broadcast(line);
+	}
+
+	for (auto it = branches.begin(); it != branches.end(); ) {
+		if (now.find(it->first) != now.end()) {
+			++it;
+			continue;
+		}
+
+		line.clear();
+		line += "{\"event\":\"deleted\",\"ref\":";
+		json_string(line, it->second.ref);
+		line += ",\"name\":";
+		json_string(line, it->second.name);
+		line += "}\n";
+		broadcast(line);
+
+		order.erase(&it->second);
+		it = branches.erase(it);
+	}
+
+	for (auto &r : now) {
+		auto it = branches.find(r.first);
+		const char *type = "moved";
+		git_commit *commit;
+		time_t last;
+
+		if (it != branches.end() && git_oid_equal(&it->second.oid, &r.second.first))
+			continue;
+
+		/* Refs to commits not there (yet) are left for the next scan */
+		if (git_commit_lookup(&commit, repo, &r.second.first) < 0)
+			continue;
+
+		last = static_cast<time_t>(git_commit_time(commit));
+		git_commit_free(commit);
+
+		if (it == branches.end()) {
+			branch b(r.first, r.second.second, r.first == head, last, r.second.first);
+
+			it   = branches.emplace(r.first, std::move(b)).first;
+			type = "created";
+		} else {
+			order.erase(&it->second);
+			it->second.oid  = r.second.first;
+			it->second.last = last;
+			it->second.describe.clear();
+		}
+
+		order.insert(&it->second);
+
+		if (describe && !it->second.pending) {
+			it->second.pending = true;
+			queue.push_front(std::make_pair(it->first, false));
+		}
+
+		line.clear();
+		branch_event(type, it->second, position(it->second), line);
+		broadcast(line);
+	}
+
+	if (!describe)
+		return 0;
+
+	error = read_tags(refs, state);
+	if (error < 0)
+		return error;
+
+	if (state == tag_state)
+		return 0;
+
+	/* New tags can change any description, they are all redone */
+	std::unique_ptr<tag_table> table(new tag_table());
+
+	error = table->build(repo, refs, opts);
+	if (error < 0)
+		return error;
+
+	/*
+	 * The results so far refer to the old table, so they are saved before
+	 * the index drops the ones the new tags change.
+	 */
+	if (index) {
+		index->save();
+		error = index->load(repo, *table, opts, graph);
+		if (error < 0)
+			return error;
+	}
+
+	exact.reset(new describer(repo, *table, opts, graph));
+	approximate.reset(new approx_describer(repo, *table, opts, graph));
+	own_tags  = std::move(table);
+	tags      = own_tags.get();
+	tag_state = state;
+
+	/* Descriptions are kept until redone, pending branches are queued already */
+	for (auto b : order) {
+		if (!b->pending)
+			queue.push_back(std::make_pair(b->ref, true));
+	}
+
+	return 0;
+}
+
+void recent_service::describe_next()
+{
+	const tag_table::tag *tag;
+	std::string line, desc;
+	unsigned depth;
+	int error;
+
+	auto it   = branches.find(queue.front().first);
+	bool redo = queue.front().second;
+
+	queue.pop_front();
+
+	/* Moved meanwhile, then there is an entry to describe it anyway */
+	if (it == branches.end() || it->second.pending == redo)
+		return;
+
+	branch &b = it->second;
+
+	if (index && index->lookup(&b.oid, &tag, &depth)) {
+		error = tag ? 0 : GIT_ENOTFOUND;
+	} else {
+		if (approx)
+			error = approximate->describe(&b.oid, &tag, &depth);
+		else
+			error = exact->describe(&b.oid, &tag, &depth);
+
+		if (error == 0 && index)
+			index->add(&b.oid, tag, depth);
+		else if (error == GIT_ENOTFOUND && index)
+			index->add(&b.oid, NULL, 0);
+	}
+
+	/* Saved whenever all branches are described */
+	if (index && queue.empty())
+		index->save();
+
+	if (error == 0 && approx) {
+		approximate->format(&b.oid, tag, depth, desc);
+	} else if (error == 0) {
+		exact->format(&b.oid, tag, depth, desc);
+	} else if (error != GIT_ENOTFOUND) {
+		const git_error *e = giterr_last();
+
+		std::cerr << "Error: Can't describe " << b.name << ": "
+			  << (e ? e->message : "unknown error") << std::endl;
+	}
+
+	b.pending = false;
+
+	/* Most descriptions stay the same when tags change */
+	if (redo && desc == b.describe)
+		return;
+
+	b.describe = desc;
+
+	line = "{\"event\":\"described\",\"ref\":";
+	json_string(line, b.ref);
+	line += ",\"name\":";
+	json_string(line, b.name);
+	line += ",\"describe\":";
+	json_string(line, b.describe);
+	line += "}\n";
+	broadcast(line);
+}
+
+int recent_service::run(std::vector<branch> &initial, tag_table &t)
+{
+	std::string commondir = git_repository_commondir(repo);
+	std::string gitdir    = git_repository_path(repo);
+	auto dirty_since      = std::chrono::steady_clock::now();
+	bool dirty            = false;
+	struct sockaddr_un addr;
+	std::vector<struct pollfd> fds;
+	struct sigaction sa;
+	sigset_t block, wait_mask;
+	ref_store refs;
+	int error;
+
+	/* Stopping removes the socket, signals only arrive while polling */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigprocmask(SIG_BLOCK, &block, &wait_mask);
+
+	socket_path = service_socket_path(repo);
+	if (!socket_address(socket_path, &addr))
+		return 1;
+
+	mkdir((commondir + "git-tools").c_str(), 0777);
+
+	/* A socket nobody listens on is left over from a service gone */
+	{
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			close(fd);
+			std::cerr << "Error: git-recent is already serving " << commondir << std::endl;
+			return 1;
+		}
+		if (fd >= 0)
+			close(fd);
+		unlink(socket_path.c_str());
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 16) < 0) {
+		std::cerr << "Error: Can't listen on " << socket_path << ": " << strerror(errno) << std::endl;
+		if (listen_fd >= 0) {
+			close(listen_fd);
+			listen_fd = -1;
+		}
+		return 1;
+	}
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		std::cerr << "Error: Can't watch refs: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	/* Watched before the refs are read again, so no change is missed */
+	error = 0;
+	for (auto &ns : namespaces)
+		error |= watch_tree(commondir + ns.substr(0, name_offset(ns)));
+	if (describe)
+		error |= watch_tree(commondir + "refs/tags/");
+	error |= watch_tree(commondir + "reftable/");
+	error |= watch_dir(commondir, true);
+	if (gitdir != commondir)
+		error |= watch_dir(gitdir, true);
+	if (error < 0) {
+		std::cerr << "Error: Can't watch refs: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	for (auto &b : initial) {
+		auto it = branches.emplace(b.ref, std::move(b)).first;
+
+		order.insert(&it->second);
+		if (it->second.current)
+			head = it->first;
+	}
+	initial.clear();
+
+	if (describe) {
+		error = refs.open(repo);
+		if (error < 0)
+			return error;
+
+		error = read_tags(refs, tag_state);
+		if (error < 0)
+			return error;
+
+		tags = &t;
+		exact.reset(new describer(repo, *tags, opts, graph));
+		approximate.reset(new approx_describer(repo, *tags, opts, graph));
+
+		for (auto b : order) {
+			branches[b->ref].pending = true;
+			queue.push_back(std::make_pair(b->ref, false));
+		}
+	}
+
+	/* Changes between the first scan and the watches being set up */
+	error = rescan();
+	if (error < 0)
+		return error;
+
+	while (!stopping) {
+		auto now = std::chrono::steady_clock::now();
+		struct timespec ts, *tsp = NULL;
+		int timeout = -1;
+		int n;
+
+		if (dirty) {
+			auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(now - dirty_since);
+
+			timeout = waited.count() >= MAX_DELAY_MS ? 0 : QUIET_MS;
+		} else if (!queue.empty()) {
+			timeout = 0;
+		}
+
+		fds.clear();
+		fds.push_back({ listen_fd, POLLIN, 0 });
+		fds.push_back({ inotify_fd, POLLIN, 0 });
+		for (auto &c : clients)
+			fds.push_back({ c.fd, (short)(POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0 });
+
+		if (timeout >= 0) {
+			ts.tv_sec  = 0;
+			ts.tv_nsec = timeout * 1000000L;
+			tsp        = &ts;
+		}
+
+		n = ppoll(fds.data(), fds.size(), tsp, &wait_mask);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Error: poll failed: " << strerror(errno) << std::endl;
+			return 1;
+		}
+
+		/* Clients only ever send to close the connection */
+		for (size_t i = clients.size(); i-- > 0; ) {
+			short revents = fds[i + 2].revents;
+			bool keep = true;
+
+			if (revents & (POLLIN | POLLHUP | POLLERR)) {
+				char buf[256];
+
+				keep = read(clients[i].fd, buf, sizeof(buf)) > 0;
+			}
+
+			if (keep && (revents & POLLOUT))
+				keep = flush_client(clients[i]);
+
+			if (!keep) {
+				close(clients[i].fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_client();
+
+		if ((fds[1].revents & POLLIN) && read_inotify()) {
+			if (!dirty)
+				dirty_since = now;
+			dirty = true;
+
+			/* Wait for the refs to become quiet, up to MAX_DELAY_MS */
+			if (std::chrono::steady_clock::now() - dirty_since <
+			    std::chrono::milliseconds(MAX_DELAY_MS))
+				continue;
+		}
+
+		if (dirty && (n == 0 || std::chrono::steady_clock::now() - dirty_since >=
+					std::chrono::milliseconds(MAX_DELAY_MS))) {
+			dirty = false;
+
+			error = rescan();
+			if (error < 0)
+				return error;
+		} else if (!dirty && !queue.empty()) {
+			describe_next();
+		}
+
+		/* Events are written right away, most clients keep up */
+		for (size_t i = clients.size(); i-- > 0; ) {
+			if (!flush_client(clients[i])) {
+				close(clients[i].fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int subscribe(git_repository *repo)
+{
+	std::string path = service_socket_path(repo);
+	struct sockaddr_un addr;
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	if (!socket_address(path, &addr))
+		return 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		std::cerr << "Error: No git-recent --serve running for this repository" << std::endl;
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fwrite(buf, 1, n, stdout) != (size_t)n || fflush(stdout) != 0)
+			break;
+	}
+
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * service.h - Resident git-recent with a change feed for subscribers
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __SERVICE_H
+#define __SERVICE_H
+
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <map>
+
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#include <git2.h>
+
+#include "commitgraph.h"
+#include "descindex.h"
+#include "describe.h"
+#include "branch.h"
+#include "refs.h"
+
+/*
+ * Keeps the sorted branch list in memory and updates it when refs change,
+ * as reported by inotify. Clients connect to a Unix socket and get one JSON
+ * object per line: the current list as "created" events, a "synced" event,
+ * and then an event for every branch created, moved or deleted, every new
+ * description and every change of HEAD.
+ */
+class recent_service {
+	struct client {
+		int fd;
+		std::string out;
+		size_t sent;		// Bytes of out already written
+	};
+
+	/* Same order as branch::operator< */
+	struct order_less {
+		bool operator()(const branch *a, const branch *b) const
+		{
+			return *a < *b;
+		}
+	};
+
+	git_repository *repo;
+	std::vector<std::string> namespaces;
+	std::string prefix;
+	const describe_options &opts;
+	bool describe;
+	bool approx;
+	const commit_graph *graph;
+	describe_index *index;
+
+	/*
+	 * Replaced as a whole when tags change. Until then it is the table of
+	 * the caller, which the index was loaded for.
+	 */
+	const tag_table *tags;
+	std::unique_ptr<tag_table> own_tags;
+	std::unique_ptr<describer> exact;
+	std::unique_ptr<approx_describer> approximate;
+	std::string tag_state;
+
+	std::map<std::string, branch> branches;		// By ref name
+	/* Knows the rank of every node, for the positions in the events */
+	__gnu_pbds::tree<const branch *, __gnu_pbds::null_type, order_less, __gnu_pbds::rb_tree_tag,
+			 __gnu_pbds::tree_order_statistics_node_update> order;
+	/* Refs to describe, true to redo the description after tag changes */
+	std::deque<std::pair<std::string, bool>> queue;
+	std::string head;
+
+	std::string socket_path;
+	int listen_fd;
+	int inotify_fd;
+	std::unordered_map<int, std::pair<std::string, bool>> watches;
+	std::vector<client> clients;
+
+	int watch_tree(const std::string &dir);
+	int watch_dir(const std::string &dir, bool git_dir);
+	bool read_inotify();
+
+	int read_tags(ref_store &refs, std::string &state);
+	int rescan();
+	void describe_next();
+
+	size_t position(const branch &b) const;
+	void branch_event(const char *type, const branch &b, size_t pos, std::string &out) const;
+	void broadcast(const std::string &line);
+	void accept_client();
+	bool flush_client(client &c);
+
+public:
+	recent_service(git_repository *r, const std::vector<std::string> &ns,
+		       const std::string &p, const describe_options &o, bool d, bool a,
+		       const commit_graph *g, describe_index *i);
+
+	~recent_service();
+
+	/*
+	 * Takes over the scanned branches and serves them until an error
+	 * occurs. tags is the table the index was loaded for.
+	 */
+	int run(std::vector<branch> &initial, tag_table &tags);
+};
+
+/* Socket of the service of the repository */
+std::string service_socket_path(git_repository *repo);
+
+/* Copies the events of the running service to stdout until it goes away */
+int subscribe(git_repository *repo);
+
+#endif
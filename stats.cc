@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * stats.cc - Time and heap usage per phase of a run
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+#include <string.h>
+
+#include "stats.h"
+
+void run_stats::begin(const char *name)
+{
+	end();
+
+	for (current = 0; current < phases.size(); current++) {
+		if (phases[current].name == name)
+			break;
+	}
+
+	if (current == phases.size()) {
+		phase p;
+
+		memset(&p.alloc, 0, sizeof(p.alloc));
+		memset(&p.perf, 0, sizeof(p.perf));
+		p.name = name;
+		p.ns   = 0;
+
+		phases.push_back(p);
+	}
+
+	phase &p = phases[current];
+
+	/* Peak live bytes are reported per phase */
+	alloc_reset_peak();
+
+	p.alloc_start = alloc_counters_get();
+	if (perf)
+		perf->read(p.perf_start);
+	p.start = std::chrono::steady_clock::now();
+
+	running = true;
+}
+
+void run_stats::end()
+{
+	auto now = std::chrono::steady_clock::now();
+	alloc_counters c;
+	perf_values v;
+
+	if (!running)
+		return;
+
+	/* Read first, so the phase is not charged for the bookkeeping */
+	if (perf)
+		perf->read(v);
+	c = alloc_counters_get();
+
+	phase &p = phases[current];
+
+	p.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - p.start).count();
+	p.alloc.count += c.count - p.alloc_start.count;
+	p.alloc.bytes += c.bytes - p.alloc_start.bytes;
+	p.alloc.live  += c.live - p.alloc_start.live;
+	p.alloc.peak   = std::max(p.alloc.peak, c.peak);
+
+	for (int i = 0; perf && i < COUNTER_MAX; i++)
+		p.perf.v[i] += v.v[i] - p.perf_start.v[i];
+
+	running = false;
+}
+
+static std::string format_bytes(long long bytes)
+{
+	static const char *units[] = { "B", "KiB", "MiB", "GiB" };
+	double value = bytes;
+	std::ostringstream os;
+	unsigned i = 0;
+
+	while ((value >= 1024.0 || value <= -1024.0) && i < 3) {
+		value /= 1024.0;
+		i++;
+	}
+
+	os << std::fixed << std::setprecision(i ? 1 : 0) << value << units[i];
+
+	return os.str();
+}
+
+/* Counters are shown with decimal unit prefixes, like perf does */
+static std::string format_count(unsigned long long count)
+{
+	static const char *units[] = { "", "K", "M", "G", "T" };
+	double value = count;
+	std::ostringstream os;
+	unsigned i = 0;
+
+	while (value >= 1000.0 && i < 4) {
+		value /= 1000.0;
+		i++;
+	}
+
+	os << std::fixed << std::setprecision(i ? 1 : 0) << value << units[i];
+
+	return os.str();
+}
+
+void run_stats::print(std::ostream &os)
+{
+	unsigned long long total_ns = 0;
+
+	end();
+
+	os << std::left << std::setw(12) << "phase"
+	   << std::right << std::setw(12) << "time"
+	   << std::setw(12) << "allocs"
+	   << std::setw(12) << "bytes"
+	   << std::setw(12) << "peak";
+	if (perf) {
+		os << std::setw(12) << "cycles"
+		   << std::setw(12) << "instr"
+		   << std::setw(8)  << "IPC"
+		   << std::setw(12) << "cache-miss"
+		   << std::setw(12) << "branch-miss";
+	}
+	os << std::endl;
+
+	for (auto &p : phases) {
+		std::ostringstream ms;
+
+		ms << std::fixed << std::setprecision(1) << p.ns / 1000000.0 << "ms";
+		total_ns += p.ns;
+
+		os << std::left << std::setw(12) << p.name
+		   << std::right << std::setw(12) << ms.str()
+		   << std::setw(12) << p.alloc.count
+		   << std::setw(12) << format_bytes(p.alloc.bytes)
+		   << std::setw(12) << format_bytes(p.alloc.peak);
+
+		if (perf) {
+			const uint64_t *v = p.perf.v;
+			std::ostringstream ipc;
+
+			if (perf->available(COUNTER_CYCLES) && perf->available(COUNTER_INSTRUCTIONS) &&
+			    v[COUNTER_CYCLES])
+				ipc << std::fixed << std::setprecision(2)
+				    << (double)v[COUNTER_INSTRUCTIONS] / v[COUNTER_CYCLES];
+			else
+				ipc << "-";
+
+			for (int i = 0; i < COUNTER_MAX; i++) {
+				os << std::setw(12) << (perf->available((perf_counter)i) ? format_count(v[i]) : "-");
+				if (i == COUNTER_INSTRUCTIONS)
+					os << std::setw(8) << ipc.str();
+			}
+		}
+
+		os << std::endl;
+	}
+
+	os << std::left << std::setw(12) << "total"
+	   << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+	   << total_ns / 1000000.0 << "ms" << std::endl;
+
+	if (perf && perf->only_user())
+		os << "Counters only include user space" << std::endl;
+}
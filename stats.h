@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * stats.h - Time and heap usage per phase of a run
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <ostream>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "perfcount.h"
+#include "alloc.h"
+
+class run_stats {
+	struct phase {
+		std::string name;
+		std::chrono::steady_clock::time_point start;
+		alloc_counters alloc_start;
+		perf_values perf_start;
+		alloc_counters alloc;
+		perf_values perf;
+		unsigned long long ns;
+	};
+
+	std::vector<phase> phases;
+	size_t current;
+	bool running;
+	const perf_counters *perf;
+
+public:
+	run_stats()
+		: current(0), running(false), perf(NULL)
+	{}
+
+	/* Also report the counters per phase, with the IPC */
+	void use_counters(const perf_counters *p)
+	{
+		perf = p;
+	}
+
+	/*
+	 * Ends the running phase, if any, and starts a new one. A phase which
+	 * is entered again, like per branch, adds to its earlier numbers.
+	 */
+	void begin(const char *name);
+	void end();
+
+	void print(std::ostream &os);
+};
+
+#endif
@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * trace.cc - Spans of work in the Chrome trace event format
+ *
+ * Every thread records its spans into its own buffer, which only it writes
+ * to. The lock of a buffer is only contended while the trace is written.
+ * Span names are not copied, arguments are appended to one string per
+ * thread, so recording a span usually does not allocate.
+ *
+ * The file can be loaded into chrome://tracing or ui.perfetto.dev.
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#include <iostream>
+#include <vector>
+#include <string>
+#include <mutex>
+
+#include <sys/syscall.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace_event {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	uint32_t arg;		// Offset in args, or NO_ARG
+};
+
+#define NO_ARG		0xffffffffU
+
+struct trace_buffer {
+	std::mutex lock;
+	std::vector<trace_event> events;
+	std::string args;	// Zero terminated arguments
+	const char *name;
+	long tid;
+};
+
+std::atomic<bool> trace_enabled(false);
+
+static FILE *trace_file;
+static uint64_t trace_start;
+static std::mutex buffers_lock;
+static std::vector<trace_buffer *> buffers;	// Never freed, threads may exit early
+static thread_local trace_buffer *local;
+
+static trace_buffer *local_buffer()
+{
+	if (local == NULL) {
+		local = new trace_buffer;
+		local->name = NULL;
+		local->tid  = syscall(SYS_gettid);
+
+		std::lock_guard<std::mutex> guard(buffers_lock);
+		buffers.push_back(local);
+	}
+
+	return local;
+}
+
+uint64_t trace_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		std::cerr << "Error: Can't create trace file " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	trace_start   = trace_now();
+	trace_enabled = true;
+
+	return true;
+}
+
+void trace_thread(const char *name)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_buffer *b = local_buffer();
+	std::lock_guard<std::mutex> guard(b->lock);
+
+	b->name = name;
+}
+
+void trace_add(const char *name, const char *arg, uint64_t start, uint64_t end)
+{
+	trace_buffer *b = local_buffer();
+	std::lock_guard<std::mutex> guard(b->lock);
+	trace_event e;
+
+	e.name  = name;
+	e.start = start;
+	e.end   = end;
+	e.arg   = NO_ARG;
+
+	if (arg) {
+		e.arg = b->args.size();
+		b->args.append(arg, strlen(arg) + 1);
+	}
+
+	b->events.push_back(e);
+}
+
+static void append_json_string(std::string &out, const char *s)
+{
+	out += '"';
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char buf[8];
+
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+
+	out += '"';
+}
+
+/* Microseconds since the start of the trace, with nanosecond precision */
+static void append_us(std::string &out, uint64_t ns)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu.%03llu", (unsigned long long)(ns / 1000),
+		 (unsigned long long)(ns % 1000));
+	out += buf;
+}
+
+int trace_write()
+{
+	long pid = getpid();
+	std::string out;
+	bool first = true;
+	char buf[64];
+	int error;
+
+	if (!trace_enabled)
+		return 0;
+
+	out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+	std::lock_guard<std::mutex> guard(buffers_lock);
+
+	for (auto b : buffers) {
+		std::lock_guard<std::mutex> buffer_guard(b->lock);
+
+		snprintf(buf, sizeof(buf), ",\"pid\":%ld,\"tid\":%ld", pid, b->tid);
+
+		if (b->name) {
+			out += first ? "" : ",\n";
+			out += "{\"name\":\"thread_name\",\"ph\":\"M\"";
+			out += buf;
+			out += ",\"args\":{\"name\":";
+			append_json_string(out, b->name);
+			out += "}}";
+			first = false;
+		}
+
+		for (auto &e : b->events) {
+			out += first ? "" : ",\n";
+			out += "{\"name\":";
+			append_json_string(out, e.name);
+			out += ",\"ph\":\"X\",\"ts\":";
+			append_us(out, e.start - trace_start);
+			out += ",\"dur\":";
+			append_us(out, e.end - e.start);
+			out += buf;
+			if (e.arg != NO_ARG) {
+				out += ",\"args\":{\"name\":";
+				append_json_string(out, b->args.c_str() + e.arg);
+				out += "}";
+			}
+			out += "}";
+			first = false;
+		}
+	}
+
+	out += "\n]}\n";
+
+	/* Spans ending later, like of detached workers, are dropped */
+	trace_enabled = false;
+
+	error = fwrite(out.data(), 1, out.size(), trace_file) != out.size();
+	error = fclose(trace_file) != 0 || error;
+	trace_file = NULL;
+
+	if (error) {
+		std::cerr << "Error: Can't write trace file: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
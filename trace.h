@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * trace.h - Spans of work in the Chrome trace event format
+ *
+ * Copyright (C) 2021 SUSE
+ *
+ * Author: Joerg Roedel <jroedel@suse.de>
+ */
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <atomic>
+
+#include <stdint.h>
+
+extern std::atomic<bool> trace_enabled;
+
+/*
+ * Starts tracing into path, which is written by trace_write(). Must be
+ * called before any thread is started. Prints an error and returns false
+ * if the file can't be created.
+ */
+bool trace_open(const char *path);
+
+/* Names the calling thread in the trace, name must stay valid */
+void trace_thread(const char *name);
+
+/* Writes all spans recorded so far, threads may still add spans meanwhile */
+int trace_write();
+
+uint64_t trace_now();
+void trace_add(const char *name, const char *arg, uint64_t start, uint64_t end);
+
+/*
+ * One unit of work, from its construction to its destruction or to end().
+ * name must be a string literal, arg, usually the branch, must stay valid
+ * until the span ends. Costs a branch while tracing is disabled.
+ */
+class trace_span {
+	const char *name;
+	const char *arg;
+	uint64_t start;
+
+public:
+	explicit trace_span(const char *n, const char *a = NULL)
+		: name(n), arg(a), start(trace_enabled ? trace_now() : 0)
+	{}
+
+	~trace_span()
+	{
+		end();
+	}
+
+	void end()
+	{
+		if (start) {
+			trace_add(name, arg, start, trace_now());
+			start = 0;
+		}
+	}
+};
+
+#endif